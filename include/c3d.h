@@ -71,6 +71,10 @@
 #include <string.h>
 #include <intrin.h> // asm
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define C3D_SSE2
+#endif
+
 #ifndef _WIN32
 
 #warning "Non-windows operating system detected."
@@ -88,8 +92,20 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#ifdef C3D_NET
+#include <winsock2.h> // link with -lws2_32
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#endif
+
 #include <windows.h>
 
+#if defined(C3D_KITTY_ZLIB) || defined(C3D_REC_ZLIB)
+#include <zlib.h> // link with -lz
+#endif
+
 // Define C3D_IMPLEMENTATION in one source file to include the implementation.
 // Example:
 // #define C3D_IMPLEMENTATION
@@ -134,9 +150,111 @@ extern "C" {
 
 #define C3D_PXCHAR L'█'
 
+// Pixel size of a terminal cell, used to size the framebuffer for the bitmap outputs.
+#ifndef C3D_CELL_PXW
+#define C3D_CELL_PXW 8
+#endif
+#ifndef C3D_CELL_PXH
+#define C3D_CELL_PXH 16
+#endif
+#ifndef C3D_SIXEL_COLORS
+#define C3D_SIXEL_COLORS 256
+#endif
+#ifndef C3D_KITTY_CHUNK
+#define C3D_KITTY_CHUNK 4096
+#endif
+#ifndef C3D_ENCODE_BANDS
+#define C3D_ENCODE_BANDS 4          // threads the ANSI output is encoded with
+#endif
+#ifndef C3D_ENCODE_MIN_CELLS
+#define C3D_ENCODE_MIN_CELLS 4096   // smaller frames are encoded on one thread
+#endif
+#ifndef C3D_WRITER_RING
+#define C3D_WRITER_RING 3           // one being encoded, one waiting, one being written
+#endif
+#ifndef C3D_REC_KEYINTERVAL
+#define C3D_REC_KEYINTERVAL 60      // frames between keyframes in a recording
+#endif
+#define C3D_REC_MAGIC "C3DREC"
+#define C3D_REC_VERSION 1
+#define C3D_REC_FLAG_ZLIB 0x01
+#ifndef C3D_REC_MAXCELLS
+#define C3D_REC_MAXCELLS (4096 * 4096) // largest frame a recording or a frame server may send
+#endif
+#ifndef C3D_Y4M_FPS
+#define C3D_Y4M_FPS 30              // frame rate announced in the Y4M header
+#endif
+#define C3D_SHM_MAGIC 0x4D485333    // "3SHM"
+#define C3D_SHM_VERSION 1
+#ifndef C3D_CLUSTER_REBALANCE
+#define C3D_CLUSTER_REBALANCE 30    // frames between resizing the bands of a cluster
+#endif
+#define C3D_CLUSTER_MAXROUNDS 16    // compositing rounds, so at most 2^16 sort-last workers
+#ifndef C3D_CLUSTER_TIMEOUT
+#define C3D_CLUSTER_TIMEOUT 5000    // milliseconds a cluster worker may take to answer before it's dropped
+#endif
+#define C3D_ANSI_CELL_MAX 23        // longest a cell gets: "\x1b[38;2;255;255;255m" + a 4 byte glyph
+#define C3D_OUTPUT_ISBITMAP(o) ((o) == C3D_OUTPUT_SIXEL || (o) == C3D_OUTPUT_KITTY || (o) == C3D_OUTPUT_Y4M)
+#define C3D_OUTPUT_ISASCII(o) ((o) == C3D_OUTPUT_ASCII || (o) == C3D_OUTPUT_ASCII_COLOR)
+#ifndef C3D_ASCII_RAMP
+#define C3D_ASCII_RAMP " .:-=+*#%@" // darkest to brightest
+#endif
+#define C3D_RGB15(c) (((GetRValue(c) >> 3) << 10) | ((GetGValue(c) >> 3) << 5) | (GetBValue(c) >> 3))
+
 #define C3D_MAX(a, b, c) (max(max(a, b), c))
 #define C3D_MIN(a, b, c) (min(min(a, b), c))
 #define C3D_CLAMP(var, x, y) (var > y) ? y : ((var < x) ? x : var)
+#ifndef C3D_FASTMATH_BITS
+#define C3D_FASTMATH_BITS 10        // precision C3D_FASTMATH keeps, see c3d_rsqrtf() and c3d_specpow()
+#endif
+#ifndef C3D_POWLUT_SLOTS
+#define C3D_POWLUT_SLOTS 16         // specular power tables kept at once, one per shininess
+#endif
+#ifndef C3D_POWLUT_MAX
+#define C3D_POWLUT_MAX 16384        // entries a specular power table may have before powf() is used
+#endif
+#ifndef C3D_SHADOW_BIAS
+#define C3D_SHADOW_BIAS 0.05f       // distance a surface may be behind the shadow map before it is in shadow
+#endif
+#define C3D_SHADOW_NEAR 0.05f       // near plane of the shadow map faces
+#ifndef C3D_TEMPORAL_REFRESH
+#define C3D_TEMPORAL_REFRESH 8      // a cell is shaded anew at least once every this many frames
+#endif
+#ifndef C3D_TEMPORAL_DEPTH
+#define C3D_TEMPORAL_DEPTH 0.02f    // relative depth difference past which a reprojected cell is disoccluded
+#endif
+#ifndef C3D_LOD_LEVELS
+#define C3D_LOD_LEVELS 4            // simplified versions kept per mesh, each with about half the triangles of the last
+#endif
+#ifndef C3D_LOD_MIN_TRIS
+#define C3D_LOD_MIN_TRIS 256        // meshes are not simplified below this many triangles
+#endif
+#ifndef C3D_LOD_DENSITY
+#define C3D_LOD_DENSITY 2.0f        // triangles per covered cell a mesh is drawn with at most
+#endif
+#ifndef C3D_LOD_HYSTERESIS
+#define C3D_LOD_HYSTERESIS 1.5f     // how far past its budget a mesh goes before it changes level
+#endif
+#define C3D_LOD_MAGIC "C3DLOD"
+#define C3D_LOD_VERSION 1
+
+// The features a c3d_rasterizewith() variant is compiled for.
+#define C3D_RASTER_TEXTURED 1       // samples the diffuse texture
+#define C3D_RASTER_LIT 2            // shades lighting, otherwise the diffuse color is shown as is
+#define C3D_RASTER_BLENDED 4        // blends with the background by the material's transparency
+#define C3D_RASTER_SMOOTH 8         // interpolates the normals, otherwise the triangle's first is used
+#define C3D_RASTER_VERTEX 16        // with C3D_RASTER_LIT, interpolates the light shaded at the corners
+#define C3D_RASTER_ASCII 32         // writes a ramp glyph and the flat mesh color, for the ASCII outputs
+#define C3D_RASTER_VARIANTS 64
+#define C3D_HIZ_TILE 8              // width and height of a hierarchical depth tile, a multiple of 4 so VRS blocks fit in
+#define C3D_RASTER_DEPTH 64         // writes depth only, see c3d_rasterizedepth()
+#define C3D_RASTER_PREPASS 128      // with C3D_RASTER_DEPTH, writes the NDC z the shading pass is tested against
+#if defined(_MSC_VER)
+#define C3D_FORCEINLINE __forceinline
+#else
+#define C3D_FORCEINLINE inline __attribute__((always_inline))
+#endif
+
 #define C3D_KEY_PRESSED 0x8000
 #define C3D_MOUSE_SENSITIVITY 0.01f
 #define C3D_MOUSE_DELTA_SENSITIVITY 0.01f
@@ -147,7 +265,7 @@ extern "C" {
 #define _OBJ_FACES_MAX   10000000
 
 STDC3DDEF HANDLE hConsole;
-STDC3DDEF const CHAR_INFO screenBuffer[C3D_SCREEN_WIDTH * C3D_SCREEN_HEIGHT];
+STDC3DDEF CHAR_INFO screenBuffer[C3D_SCREEN_WIDTH * C3D_SCREEN_HEIGHT];
 STDC3DDEF const SMALL_RECT consoleWriteArea = {0, 0, C3D_SCREEN_WIDTH - 1, C3D_SCREEN_HEIGHT - 1};
 
 typedef unsigned int     c3d_intui;
@@ -259,6 +377,33 @@ typedef enum c3dmtl_t {
     C3D__MTL_GLASS      // Glass is not reflective, and mostly transparent
 } c3d_stdmtl;
 
+typedef struct c3d_shlights_t c3d_shlights;
+
+// How many cells share one lighting evaluation. Depth and
+// coverage are always resolved per cell, and the texture
+// is sampled per cell; only the lighting is shared by the
+// cells of a block, on a grid aligned to the screen.
+typedef enum c3d_shadingrate_t {
+    C3D_RATE_1X1,
+    C3D_RATE_2X1,
+    C3D_RATE_2X2,
+    C3D_RATE_4X2,
+} c3d_shadingrate;
+
+// The light shaded at a vertex of a mesh with per-vertex
+// lighting. A vertex is shaded the first time a frame a
+// triangle using it is drawn, the others take it from here.
+typedef struct c3d_vertexlight_t {
+    vec3 ambient, diffuse, specular;
+    c3d_intui frame;            // the display's draw_frame it was shaded in, 0 for never
+} c3d_vertexlight;
+
+// A simplified version of a mesh, see c3d_meshlods().
+typedef struct c3d_meshlod_t {
+    tri *tris;
+    int tri_count;
+} c3d_meshlod;
+
 // A mesh is an array of triangles. It has a name,
 // and a reference to whatever material(s) it may
 // have.
@@ -267,6 +412,26 @@ typedef struct mesh_t{
     tri *tris;
     int tri_count;
     material *mtl;
+    vec3 *baked;                // static lights' diffuse per triangle corner, see c3d_bakemesh()
+    c3d_intui version;          // changed whenever the mesh is loaded or transformed, unique among meshes
+    c3d_intui baked_version;    // the mesh version baked was computed for
+    c3d_intui baked_lights;     // the static lights' version baked was computed for
+    c3d_intui baked_shadows;    // the display's shadow_version baked was computed for
+    c3d_shlights *sh;           // the lights far from the mesh, see c3d_shupdate()
+    c3d_shadingrate rate;       // the finest rate it is shaded at, see c3d_vrs
+    bool occluder;              // drawn into the occlusion buffer, see c3d_occlusion
+    vec3 box_min, box_max;      // world space bounding box, see c3d_meshbox()
+    c3d_intui box_version;      // the mesh version the box was computed for
+    vec3 sphere_center;         // world space bounding sphere, see c3d_meshsphere()
+    float sphere_radius;
+    c3d_intui sphere_version;   // the mesh version the sphere was computed for
+    c3d_meshlod *lods;          // coarser and coarser versions of tris, see c3d_meshlods()
+    int lod_count;
+    int lod;                    // the one drawn this frame, 0 for tris itself, see c3d_lodselect()
+    c3d_vertexlight *vlights;   // per distinct vertex of the level drawn, see c3d_meshweld()
+    c3d_intui *vlight_ids;      // per triangle corner of the level drawn, its vertex in vlights
+    c3d_intui vlight_version;   // the mesh version and level they were welded for
+    int vlight_lod;
 } mesh;
 
 // The camera defines the first person object that
@@ -292,8 +457,409 @@ typedef struct light_t {
     vec3 color;         // the light's color (r, g, b)
     float brightness;   // a scalar factor that defines how strong the light is
     float radius;       // defines how far the light reaches
+    bool dynamic;       // moves or changes often, so it is never baked
 } light;
 
+// Output backends. The ANSI backend writes one colored
+// glyph per cell, while the bitmap backends (sixel and
+// kitty) send the whole framebuffer as an image, so each
+// framebuffer pixel is a real terminal pixel. The ASCII
+// backends pick the glyph from the shaded intensity and
+// get by with about one byte per cell. The Y4M backend
+// is not for terminals at all but for video encoders.
+typedef enum c3d_output_t {
+    C3D_OUTPUT_ANSI,
+    C3D_OUTPUT_SIXEL,
+    C3D_OUTPUT_KITTY,
+    C3D_OUTPUT_ASCII,       // a density ramp glyph per cell and no escapes at all
+    C3D_OUTPUT_ASCII_COLOR, // like ASCII, with one flat color per mesh
+    C3D_OUTPUT_Y4M,         // raw YUV4MPEG2 video, meant for a pipe into an encoder
+} c3d_output;
+
+// Where lighting is evaluated. Per-pixel runs Blinn-Phong
+// for every covered cell, per-vertex (Gouraud) runs it at
+// the corners of a triangle and interpolates the results.
+typedef enum c3d_lighting_t {
+    C3D_LIGHTING_PIXEL,
+    C3D_LIGHTING_VERTEX,
+} c3d_lighting;
+
+// Growable byte buffer the output encoders write into.
+// It is kept alive between frames so we don't allocate
+// a new one for every c3d_render() call.
+typedef struct c3d_outbuf_t {
+    char *data;
+    size_t len;
+    size_t cap;
+} c3d_outbuf;
+
+// Working memory of the bitmap encoders, kept on the
+// display and reused between frames like its c3d_outbuf.
+typedef struct c3d_encscratch_t {
+    COLORREF *row;              // one padded Y4M row
+    size_t row_cap;
+    c3d_intui *hist;            // sixel: how often each 15-bit color is used
+    c3d_intus *lut;             // sixel: palette index of each 15-bit color
+    uint64_t *used;             // sixel: used colors, packed with their counts
+    c3d_intus *nearest;         // sixel: palette entry nearest to each coarse color cell
+    c3d_intuc *rows;            // sixel: one sixel row per palette color
+    size_t rows_cap;
+    c3d_intuc *pixels;          // kitty: the raw image
+    size_t pixels_cap;
+    c3d_intuc *zpixels;         // kitty: the compressed image
+    size_t zpixels_cap;
+} c3d_encscratch;
+
+// A horizontal band of the framebuffer and the slice of
+// the output buffer it is encoded into. c3d_render()
+// splits the frame into bands and encodes them at once.
+typedef struct c3d_band_t {
+    wchar_t **buffer;
+    COLORREF **colorBuffer;
+    int width;
+    int y0, y1;     // rows [y0, y1) of the framebuffer
+    char *out;      // where the band writes its escapes
+    size_t len;     // how much it wrote
+} c3d_band;
+
+// Threads the ANSI bands are encoded on. They are started
+// with the first frame that needs them and then wait for
+// the next one, so a frame costs a wake-up instead of a
+// thread per band. Every thread, and c3d_render() itself,
+// takes bands off the frame until none are left.
+typedef struct c3d_encpool_t {
+    HANDLE threads[C3D_ENCODE_BANDS];
+    int thread_count;
+    c3d_band *bands;            // the bands of the frame being encoded
+    int band_count;
+    int next;                   // the next band nobody took yet
+    int busy;                   // bands not fully encoded yet
+    c3d_intui frame;            // bumped for every frame handed out
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake;    // a new frame, or the pool stopping
+    CONDITION_VARIABLE done;    // the last band of a frame is encoded
+    bool running;
+} c3d_encpool;
+
+// Asynchronous terminal writer. The render thread encodes
+// into one of a small ring of preallocated buffers and hands
+// it over; a dedicated thread writes it out. At most one
+// frame waits to be written: when the terminal can't keep
+// up, the waiting frame is dropped in favor of the newer one
+// instead of piling up behind it.
+typedef struct c3d_writer_t {
+    c3d_outbuf bufs[C3D_WRITER_RING];
+    int encoding;               // buffer owned by the render thread, or -1
+    int pending;                // buffer waiting to be written, or -1
+    int writing;                // buffer being written, or -1
+    HANDLE out;                 // where frames are written to
+    HANDLE thread;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake;
+    bool running;
+    c3d_intui written;          // frames fully written
+    c3d_intui dropped;          // stale frames dropped before being written
+} c3d_writer;
+
+// Encodes rendered frames in the .c3drec frame format, as
+// keyframes and XOR/RLE deltas against the last frame.
+typedef struct c3d_fbencoder_t {
+    c3d_intuc *prev;            // byte planes of the last encoded frame
+    c3d_intuc *cur;             // byte planes of the frame being encoded
+    c3d_outbuf pack;            // the encoded payload
+    #ifdef C3D_REC_ZLIB
+    c3d_intuc *zpack;           // the compressed payload
+    size_t zpack_cap;
+    #endif
+    c3d_intuc header[20];       // header of the last encoded frame
+    c3d_intus width;
+    c3d_intus height;
+    c3d_intui frames;
+    LARGE_INTEGER freq;
+    LARGE_INTEGER start;
+} c3d_fbencoder;
+
+// Decodes a stream of .c3drec frames back into a framebuffer.
+typedef struct c3d_fbdecoder_t {
+    c3d_intuc *planes;          // byte planes of the last decoded frame
+    c3d_intuc *payload;
+    size_t payload_cap;
+    #ifdef C3D_REC_ZLIB
+    c3d_intuc *unpacked;
+    size_t unpacked_cap;
+    #endif
+    wchar_t **buffer;
+    COLORREF **colorBuffer;
+    int width;
+    int height;
+    COLORREF background;
+    c3d_intui time;             // milliseconds since the stream started
+    bool have_key;              // deltas are skipped until a keyframe decodes
+} c3d_fbdecoder;
+
+// Records the rendered frames into a .c3drec file.
+typedef struct c3d_recorder_t {
+    FILE *f;
+    c3d_fbencoder enc;
+} c3d_recorder;
+
+// Header of a shared-memory framebuffer, mapped by the
+// renderer and any number of local readers. seq is odd
+// while the front slot is being swapped.
+typedef struct c3d_shmheader_t {
+    c3d_intui magic;            // C3D_SHM_MAGIC once the header is ready
+    c3d_intui version;
+    c3d_intui max_width;        // capacity of each slot
+    c3d_intui max_height;
+    volatile LONG seq;          // seqlock counter
+    volatile c3d_intui front;   // slot holding the latest finished frame
+    struct {
+        c3d_intui width;
+        c3d_intui height;
+        c3d_intui frame;        // the display's frame_count for this frame
+        c3d_intui reserved;
+    } slots[2];
+} c3d_shmheader;
+
+// The renderer's side of a shared-memory framebuffer.
+typedef struct c3d_shm_t {
+    HANDLE mapping;
+    c3d_shmheader *header;
+} c3d_shm;
+
+typedef struct c3d_server_t c3d_server;
+typedef struct c3d_cluster_t c3d_cluster;
+
+#ifdef C3D_NET
+
+// A viewer connected to a frame server.
+typedef struct c3d_netclient_t {
+    SOCKET s;
+    c3d_outbuf pending;         // queued bytes the socket hasn't taken yet
+    size_t sent;                // how much of pending was already sent
+    bool need_key;              // deltas are skipped until the next keyframe
+    bool joined;                // hasn't been sent a frame yet
+    c3d_intui skipped;          // frames skipped because the viewer was behind
+} c3d_netclient;
+
+// Serves rendered frames to any number of viewers, encoding
+// each frame once for all of them.
+struct c3d_server_t {
+    SOCKET listen;
+    c3d_netclient *clients;
+    int client_count;
+    int client_cap;
+    c3d_fbencoder enc;
+};
+
+// A worker process rendering a band of rows for a cluster.
+typedef struct c3d_clusterworker_t {
+    SOCKET s;
+    c3d_intus y0;               // the rows it renders, [y0, y1)
+    c3d_intus y1;
+    float share;                // its fraction of the rows
+    float speed;                // rows per microsecond at the last rebalance
+    double time;                // microseconds spent rendering since the last rebalance
+    c3d_intuc *planes;          // byte planes of its rows, deltas apply to them
+    size_t planes_size;
+    c3d_intuc *payload;
+    size_t payload_cap;
+    char *addr;                 // its "host:port", where the other workers reach it too
+    bool root;                  // answers with cells, the root of a sort-last compositing tree
+} c3d_clusterworker;
+
+// How a cluster splits the work. Sort-first gives every
+// worker a band of rows, sort-last gives every worker a
+// share of the meshes and composites by depth.
+typedef enum c3d_clustermode_t {
+    C3D_CLUSTER_SORTFIRST,
+    C3D_CLUSTER_SORTLAST,
+} c3d_clustermode;
+
+// Renders through worker processes instead of locally.
+struct c3d_cluster_t {
+    c3d_clustermode mode;
+    c3d_clusterworker *workers;
+    int worker_count;
+    c3d_outbuf msg;             // scene changes queued for every worker
+    cam camera;                 // the camera and lights last sent
+    light *lights;
+    c3d_intui light_count;
+    bool synced;                // false until the camera and lights were sent once
+    c3d_intui frames;
+};
+
+#endif
+
+// What a mesh was when a shadow map was rendered.
+typedef struct c3d_shadowmesh_t {
+    const tri *tris;
+    int tri_count;
+    c3d_intui version;
+    bool inside;                // whether it was within the light's radius
+} c3d_shadowmesh;
+
+// A point light's shadow map: the distance to the nearest
+// surface along each face of a cube around the light. It
+// is only rendered again when the light moves or a mesh
+// that is (or was) within its radius changes.
+typedef struct c3d_shadowmap_t {
+    float *depth;               // 6 faces of size x size
+    mat4 faces[6];              // each face's projection and view
+    int face_of_axis[6];        // the face looking along +x, -x, +y, -y, +z, -z
+    vec3 position;              // the light it was rendered for
+    float radius;
+    c3d_intus size;
+    c3d_shadowmesh *meshes;     // the meshes it was rendered from
+    c3d_intui mesh_count;
+} c3d_shadowmap;
+
+// The lighting of a block of cells, see c3d_shadingrate.
+typedef struct c3d_vrsblock_t {
+    vec3 ambient, diffuse, specular;
+    int row;                    // the row of blocks it was shaded for, -1 if none yet
+} c3d_vrsblock;
+
+// Variable-rate shading. A triangle is shaded at the
+// coarsest of its mesh's rate and the rates below that
+// apply to it, each left at C3D_RATE_1X1 to turn it off.
+typedef struct c3d_vrs_t {
+    c3d_shadingrate far_rate;   // for meshes whose center is further than far_distance from the camera
+    float far_distance;
+    c3d_shadingrate flat_rate;  // for meshes without a texture
+    c3d_shadingrate edge_rate;  // for triangles entirely outside the fovea
+    float fovea;                // the centered fraction of the screen's width and height edge_rate spares
+    c3d_vrsblock *blocks;       // one row of blocks, reused by every triangle
+    c3d_intui block_cap;
+} c3d_vrs;
+
+// What a cell was shaded with, kept for the next frame.
+typedef struct c3d_temporalcell_t {
+    vec3 lit;                   // ambient plus diffuse, before the texture
+    vec3 specular;
+    float w;                    // distance along the view axis
+    c3d_intui mesh;             // the mesh's index plus one, 0 if none was drawn here
+    c3d_intui version;          // the mesh's version
+    c3d_intus lod;              // the mesh's level of detail
+} c3d_temporalcell;
+
+// A tile of the hierarchical depth, see c3d_hiz.
+typedef struct c3d_hiztile_t {
+    float zmin;                 // the nearest depth drawn in the tile
+    float zmax;                 // the farthest depth in the tile, INFINITY while any cell is empty
+    bool dirty;                 // cells were drawn since zmax was computed, it may be too far
+} c3d_hiztile;
+
+// Hierarchical depth. The depth buffer is split into
+// C3D_HIZ_TILE cells wide tiles that keep the range of the
+// depths in them, so a triangle behind everything in a tile
+// is skipped there without testing its cells one by one, and
+// one in front of everything skips reading the depth buffer.
+typedef struct c3d_hiz_t {
+    bool enabled;
+    c3d_hiztile *tiles;         // row by row
+    c3d_intus columns;
+    c3d_intus rows;
+    c3d_intui cap;
+} c3d_hiz;
+
+// Occlusion culling. The meshes marked as occluders are
+// drawn depth only into a small buffer before the frame,
+// and every other mesh whose bounding box is behind them
+// wherever it lands on the buffer is not drawn at all.
+typedef struct c3d_occlusion_t {
+    c3d_intus width;            // 0 for no occlusion culling, the height follows the display's
+    c3d_intus height;
+    float *depth;               // per cell, the nearest occluder covering all of it at its farthest, distance along the view axis
+    c3d_intui size;             // cells depth was allocated for
+    bool *culled;               // per mesh, whether it is hidden this frame
+    c3d_intui culled_cap;
+    c3d_intui culled_count;     // meshes hidden this frame
+} c3d_occlusion;
+
+// The order the meshes are drawn in, nearest first, so
+// the depth test turns away the cells of the meshes behind
+// before they are shaded. Each frame starts from the last
+// one's order, which is usually still sorted.
+typedef struct c3d_draworder_t {
+    bool enabled;
+    c3d_intui *ids;             // mesh indices, nearest first
+    c3d_intui *scratch;         // the ids between the two passes of the sort
+    c3d_intus *keys;            // per mesh, its distance along the view axis, quantized
+    c3d_intui count;            // meshes ids holds
+    c3d_intui cap;
+} c3d_draworder;
+
+// The lights as structure-of-arrays, padded to a multiple
+// of 4 with dark lights, for the SIMD shading kernel. The
+// display's are rebuilt from the lights every frame.
+typedef struct c3d_lightsoa_t {
+    float *data;                // one block holding all the arrays below
+    float *px, *py, *pz;        // positions
+    float *r, *g, *b;           // colors times brightness
+    float *radius2;             // radius squared, negative for padding
+    float *inv_radius2;
+    const c3d_shadowmap **shadow; // per light, NULL for the padding
+    bool shadowed;              // whether shadow is worth looking at
+    c3d_intui count;            // lights laid out, before the padding
+    c3d_intui built;            // the display's draw_frame it was laid out in, 0 for never
+    c3d_intui padded;
+    c3d_intui cap;
+} c3d_lightsoa;
+
+// A copy of some of the lights, compared to the display's
+// every frame to tell when they changed.
+typedef struct c3d_lightwatch_t {
+    light *lights;
+    c3d_intui count;
+    c3d_intui version;          // bumped on every change, 0 before the first look
+} c3d_lightwatch;
+
+// Baked lighting. The diffuse light of the static lights
+// is computed once per triangle corner and kept in the
+// meshes, only dynamic lights and specular highlights are
+// evaluated per frame. Any change to the static lights
+// bumps the watch's version so every mesh is baked again.
+typedef struct c3d_bake_t {
+    bool enabled;
+    c3d_lightwatch watch;       // the static lights the meshes were baked with
+    c3d_lightsoa dynamic;       // the dynamic lights, for shading
+    c3d_lightsoa fixed;         // the static lights, for their specular highlights
+} c3d_bake;
+
+// The lights far from a mesh, projected onto spherical
+// harmonics as seen from its center. Our diffuse term is
+// a step over the hemisphere, whose band 2 projection is
+// zero, so the first two bands hold all of L2 and the
+// evaluation is one dot product per channel.
+struct c3d_shlights_t {
+    vec3 coeffs[4];             // Y(0,0), Y(1,-1), Y(1,0), Y(1,1), r, g, b in each
+    bool *distant;              // per light, whether it is in coeffs
+    c3d_lightsoa nearby;        // the lights still shaded one by one
+    c3d_intui mesh_version;     // the mesh and lights' versions it was built for
+    c3d_intui light_version;
+};
+
+// Temporal reuse of shading. A cell's point is reprojected
+// with last frame's camera and takes the lighting shaded
+// there, if the same mesh, not transformed since, was drawn
+// at the same depth. Any change to the lights or to a static
+// light's shadow map drops the whole of last frame, and every
+// cell is shaded anew once per C3D_TEMPORAL_REFRESH frames
+// anyway, so highlights follow the camera.
+typedef struct c3d_temporal_t {
+    bool enabled;
+    c3d_temporalcell *prev;     // last frame's cells, width by height
+    c3d_temporalcell *cur;      // this frame's cells
+    c3d_intus width;            // the display size the cells were allocated for
+    c3d_intus height;
+    mat4 matcam;                // last frame's view-projection
+    bool drawn;                 // whether prev holds a whole frame
+    bool reuse;                 // whether prev may be reused this frame
+    c3d_lightwatch watch;
+    c3d_intui shadow_version;   // the display's shadow_version prev was shaded with
+} c3d_temporal;
+
 // The display, or scene, which is used to c3d_render
 // any 3D space.
 typedef struct display_t {
@@ -303,15 +869,55 @@ typedef struct display_t {
     cam camera;                 // a regular field of view camera
     behavior *behaviors;        // the behaviors of a display, actions that run every c3d_update() call
     light *lights;              // the lights of a display
+    c3d_lightsoa lightsoa;      // the lights laid out for shading
+    c3d_bake bake;              // static lights baked into the meshes, if enabled
+    float sh_distance;          // lights further than this from a mesh go through its SH, 0 for never
+    c3d_lightwatch sh_watch;
+    c3d_shadowmap *shadows;     // one per light, while shadow_size is not 0
+    c3d_intui shadow_count;
+    c3d_intui shadow_version;   // bumped whenever a static light's shadow map is rendered
+    c3d_intus shadow_size;      // shadow map faces are this many texels wide, 0 for no shadows
+    c3d_vrs vrs;                // where lighting is shaded at a coarser rate
+    c3d_temporal temporal;      // last frame's shading, reused where it still holds
+    c3d_hiz hiz;                // per-tile depth ranges, to skip hidden tiles of triangles
+    c3d_occlusion occlusion;    // meshes hidden behind the occluders, skipped whole
+    c3d_draworder order;        // meshes nearest first, see c3d_sortmeshes()
     bool running;               // simple check if the display runs. Useful for constant c3d_render loops
+    c3d_output output;          // the backend c3d_render() encodes frames with
+    c3d_lighting lighting;      // per-pixel or per-vertex lighting
+    bool depth_prepass;         // lay down depth first and shade only what it leaves, see c3d_drawmeshes()
+    bool lod;                   // draw meshes with fewer triangles the smaller they are on screen
+    c3d_outbuf outbuf;          // the encoded frame, reused between frames
+    c3d_encscratch scratch;     // encoder working memory, reused between frames
+    c3d_encpool *encpool;       // threads the ANSI output is encoded on, started on first use
+    c3d_writer *writer;         // if set, frames are written asynchronously through it
+    c3d_recorder *recorder;     // if set, frames are recorded through it
+    HANDLE out;                 // where frames are written, the console if NULL
+    c3d_shm *shm;               // if set, frames are exported to shared memory
+    c3d_server *server;         // if set, frames are broadcast to viewers (C3D_NET)
+    c3d_cluster *cluster;       // if set, frames are rendered by worker processes (C3D_NET)
+    bool worker;                // renders for a cluster, so scenes don't start outputs, see c3d_loadscene()
+    c3d_intus stream_width;     // frame size announced in a Y4M header, 0 until one is written
+    c3d_intus stream_height;
     c3d_intus display_width;          
     c3d_intus display_height;         
+    c3d_intus region_y0;        // rows the rasterizer may draw to, [region_y0, region_y1),
+    c3d_intus region_y1;        // or all of them if region_y1 is 0
+    c3d_intui mesh_part;        // meshes drawn, those with index % mesh_parts == mesh_part,
+    c3d_intui mesh_parts;       // or all of them if mesh_parts is 0, see c3d_workerserve()
     c3d_intui behavior_count;         
     c3d_intui frame_count;
+    c3d_intui draw_frame;       // bumped every frame drawn, to tell what was built for this frame apart
     c3d_intui mesh_count;
     c3d_intui light_count;
 } display;
 
+// A variant of c3d_rasterizewith(), see C3D_RASTER_VARIANT.
+typedef void (*c3d_rasterfn)(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer,
+                             vec3 v0_ndc, vec3 v1_ndc, vec3 v2_ndc, float w0_clip, float w1_clip, float w2_clip,
+                             tri t, material *mtl, const vec3 *baked, c3d_vertexlight *const *vlights,
+                             const c3d_shlights *sh, c3d_shadingrate rate, int mesh_id);
+
 // Window structure.
 typedef struct window_t{
     c3d_intus width;
@@ -334,7 +940,7 @@ typedef struct _obj_t{
 }_obj;
 
 
-STDC3DDEF c3d_intuc *c3d_strcat3(const char *prefix, const char *string, const char *suffix);
+STDC3DDEF char *c3d_strcat3(const char *prefix, const char *string, const char *suffix);
 STDC3DDEF bool c3d_hastexture(const char *folder);
 STDC3DDEF c3d_intui c3d_loadobjfolder(display *d, const char *folder);
 STDC3DDEF void c3d_folderlist(const char *path, char ***out, int *count);
@@ -348,6 +954,13 @@ STDC3DDEF void c3d_meshabs(mesh *A, mat4 B);
 STDC3DDEF void c3d_meshrel(mesh *A, mat4 B);
 STDC3DDEF vec3 c3d_meshcenter(mesh A);
 STDC3DDEF void c3d_show_file_contents(const char *filename);
+STDC3DDEF void c3d_recframe(display *d, wchar_t **buffer, COLORREF **colorBuffer);
+STDC3DDEF void c3d_shmframe(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer);
+#ifdef C3D_NET
+STDC3DDEF void c3d_serverframe(display *d, wchar_t **buffer, COLORREF **colorBuffer);
+STDC3DDEF bool c3d_clusterframe(display *d, wchar_t **buffer, COLORREF **colorBuffer);
+STDC3DDEF void c3d_clusterstop(display *d);
+#endif
 
 
 
@@ -365,18 +978,171 @@ STDC3DDEF void c3d_show_file_contents(const char *filename);
 
 #ifdef C3D_IMPLEMENTATION
 
+// The last version given to a mesh, so no two meshes ever share one.
+static c3d_intui c3d_meshversions = 0;
+
+/* =============================================================================
+ *                                  FAST MATH
+ * =============================================================================
+ */
+
+/*
+ * With C3D_FASTMATH defined, normalization goes through a float
+ * reciprocal square root and the specular power through a lookup table
+ * per shininess. C3D_FASTMATH_BITS is how many bits of precision they
+ * must keep: relative for c3d_rsqrtf(), absolute for c3d_specpow(), whose
+ * results lie in [0, 1]. 8 bits is all the 8-bit color channels can
+ * show. Without C3D_FASTMATH both fall back to the exact libm calls.
+ */
+
+/**
+ * Clamps v to [lo, hi]. Compiles to a min and a max rather than branches.
+ */
+STDC3DDEF float c3d_clampf(float v, float lo, float hi){
+    #ifdef C3D_SSE2
+    return _mm_cvtss_f32(_mm_min_ss(_mm_max_ss(_mm_set_ss(v), _mm_set_ss(lo)), _mm_set_ss(hi)));
+    #else
+    v = (v < lo) ? lo : v;
+    return (v > hi) ? hi : v;
+    #endif
+}
+
+/**
+ * Returns 1 / sqrt(x) for x > 0, to C3D_FASTMATH_BITS bits.
+ */
+STDC3DDEF float c3d_rsqrtf(float x){
+    #if !defined(C3D_FASTMATH) || C3D_FASTMATH_BITS > 22
+    return 1.0f / sqrtf(x);
+    #else
+    #ifdef C3D_SSE2
+    // the hardware estimate is good to about 11.4 bits, each Newton step doubles that
+    float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    #if C3D_FASTMATH_BITS > 11
+    r = r * (1.5f - 0.5f * x * r * r);
+    #endif
+    #else
+    // the bit trick starts at about 4.5 bits
+    uint32_t i;
+    float r;
+    memcpy(&i, &x, sizeof(i));
+    i = 0x5f375a86 - (i >> 1);
+    memcpy(&r, &i, sizeof(r));
+    r = r * (1.5f - 0.5f * x * r * r);
+    #if C3D_FASTMATH_BITS > 9
+    r = r * (1.5f - 0.5f * x * r * r);
+    #endif
+    #if C3D_FASTMATH_BITS > 17
+    r = r * (1.5f - 0.5f * x * r * r);
+    #endif
+    #endif
+    return r;
+    #endif
+}
+
+#ifdef C3D_FASTMATH
+
+// A tabulated x^exponent over [0, 1], linearly interpolated.
+typedef struct c3d_powlut_t {
+    float exponent;
+    int size;
+    float *table;
+} c3d_powlut;
+
+static c3d_powlut c3d_powluts[C3D_POWLUT_SLOTS];
+
+/**
+ * Returns the table for an exponent, building it the first time. Its
+ * size keeps the interpolation error, at most exponent * (exponent - 1)
+ * * h^2 / 8 for a step h, under 2^-C3D_FASTMATH_BITS. Returns NULL if
+ * that needs more than C3D_POWLUT_MAX entries, for exponents under 2
+ * whose curve is too steep near 0 to tabulate, or once the
+ * C3D_POWLUT_SLOTS tables are taken by other exponents.
+ */
+STDC3DDEF c3d_powlut *c3d_powlutget(float exponent){
+    if (exponent < 2.0f) return NULL;
+
+    uint32_t key;
+    memcpy(&key, &exponent, sizeof(key));
+    uint32_t slot = (key ^ (key >> 13)) % C3D_POWLUT_SLOTS;
+
+    // probed linearly and never evicted, so two exponents sharing a
+    // slot can't keep rebuilding each other's table
+    c3d_powlut *lut = NULL;
+    for (int i = 0; i < C3D_POWLUT_SLOTS; i++){
+        c3d_powlut *l = &c3d_powluts[(slot + i) % C3D_POWLUT_SLOTS];
+        if (l->table == NULL){
+            lut = l;
+            break;
+        }
+        if (l->exponent == exponent) return l->size ? l : NULL;
+    }
+    if (lut == NULL) return NULL;
+
+    double steps = ceil(sqrt(exponent * (exponent - 1.0) * (double)(1u << C3D_FASTMATH_BITS) / 8.0));
+    lut->exponent = exponent;
+
+    if (steps + 1 > C3D_POWLUT_MAX){
+        // remembered as untabulable, so we don't retry every fragment
+        lut->size = 0;
+        lut->table = (float *)malloc(sizeof(float));
+        if (lut->table == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_powlutget.\n");
+            exit(EXIT_FAILURE);
+        }
+        return NULL;
+    }
+
+    lut->size = (int)steps + 1;
+    lut->table = (float *)malloc(lut->size * sizeof(float));
+    if (lut->table == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_powlutget.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < lut->size; i++) lut->table[i] = powf((float)i / (float)(lut->size - 1), exponent);
+
+    return lut;
+}
+
+#endif
+
+/**
+ * Returns x^exponent for x in [0, 1], the specular term of Blinn-Phong.
+ */
+STDC3DDEF float c3d_specpow(float x, float exponent){
+    #ifdef C3D_FASTMATH
+    c3d_powlut *lut = c3d_powlutget(exponent);
+    if (lut != NULL){
+        float f = c3d_clampf(x, 0.0f, 1.0f) * (lut->size - 1);
+        int i = (int)f;
+        if (i >= lut->size - 1) return lut->table[lut->size - 1];
+        return lut->table[i] + (f - i) * (lut->table[i + 1] - lut->table[i]);
+    }
+    #endif
+    return powf(x, exponent);
+}
+
 /* =============================================================================
  *                              LINEAR ALGEBRA
  * =============================================================================
  */
 
 STDC3DDEF void c3d_vec3normalize(vec3 *vec){
+    #ifdef C3D_FASTMATH
+    float len2 = vec->x * vec->x + vec->y * vec->y + vec->z * vec->z;
+    if (len2 > 0.0f){
+        float r = c3d_rsqrtf(len2);
+        vec->x *= r;
+        vec->y *= r;
+        vec->z *= r;
+    }
+    #else
     float V = sqrt(pow(vec->x, 2) + pow(vec->y, 2) + pow(vec->z, 2));
     if (V != 0){
         vec->x /= V;
         vec->y /= V;
         vec->z /= V;
     }
+    #endif
 }
 
 STDC3DDEF void c3d_vec4normalize(vec4 *vec){
@@ -558,10 +1324,31 @@ STDC3DDEF vec3 c3d_vec3cross(vec3 a, vec3 b) {
     return result;
 }
 
+/**
+ * Blends three vectors by barycentric weights.
+ */
+STDC3DDEF vec3 c3d_vec3bary(vec3 a, vec3 b, vec3 c, float wa, float wb, float wc){
+    return (vec3){
+        a.x * wa + b.x * wb + c.x * wc,
+        a.y * wa + b.y * wb + c.y * wc,
+        a.z * wa + b.z * wb + c.z * wc
+    };
+}
+
 STDC3DDEF float c3d_vec3dot(vec3 A, vec3 B){
     return A.x * B.x + A.y * B.y + A.z * B.z;
 }
 
+/**
+ * Hashes the bits of a vector, for welding the corners at the same
+ * position.
+ */
+STDC3DDEF c3d_intui c3d_vec3hash(vec3 v){
+    c3d_intui b[3];
+    memcpy(b, &v, sizeof(b));
+    return (b[0] * 73856093u) ^ (b[1] * 19349663u) ^ (b[2] * 83492791u);
+}
+
 /**
  * Projects a 3d vector into a 2d one.
  */
@@ -786,7 +1573,8 @@ STDC3DDEF int c3d_suthhodgman(vex *inVerts, int inCount, vex *outVerts) {
 }
 
 /**
- * Handles clipping against near-plane (w = 0)
+ * Handles clipping against near-plane (w = 0). A triangle wholly in
+ * front of it is given back as it is, see c3d_triwhole().
  */
 STDC3DDEF int c3d_nearclip(tri t, mat4 matcam, tri *clippedtri) {
     vex in[3];
@@ -802,6 +1590,12 @@ STDC3DDEF int c3d_nearclip(tri t, mat4 matcam, tri *clippedtri) {
         in[i].uv = uvs[i];
     }
 
+    // clipping would rotate the corners, which the per-corner caches rely on
+    if (c3d_innear(in[0]) && c3d_innear(in[1]) && c3d_innear(in[2])) {
+        clippedtri[0] = t;
+        return 1;
+    }
+
     vex out[8];
     int outc = c3d_suthhodgman(in, 3, out);
 
@@ -843,6 +1637,17 @@ STDC3DDEF int c3d_nearclip(tri t, mat4 matcam, tri *clippedtri) {
     return 0;
 }
 
+/**
+ * Whether c3d_nearclip() gave back the triangle t as it is, so its
+ * corners are the ones of t, in the same order. A clipped one always has
+ * a corner on the near plane that t doesn't.
+ */
+STDC3DDEF bool c3d_triwhole(const tri *clipped, const tri *t){
+    return clipped->vx.x == t->vx.x && clipped->vx.y == t->vx.y && clipped->vx.z == t->vx.z &&
+           clipped->vy.x == t->vy.x && clipped->vy.y == t->vy.y && clipped->vy.z == t->vy.z &&
+           clipped->vz.x == t->vz.x && clipped->vz.y == t->vz.y && clipped->vz.z == t->vz.z;
+}
+
 /**
  * Edge function for rasterization
  */
@@ -879,370 +1684,5185 @@ STDC3DDEF bool c3d_backface(tri t, vec3 pos){
 
 /*
  * =============================================================================
- *               SHADING, TEXTURING, RENDERING AND RASTERIZING
+ *                              OUTPUT ENCODERS
  * =============================================================================
  */
 
 /**
- * Function for displaying all buffers.
- * 
- * This function uses the ANSI escape character \033[ and defines
- * 38;2 for coloring on the screen, and the last three digits,
- * separated by the semicolons, are the R, G and B, 48;2 for bg
- * coloring.
- */ 
-STDC3DDEF void c3d_render(display *d, wchar_t **buffer, COLORREF **colorBuffer) {
-    wchar_t *output_buffer = NULL;
-    size_t output_buffer_size = 0;
-
-    if (!output_buffer) {
-        size_t max_line_length = d->display_width * 30 + 10;
-        output_buffer_size = d->display_height * max_line_length * sizeof(wchar_t);
-        output_buffer = (wchar_t *)malloc(output_buffer_size);
-        if (!output_buffer) {
-            fwprintf(stderr, L"Memory allocation failed for output_buffer.\n");
-            exit(EXIT_FAILURE);
-        }
+ * Makes sure the output buffer has room for n more bytes.
+ */
+STDC3DDEF void c3d_outreserve(c3d_outbuf *o, size_t n){
+    if (o->len + n <= o->cap) return;
+
+    size_t cap = o->cap ? o->cap : 4096;
+    while (cap < o->len + n) cap *= 2;
+
+    char *data = (char *)realloc(o->data, cap);
+    if (data == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_outreserve.\n");
+        exit(EXIT_FAILURE);
     }
+    o->data = data;
+    o->cap = cap;
+}
 
-    size_t buffer_pos = 0;
+STDC3DDEF void c3d_outappend(c3d_outbuf *o, const char *s, size_t n){
+    c3d_outreserve(o, n);
+    memcpy(o->data + o->len, s, n);
+    o->len += n;
+}
 
-    int bgr = (int)(d->background_color.x);
-    int bgg = (int)(d->background_color.y);
-    int bgb = (int)(d->background_color.z);
-    
-    bgr = C3D_CLAMP(bgr, 0, 255);
-    bgg = C3D_CLAMP(bgg, 0, 255);
-    bgb = C3D_CLAMP(bgb, 0, 255);
-    
-    buffer_pos += swprintf(&output_buffer[buffer_pos], output_buffer_size - buffer_pos, L"\x1b[48;2;%d;%d;%dm", bgr, bgg, bgb);
-    buffer_pos += swprintf(&output_buffer[buffer_pos], output_buffer_size - buffer_pos, L"\x1b[H");
+STDC3DDEF void c3d_outstr(c3d_outbuf *o, const char *s){
+    c3d_outappend(o, s, strlen(s));
+}
 
-    COLORREF lastColor = 0xFFFFFFFF; 
+STDC3DDEF void c3d_outchar(c3d_outbuf *o, char c){
+    c3d_outreserve(o, 1);
+    o->data[o->len++] = c;
+}
 
-    for (int y = 0; y < d->display_height; y++) {
-        for (int x = 0; x < d->display_width; x++) {
-            COLORREF color = colorBuffer[y][x];
+/**
+ * Appends an unsigned integer in decimal. Much cheaper than going
+ * through printf for the thousands of numbers an escape stream has.
+ */
+STDC3DDEF void c3d_outuint(c3d_outbuf *o, c3d_intui v){
+    char tmp[10];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
 
-            if (color != lastColor) {
-                int r = GetRValue(color);
-                int g = GetGValue(color);
-                int b = GetBValue(color);
-                buffer_pos += swprintf(&output_buffer[buffer_pos], output_buffer_size - buffer_pos, L"\x1b[38;2;%d;%d;%dm", r, g, b);
-                lastColor = color;
-            }
-            
-            wchar_t wc = buffer[y][x];
-            output_buffer[buffer_pos++] = wc;
-        }
-        output_buffer[buffer_pos++] = L'\n';
-    }
+    c3d_outreserve(o, n);
+    while (n) o->data[o->len++] = tmp[--n];
+}
 
-    buffer_pos += swprintf(&output_buffer[buffer_pos], output_buffer_size - buffer_pos, L"\x1b[0m");
+/**
+ * Appends n bytes of src encoded as base64.
+ */
+STDC3DDEF void c3d_outbase64(c3d_outbuf *o, const c3d_intuc *src, size_t n){
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    c3d_outreserve(o, (n + 2) / 3 * 4);
+    char *dst = o->data + o->len;
+
+    size_t i = 0;
+    for (; i + 2 < n; i += 3){
+        c3d_intui v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+        *dst++ = table[(v >> 18) & 63];
+        *dst++ = table[(v >> 12) & 63];
+        *dst++ = table[(v >> 6) & 63];
+        *dst++ = table[v & 63];
+    }
+    if (i < n){
+        c3d_intui v = src[i] << 16;
+        if (i + 1 < n) v |= src[i + 1] << 8;
+        *dst++ = table[(v >> 18) & 63];
+        *dst++ = table[(v >> 12) & 63];
+        *dst++ = (i + 1 < n) ? table[(v >> 6) & 63] : '=';
+        *dst++ = '=';
+    }
 
-    DWORD written;
-    WriteConsoleW(hConsole, output_buffer, (DWORD)buffer_pos, &written, NULL);
+    o->len = dst - o->data;
 }
 
 /**
- * Compute illumination for a given material using Blinn-Phong's algorithm.
- * 
- * https://en.wikipedia.org/wiki/Blinn–Phong_reflection_model
+ * Writes len bytes to a handle. WriteFile may return before everything
+ * is written, so we keep going from where it stopped until the data is
+ * drained or the handle fails.
  */
-STDC3DDEF void c3d_bphongshade(display *d, vec3 normal, vec3 space, material *mtl, vec3 *out_ambient, vec3 *out_diffuse, vec3 *out_specular) {
-    *out_ambient = mtl->ambient_color; 
-    out_diffuse->x = 0.0f; out_diffuse->y = 0.0f; out_diffuse->z = 0.0f;
-    out_specular->x = 0.0f; out_specular->y = 0.0f; out_specular->z = 0.0f;
+STDC3DDEF bool c3d_outwrite(HANDLE h, const char *data, size_t len){
+    size_t off = 0;
+    while (off < len){
+        DWORD written = 0;
+        if (!WriteFile(h, data + off, (DWORD)(len - off), &written, NULL) || written == 0) return false;
+        off += written;
+    }
+    return true;
+}
 
-    for (int i = 0; i < d->light_count; i++) {
-        light L = d->lights[i];
+/**
+ * Returns the handle a display's frames are written to.
+ */
+STDC3DDEF HANDLE c3d_outhandle(display *d){
+    return (d->out != NULL) ? d->out : hConsole;
+}
 
-        vec3 toLight = {L.position.x - space.x, L.position.y - space.y, L.position.z - space.z};
-        float dist = sqrtf(toLight.x*toLight.x + toLight.y*toLight.y + toLight.z*toLight.z);
-        if (dist <= 0.0001f) dist = 0.0001f;
-        c3d_vec3normalize(&toLight);
+STDC3DDEF void c3d_writerstart(display *d);
+STDC3DDEF void c3d_writerstop(display *d);
 
-        float NdotL = max(0.0f, c3d_vec3dot(normal, toLight));
-        if (NdotL > 0.0f) {
-            if (dist > L.radius) continue; 
-            float attenuation = 1.0f / (1.0f + (dist / L.radius) * (dist / L.radius));
+/**
+ * Sends a display's frames back to the console, closing the file or
+ * pipe c3d_outopen() opened. Standard output is left open.
+ */
+STDC3DDEF void c3d_outclose(display *d){
+    if (d->out == NULL) return;
 
-            vec3 viewDir = {d->camera.pos.x - space.x, d->camera.pos.y - space.y, d->camera.pos.z - space.z};
-            c3d_vec3normalize(&viewDir);
+    bool writer = (d->writer != NULL);
+    if (writer) c3d_writerstop(d);
 
-            vec3 halfDir = {viewDir.x + toLight.x, viewDir.y + toLight.y, viewDir.z + toLight.z};
-            c3d_vec3normalize(&halfDir);
+    if (d->out != GetStdHandle(STD_OUTPUT_HANDLE)) CloseHandle(d->out);
+    d->out = NULL;
+    d->stream_width = 0;
+    d->stream_height = 0;
 
-            float NdotH = max(0.0f, c3d_vec3dot(normal, halfDir));
-            float specular_factor = powf(NdotH, mtl->shininess);
+    if (writer) c3d_writerstart(d);
+}
 
-            out_diffuse->x += mtl->diffuse_color.x * L.color.x * L.brightness;
-            out_diffuse->y += mtl->diffuse_color.y * L.color.y * L.brightness;
-            out_diffuse->z += mtl->diffuse_color.z * L.color.z * L.brightness;
+/**
+ * Sends a display's frames somewhere other than the console: standard
+ * output when path is NULL or "-", otherwise a file or an existing
+ * named pipe (\\.\pipe\name). Together with setting the display size
+ * by hand instead of calling c3d_wininit(), this lets C3D run headless.
+ * Whatever an earlier call opened is closed, and a running writer is
+ * restarted on the new output.
+ */
+STDC3DDEF bool c3d_outopen(display *d, const char *path){
+    HANDLE h;
+    if (path == NULL || !strcmp(path, "-")){
+        h = GetStdHandle(STD_OUTPUT_HANDLE);
+    } else {
+        bool pipe = !strncmp(path, "\\\\.\\pipe\\", 9);
+        h = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, pipe ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
 
-            out_specular->x += mtl->specular_color.x * L.color.x * L.brightness * specular_factor * attenuation;
-            out_specular->y += mtl->specular_color.y * L.color.y * L.brightness * specular_factor * attenuation;
-            out_specular->z += mtl->specular_color.z * L.color.z * L.brightness * specular_factor * attenuation;
-        }
+    if (h == NULL || h == INVALID_HANDLE_VALUE){
+        fprintf(stderr, "Could not open output %s.\n", path ? path : "-");
+        return false;
     }
 
-    out_ambient->x = C3D_CLAMP(out_ambient->x, 0.0f, 1.0f);
-    out_ambient->y = C3D_CLAMP(out_ambient->y, 0.0f, 1.0f);
-    out_ambient->z = C3D_CLAMP(out_ambient->z, 0.0f, 1.0f);
+    bool writer = (d->writer != NULL);
+    if (writer) c3d_writerstop(d);
+    c3d_outclose(d);
 
-    out_diffuse->x = C3D_CLAMP(out_diffuse->x, 0.0f, 1.0f);
-    out_diffuse->y = C3D_CLAMP(out_diffuse->y, 0.0f, 1.0f);
-    out_diffuse->z = C3D_CLAMP(out_diffuse->z, 0.0f, 1.0f);
+    d->out = h;
+    d->stream_width = 0;
+    d->stream_height = 0;
 
-    out_specular->x = C3D_CLAMP(out_specular->x, 0.0f, 1.0f);
-    out_specular->y = C3D_CLAMP(out_specular->y, 0.0f, 1.0f);
-    out_specular->z = C3D_CLAMP(out_specular->z, 0.0f, 1.0f);
+    if (writer) c3d_writerstart(d);
+    return true;
 }
 
 /**
- * Samples a texture
+ * Writes the whole buffer to the display's output and empties it.
  */
-STDC3DDEF vec3 c3d_texsample(texture *tex, float u, float v) {
-    if (tex->data == NULL) {
-        vec3 default_color = {1.0f, 1.0f, 1.0f};
-        return default_color;
-    }
+STDC3DDEF void c3d_outflush(display *d, c3d_outbuf *o){
+    c3d_outwrite(c3d_outhandle(d), o->data, o->len);
+    o->len = 0;
+}
 
-    u = C3D_CLAMP(u, 0.0f, 1.0f);
-    v = C3D_CLAMP(v, 0.0f, 1.0f);
+/**
+ * The writer thread. Waits for a pending frame, takes it and writes it
+ * without holding the lock, so the render thread is never stuck behind
+ * a slow terminal.
+ */
+STDC3DDEF DWORD WINAPI c3d_writerloop(LPVOID arg){
+    c3d_writer *w = (c3d_writer *)arg;
 
-    int tex_x = (int)(u * (tex->width - 1));
-    int tex_y = (int)((1.0f - v) * (tex->height - 1)); 
+    EnterCriticalSection(&w->lock);
+    while (true){
+        while (w->running && w->pending < 0){
+            SleepConditionVariableCS(&w->wake, &w->lock, INFINITE);
+        }
+        if (w->pending < 0) break;
 
-    int index = tex_y * tex->width + tex_x;
+        int idx = w->pending;
+        w->pending = -1;
+        w->writing = idx;
+        LeaveCriticalSection(&w->lock);
 
-    vec3 color = tex->data[index];
+        c3d_outbuf *b = &w->bufs[idx];
+        bool ok = c3d_outwrite(w->out, b->data, b->len);
 
-    color.x = C3D_CLAMP(color.x, 0.0f, 1.0f);
-    color.y = C3D_CLAMP(color.y, 0.0f, 1.0f);
-    color.z = C3D_CLAMP(color.z, 0.0f, 1.0f);
+        EnterCriticalSection(&w->lock);
+        w->writing = -1;
+        if (ok) w->written++;
+    }
+    LeaveCriticalSection(&w->lock);
 
-    return color;
+    return 0;
 }
 
-STDC3DDEF void c3d_bresenham(display *d, wchar_t **buffer, wchar_t **colorBuffer, vec2 v0, vec2 v1){
+/**
+ * Starts writing a display's frames asynchronously to the console.
+ */
+STDC3DDEF void c3d_writerstart(display *d){
+    if (d->writer != NULL) return;
 
-    int x1 = v0.x;
-    int y1 = v0.y;
+    c3d_writer *w = (c3d_writer *)calloc(1, sizeof(c3d_writer));
+    if (w == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_writerstart.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    int x2 = v1.x;
-    int y2 = v1.y;
+    // preallocate the ring for a full screen of ANSI output
+    for (int i = 0; i < C3D_WRITER_RING; i++){
+        c3d_outreserve(&w->bufs[i], (size_t)d->display_width * d->display_height * C3D_ANSI_CELL_MAX);
+    }
 
-    int dx = abs(x2 - x1);
-    int dy = abs(y2 - y1);
+    w->encoding = -1;
+    w->pending = -1;
+    w->writing = -1;
+    w->out = c3d_outhandle(d);
+    w->running = true;
+    InitializeCriticalSection(&w->lock);
+    InitializeConditionVariable(&w->wake);
+
+    w->thread = CreateThread(NULL, 0, c3d_writerloop, w, 0, NULL);
+    if (w->thread == NULL){
+        fprintf(stderr, "Failed to start the writer thread, writing synchronously.\n");
+        DeleteCriticalSection(&w->lock);
+        for (int i = 0; i < C3D_WRITER_RING; i++) free(w->bufs[i].data);
+        free(w);
+        return;
+    }
 
-    int sx = x1 < x2 ? 1 : -1;
-    int sy = y1 < y2 ? 1 : -1;
-    int err = dx - dy;
+    d->writer = w;
+}
 
-    while (1) {
-        if (x1 >= 0 && x1 < d->display_width && y1 >= 0 && y1 < d->display_height) {
-            COLORREF color = RGB(255, 255, 255);
-            buffer[y1][x1] = C3D_PXCHAR;
-            colorBuffer[y1][x1] = color;
-        }
+/**
+ * Stops the writer. The last pending frame is written before it stops.
+ */
+STDC3DDEF void c3d_writerstop(display *d){
+    c3d_writer *w = d->writer;
+    if (w == NULL) return;
+
+    EnterCriticalSection(&w->lock);
+    w->running = false;
+    WakeConditionVariable(&w->wake);
+    LeaveCriticalSection(&w->lock);
+
+    WaitForSingleObject(w->thread, INFINITE);
+    CloseHandle(w->thread);
+    DeleteCriticalSection(&w->lock);
+
+    for (int i = 0; i < C3D_WRITER_RING; i++) free(w->bufs[i].data);
+    free(w);
+    d->writer = NULL;
+}
 
-        if (x1 == x2 && y1 == y2) break;
+/**
+ * Hands the render thread an empty buffer to encode the next frame into.
+ * With three buffers there's always one that is neither waiting nor
+ * being written.
+ */
+STDC3DDEF c3d_outbuf *c3d_writeracquire(c3d_writer *w){
+    EnterCriticalSection(&w->lock);
+    int idx = 0;
+    while (idx == w->pending || idx == w->writing) idx++;
+    w->encoding = idx;
+    LeaveCriticalSection(&w->lock);
 
-        int e2 = 2 * err;
-        if (e2 > -dy) {
-            err -= dy;
-            x1 += sx;
-        }
-        if (e2 < dx) {
-            err += dx;
-            y1 += sy;
-        }
-    }
+    w->bufs[idx].len = 0;
+    return &w->bufs[idx];
 }
 
 /**
- * Algorithm to fill triangles on any given display.
+ * Gives the encoded buffer to the writer thread. If the previous frame
+ * is still waiting, it is stale by now and gets dropped.
  */
-STDC3DDEF void c3d_rasterize(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer,
-               vec3 v0_ndc, vec3 v1_ndc, vec3 v2_ndc,
-               float w0_clip, float w1_clip, float w2_clip,
-               tri t, material *mtl) {
+STDC3DDEF void c3d_writersubmit(c3d_writer *w){
+    EnterCriticalSection(&w->lock);
+    if (w->pending >= 0) w->dropped++;
+    w->pending = w->encoding;
+    w->encoding = -1;
+    WakeConditionVariable(&w->wake);
+    LeaveCriticalSection(&w->lock);
+}
+
+/**
+ * Returns the buffer the next frame should be encoded into.
+ */
+STDC3DDEF c3d_outbuf *c3d_outbegin(display *d){
+    if (d->writer != NULL) return c3d_writeracquire(d->writer);
+    d->outbuf.len = 0;
+    return &d->outbuf;
+}
+
+/**
+ * Sends an encoded frame out, through the writer thread if there is one.
+ */
+STDC3DDEF void c3d_outend(display *d, c3d_outbuf *o){
+    if (d->writer != NULL) c3d_writersubmit(d->writer);
+    else                   c3d_outflush(d, o);
+}
+
+/**
+ * Encodes a code point as UTF-8 into dst and returns its length.
+ * Lone UTF-16 surrogates aren't characters, they come out as U+FFFD.
+ */
+STDC3DDEF int c3d_utf8(char *dst, c3d_intui c){
+    if (c >= 0xD800 && c <= 0xDFFF) c = 0xFFFD;
+    if (c < 0x80) {
+        dst[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        dst[0] = (char)(0xC0 | (c >> 6));
+        dst[1] = (char)(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c >= 0x10000) {
+        dst[0] = (char)(0xF0 | ((c >> 18) & 0x07));
+        dst[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+        dst[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+        dst[3] = (char)(0x80 | (c & 0x3F));
+        return 4;
+    }
+    dst[0] = (char)(0xE0 | ((c >> 12) & 0x0F));
+    dst[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+    dst[2] = (char)(0x80 | (c & 0x3F));
+    return 3;
+}
+
+/**
+ * Writes a color channel (0-255) in decimal into dst and returns
+ * the position right after it.
+ */
+STDC3DDEF char *c3d_utoa8(char *dst, int v){
+    if (v >= 100) *dst++ = (char)('0' + v / 100);
+    if (v >= 10)  *dst++ = (char)('0' + v / 10 % 10);
+    *dst++ = (char)('0' + v % 10);
+    return dst;
+}
+
+/**
+ * Encodes the rows [y0, y1) of the framebuffer as ANSI truecolor
+ * glyphs into the band's slice. Every band starts without a known
+ * foreground color, so bands can be encoded in any order and on
+ * any thread. Where wchar_t is UTF-16, a glyph outside the BMP
+ * takes two cells, a surrogate pair, sent as one character.
+ */
+STDC3DDEF void c3d_bandencode(c3d_band *b){
+    char *p = b->out;
+
+    COLORREF lastColor = 0xFFFFFFFF;
+
+    for (int y = b->y0; y < b->y1; y++) {
+        for (int x = 0; x < b->width; x++) {
+            COLORREF color = b->colorBuffer[y][x];
+            wchar_t wc = b->buffer[y][x];
+
+            // a blank only shows the background, its color doesn't matter
+            if (color != lastColor && wc != L' ') {
+                memcpy(p, "\x1b[38;2;", 7);
+                p = c3d_utoa8(p + 7, GetRValue(color));
+                *p++ = ';';
+                p = c3d_utoa8(p, GetGValue(color));
+                *p++ = ';';
+                p = c3d_utoa8(p, GetBValue(color));
+                *p++ = 'm';
+                lastColor = color;
+            }
+
+            c3d_intui cp = (c3d_intui)wc;
+            if (cp >= 0xD800 && cp <= 0xDBFF && x + 1 < b->width) {
+                c3d_intui lo = (c3d_intui)b->buffer[y][x + 1];
+                if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    x++;
+                }
+            }
+            p += c3d_utf8(p, cp);
+        }
+        *p++ = '\n';
+    }
+
+    b->len = p - b->out;
+}
+
+/**
+ * Takes bands off the pool's current frame and encodes them until
+ * none are left. Called with the pool's lock held.
+ */
+STDC3DDEF void c3d_encpooldrain(c3d_encpool *pool){
+    while (pool->next < pool->band_count){
+        c3d_band *b = &pool->bands[pool->next++];
+        LeaveCriticalSection(&pool->lock);
+
+        c3d_bandencode(b);
+
+        EnterCriticalSection(&pool->lock);
+        if (--pool->busy == 0) WakeConditionVariable(&pool->done);
+    }
+}
+
+/**
+ * An encoder thread. Sleeps until a new frame is handed out, helps
+ * encode it and goes back to sleep.
+ */
+STDC3DDEF DWORD WINAPI c3d_encpoolloop(LPVOID arg){
+    c3d_encpool *pool = (c3d_encpool *)arg;
+
+    EnterCriticalSection(&pool->lock);
+    c3d_intui seen = pool->frame;
+    while (true){
+        while (pool->running && pool->frame == seen){
+            SleepConditionVariableCS(&pool->wake, &pool->lock, INFINITE);
+        }
+        if (!pool->running) break;
+
+        seen = pool->frame;
+        c3d_encpooldrain(pool);
+    }
+    LeaveCriticalSection(&pool->lock);
+
+    return 0;
+}
+
+/**
+ * Starts the display's encoder threads, one less than C3D_ENCODE_BANDS
+ * since the render thread encodes too. If none can be started the
+ * bands are simply all encoded by the render thread.
+ */
+STDC3DDEF void c3d_encpoolstart(display *d){
+    if (d->encpool != NULL) return;
+
+    c3d_encpool *pool = (c3d_encpool *)calloc(1, sizeof(c3d_encpool));
+    if (pool == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_encpoolstart.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pool->running = true;
+    InitializeCriticalSection(&pool->lock);
+    InitializeConditionVariable(&pool->wake);
+    InitializeConditionVariable(&pool->done);
+
+    for (int i = 1; i < C3D_ENCODE_BANDS; i++){
+        HANDLE t = CreateThread(NULL, 0, c3d_encpoolloop, pool, 0, NULL);
+        if (t == NULL) break;
+        pool->threads[pool->thread_count++] = t;
+    }
+
+    d->encpool = pool;
+}
+
+/**
+ * Stops the display's encoder threads and frees the pool.
+ */
+STDC3DDEF void c3d_encpoolstop(display *d){
+    c3d_encpool *pool = d->encpool;
+    if (pool == NULL) return;
+
+    EnterCriticalSection(&pool->lock);
+    pool->running = false;
+    WakeAllConditionVariable(&pool->wake);
+    LeaveCriticalSection(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++){
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+    }
+    DeleteCriticalSection(&pool->lock);
+
+    free(pool);
+    d->encpool = NULL;
+}
+
+/**
+ * Encodes a frame's bands on the pool and returns once all are done.
+ */
+STDC3DDEF void c3d_encpoolrun(c3d_encpool *pool, c3d_band *bands, int count){
+    EnterCriticalSection(&pool->lock);
+    pool->bands = bands;
+    pool->band_count = count;
+    pool->next = 0;
+    pool->busy = count;
+    pool->frame++;
+    WakeAllConditionVariable(&pool->wake);
+
+    c3d_encpooldrain(pool);
+    while (pool->busy > 0){
+        SleepConditionVariableCS(&pool->done, &pool->lock, INFINITE);
+    }
+    pool->bands = NULL;
+    LeaveCriticalSection(&pool->lock);
+}
+
+/**
+ * Plain text output for the ASCII backend: the ramp glyphs row by row,
+ * without a single escape. The cursor is only sent home when writing to
+ * a terminal, so pipes and log files get clean text. Anything drawn
+ * with a wider glyph, like C3D_PXCHAR, gets the densest ramp glyph.
+ */
+STDC3DDEF void c3d_asciiencode(display *d, wchar_t **buffer, c3d_outbuf *o){
+    static const char ramp[] = C3D_ASCII_RAMP;
+    const char dense = ramp[sizeof(ramp) - 2];
+
+    int w = d->display_width;
+    int h = d->display_height;
+
+    if (GetFileType(c3d_outhandle(d)) == FILE_TYPE_CHAR) c3d_outstr(o, "\x1b[H");
+
+    c3d_outreserve(o, (size_t)h * (w + 1));
+    for (int y = 0; y < h; y++){
+        for (int x = 0; x < w; x++){
+            wchar_t wc = buffer[y][x];
+            o->data[o->len++] = ((c3d_intui)wc < 0x80) ? (char)wc : dense;
+        }
+        o->data[o->len++] = '\n';
+    }
+}
+
+STDC3DDEF COLORREF c3d_bgcolor(display *d);
+
+/**
+ * Converts n COLORREFs to the Y, U and V planes of BT.601 limited range
+ * video, 8 pixels at a time with SSE2 when available.
+ *
+ *     Y = (( 66R + 129G +  25B + 128) >> 8) +  16
+ *     U = ((-38R -  74G + 112B + 128) >> 8) + 128
+ *     V = ((112R -  94G -  18B + 128) >> 8) + 128
+ */
+STDC3DDEF void c3d_rgb2yuv(const COLORREF *src, int n, c3d_intuc *py, c3d_intuc *pu, c3d_intuc *pv){
+    int i = 0;
+
+    #ifdef C3D_SSE2
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i yoff = _mm_set1_epi16(16);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 8 <= n; i += 8){
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+
+        __m128i r = _mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+        __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), mask), _mm_and_si128(_mm_srli_epi32(b, 8), mask));
+        __m128i bl = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 16), mask), _mm_and_si128(_mm_srli_epi32(b, 16), mask));
+
+        // Y peaks at 56228, which only fits as unsigned, hence the logical shift
+        __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+        y = _mm_add_epi16(y, _mm_mullo_epi16(bl, _mm_set1_epi16(25)));
+        y = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(y, round), 8), yoff);
+
+        __m128i u = _mm_sub_epi16(_mm_mullo_epi16(bl, _mm_set1_epi16(112)), _mm_mullo_epi16(r, _mm_set1_epi16(38)));
+        u = _mm_sub_epi16(u, _mm_mullo_epi16(g, _mm_set1_epi16(74)));
+        u = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(u, round), 8), round);
+
+        __m128i v = _mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)), _mm_mullo_epi16(g, _mm_set1_epi16(94)));
+        v = _mm_sub_epi16(v, _mm_mullo_epi16(bl, _mm_set1_epi16(18)));
+        v = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(v, round), 8), round);
+
+        _mm_storel_epi64((__m128i *)(py + i), _mm_packus_epi16(y, zero));
+        _mm_storel_epi64((__m128i *)(pu + i), _mm_packus_epi16(u, zero));
+        _mm_storel_epi64((__m128i *)(pv + i), _mm_packus_epi16(v, zero));
+    }
+    #endif
+
+    for (; i < n; i++){
+        int r = GetRValue(src[i]);
+        int g = GetGValue(src[i]);
+        int b = GetBValue(src[i]);
+        py[i] = (c3d_intuc)((( 66 * r + 129 * g +  25 * b + 128) >> 8) +  16);
+        pu[i] = (c3d_intuc)(((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128);
+        pv[i] = (c3d_intuc)(((112 * r -  94 * g -  18 * b + 128) >> 8) + 128);
+    }
+}
+
+/**
+ * YUV4MPEG2 output, 4:4:4 so every framebuffer pixel keeps its own color.
+ *
+ * The header goes out once per stream, and frames that don't match the
+ * announced size are cropped or padded with the background, since Y4M
+ * can't change size mid-stream. Don't combine it with the asynchronous
+ * writer if every frame matters, as that one drops frames to keep up.
+ *
+ * https://wiki.multimedia.cx/index.php/YUV4MPEG2
+ */
+STDC3DDEF void c3d_y4mencode(display *d, wchar_t **buffer, COLORREF **colorBuffer, c3d_outbuf *o){
+    c3d_encscratch *sc = &d->scratch;
+
+    if (d->stream_width == 0){
+        d->stream_width = d->display_width;
+        d->stream_height = d->display_height;
+
+        c3d_outstr(o, "YUV4MPEG2 W");
+        c3d_outuint(o, d->stream_width);
+        c3d_outstr(o, " H");
+        c3d_outuint(o, d->stream_height);
+        c3d_outstr(o, " F");
+        c3d_outuint(o, C3D_Y4M_FPS);
+        c3d_outstr(o, ":1 Ip A1:1 C444\n");
+    }
+
+    int w = d->stream_width;
+    int h = d->stream_height;
+    int fw = min(w, (int)d->display_width);
+    int fh = min(h, (int)d->display_height);
+    size_t n = (size_t)w * h;
+    COLORREF bg = c3d_bgcolor(d);
+
+    if ((size_t)w > sc->row_cap){
+        sc->row = (COLORREF *)realloc(sc->row, w * sizeof(COLORREF));
+        if (sc->row == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_y4mencode.\n");
+            exit(EXIT_FAILURE);
+        }
+        sc->row_cap = w;
+    }
+    COLORREF *row = sc->row;
+
+    c3d_outstr(o, "FRAME\n");
+    c3d_outreserve(o, n * 3);
+    c3d_intuc *py = (c3d_intuc *)o->data + o->len;
+    c3d_intuc *pu = py + n;
+    c3d_intuc *pv = pu + n;
+
+    for (int y = 0; y < h; y++){
+        int x = 0;
+        if (y < fh){
+            for (; x < fw; x++) row[x] = (buffer[y][x] == L' ') ? bg : colorBuffer[y][x];
+        }
+        for (; x < w; x++) row[x] = bg;
+
+        c3d_rgb2yuv(row, w, py + (size_t)y * w, pu + (size_t)y * w, pv + (size_t)y * w);
+    }
+
+    o->len += n * 3;
+}
+
+/**
+ * Returns the display's background color as a COLORREF.
+ */
+STDC3DDEF COLORREF c3d_bgcolor(display *d){
+    int bgr = (int)(d->background_color.x);
+    int bgg = (int)(d->background_color.y);
+    int bgb = (int)(d->background_color.z);
+
+    bgr = C3D_CLAMP(bgr, 0, 255);
+    bgg = C3D_CLAMP(bgg, 0, 255);
+    bgb = C3D_CLAMP(bgb, 0, 255);
+
+    return RGB(bgr, bgg, bgb);
+}
+
+/**
+ * qsort comparator, sorts 64-bit keys in descending order.
+ */
+STDC3DDEF int c3d_u64desc(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x < y) - (x > y);
+}
+
+/**
+ * Sixel output with a per-frame adaptive palette.
+ *
+ * The frame is reduced to 15-bit colors, the C3D_SIXEL_COLORS most
+ * used ones become the palette and every other color is mapped to
+ * the palette entry nearest to the center of its coarse color cell
+ * (4 bits per channel), so the nearest search runs once per cell
+ * instead of once per color. Each band of 6 rows is then written as
+ * one run-length encoded sixel row per palette color present in it.
+ *
+ * https://vt100.net/docs/vt3xx-gp/chapter14.html
+ */
+STDC3DDEF void c3d_sixelencode(display *d, wchar_t **buffer, COLORREF **colorBuffer, c3d_outbuf *o){
+    c3d_encscratch *sc = &d->scratch;
+
+    int w = d->display_width;
+    int h = d->display_height;
+    COLORREF bg = c3d_bgcolor(d);
+
+    if (sc->hist == NULL){
+        sc->hist = (c3d_intui *)malloc(32768 * sizeof(c3d_intui));
+        sc->lut = (c3d_intus *)malloc(32768 * sizeof(c3d_intus));
+        sc->used = (uint64_t *)malloc(32768 * sizeof(uint64_t));
+        sc->nearest = (c3d_intus *)malloc(4096 * sizeof(c3d_intus));
+        if (sc->hist == NULL || sc->lut == NULL || sc->used == NULL || sc->nearest == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_sixelencode.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c3d_intui *hist = sc->hist;
+    c3d_intus *lut = sc->lut;
+    uint64_t *used = sc->used;
+    c3d_intus *nearest = sc->nearest;
+
+    size_t rows_size = (size_t)C3D_SIXEL_COLORS * w;
+    if (rows_size > sc->rows_cap){
+        sc->rows = (c3d_intuc *)realloc(sc->rows, rows_size);
+        if (sc->rows == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_sixelencode.\n");
+            exit(EXIT_FAILURE);
+        }
+        sc->rows_cap = rows_size;
+    }
+    c3d_intuc *rows = sc->rows;
+
+    memset(hist, 0, 32768 * sizeof(c3d_intui));
+    for (int y = 0; y < h; y++){
+        for (int x = 0; x < w; x++){
+            COLORREF c = (buffer[y][x] == L' ') ? bg : colorBuffer[y][x];
+            hist[C3D_RGB15(c)]++;
+        }
+    }
+
+    // Most used colors first. The count is packed above the color so
+    // a plain integer sort orders by popularity.
+    int usedc = 0;
+    for (int i = 0; i < 32768; i++){
+        if (hist[i]) used[usedc++] = ((uint64_t)hist[i] << 16) | i;
+    }
+    if (usedc > C3D_SIXEL_COLORS){
+        qsort(used, usedc, sizeof(uint64_t), c3d_u64desc);
+    }
+
+    int palc = min(usedc, C3D_SIXEL_COLORS);
+    for (int i = 0; i < palc; i++){
+        lut[used[i] & 0x7FFF] = (c3d_intus)i;
+    }
+    if (usedc > palc){
+        memset(nearest, 0xFF, 4096 * sizeof(c3d_intus));
+    }
+    for (int i = palc; i < usedc; i++){
+        int c = used[i] & 0x7FFF;
+        int cell = ((c >> 11) << 8) | (((c >> 6) & 15) << 4) | ((c >> 1) & 15);
+
+        if (nearest[cell] == 0xFFFF){
+            // the center of the cell, in 15-bit color units
+            int cr = ((cell >> 8) << 1) | 1;
+            int cg = (((cell >> 4) & 15) << 1) | 1;
+            int cb = ((cell & 15) << 1) | 1;
+
+            int best = 0, best_dist = INT32_MAX;
+            for (int j = 0; j < palc; j++){
+                int p = used[j] & 0x7FFF;
+                int dr = cr - ((p >> 10) & 31);
+                int dg = cg - ((p >> 5) & 31);
+                int db = cb - (p & 31);
+                int dist = dr*dr + dg*dg + db*db;
+                if (dist < best_dist){
+                    best_dist = dist;
+                    best = j;
+                }
+            }
+            nearest[cell] = (c3d_intus)best;
+        }
+        lut[c] = nearest[cell];
+    }
+
+    c3d_outstr(o, "\x1b[H\x1bP0;1;0q\"1;1;");
+    c3d_outuint(o, w);
+    c3d_outchar(o, ';');
+    c3d_outuint(o, h);
+
+    for (int i = 0; i < palc; i++){
+        int c = used[i] & 0x7FFF;
+        c3d_outchar(o, '#');
+        c3d_outuint(o, i);
+        c3d_outstr(o, ";2;");
+        c3d_outuint(o, ((c >> 10) & 31) * 100 / 31);
+        c3d_outchar(o, ';');
+        c3d_outuint(o, ((c >> 5) & 31) * 100 / 31);
+        c3d_outchar(o, ';');
+        c3d_outuint(o, (c & 31) * 100 / 31);
+    }
+
+    bool present[C3D_SIXEL_COLORS] = {0};
+    c3d_intus list[C3D_SIXEL_COLORS];
+
+    for (int y0 = 0; y0 < h; y0 += 6){
+        int listc = 0;
+
+        for (int r = 0; r < 6 && y0 + r < h; r++){
+            int y = y0 + r;
+            for (int x = 0; x < w; x++){
+                COLORREF c = (buffer[y][x] == L' ') ? bg : colorBuffer[y][x];
+                c3d_intus idx = lut[C3D_RGB15(c)];
+                if (!present[idx]){
+                    present[idx] = true;
+                    list[listc++] = idx;
+                    memset(&rows[(size_t)idx * w], 0, w);
+                }
+                rows[(size_t)idx * w + x] |= (c3d_intuc)(1 << r);
+            }
+        }
+
+        for (int k = 0; k < listc; k++){
+            c3d_intuc *row = &rows[(size_t)list[k] * w];
+
+            // trailing empty sixels don't need to be sent
+            int end = w;
+            while (end > 0 && row[end - 1] == 0) end--;
+
+            c3d_outchar(o, '#');
+            c3d_outuint(o, list[k]);
+
+            for (int x = 0; x < end;){
+                int run = 1;
+                while (x + run < end && row[x + run] == row[x]) run++;
+
+                char sixel = (char)(63 + row[x]);
+                if (run > 3){
+                    c3d_outchar(o, '!');
+                    c3d_outuint(o, run);
+                    c3d_outchar(o, sixel);
+                } else {
+                    for (int i = 0; i < run; i++) c3d_outchar(o, sixel);
+                }
+                x += run;
+            }
+
+            c3d_outchar(o, (k + 1 < listc) ? '$' : '-');
+            present[list[k]] = false;
+        }
+    }
+
+    c3d_outstr(o, "\x1b\\");
+}
+
+/**
+ * Kitty graphics protocol output.
+ *
+ * The framebuffer is sent as raw 24-bit RGB (or 32-bit RGBA with empty
+ * cells left transparent when C3D_KITTY_RGBA is defined), zlib compressed
+ * when C3D_KITTY_ZLIB is defined, base64 encoded and split into chunks.
+ * Every frame reuses the same image id so the terminal replaces the last
+ * one instead of stacking them.
+ *
+ * https://sw.kovidgoyal.net/kitty/graphics-protocol/
+ */
+STDC3DDEF void c3d_kittyencode(display *d, wchar_t **buffer, COLORREF **colorBuffer, c3d_outbuf *o){
+    c3d_encscratch *sc = &d->scratch;
+
+    int w = d->display_width;
+    int h = d->display_height;
+    COLORREF bg = c3d_bgcolor(d);
+
+    #ifdef C3D_KITTY_RGBA
+    const int channels = 4;
+    #else
+    const int channels = 3;
+    #endif
+
+    size_t n = (size_t)w * h * channels;
+    if (n > sc->pixels_cap){
+        sc->pixels = (c3d_intuc *)realloc(sc->pixels, n);
+        if (sc->pixels == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_kittyencode.\n");
+            exit(EXIT_FAILURE);
+        }
+        sc->pixels_cap = n;
+    }
+    c3d_intuc *pixels = sc->pixels;
+
+    c3d_intuc *p = pixels;
+    for (int y = 0; y < h; y++){
+        for (int x = 0; x < w; x++){
+            bool empty = (buffer[y][x] == L' ');
+            COLORREF c = empty ? bg : colorBuffer[y][x];
+            *p++ = GetRValue(c);
+            *p++ = GetGValue(c);
+            *p++ = GetBValue(c);
+            #ifdef C3D_KITTY_RGBA
+            *p++ = empty ? 0 : 255;
+            #endif
+        }
+    }
+
+    const c3d_intuc *payload = pixels;
+    size_t payload_size = n;
+    bool compressed = false;
+
+    #ifdef C3D_KITTY_ZLIB
+    uLongf zn = compressBound((uLong)n);
+    if (zn > sc->zpixels_cap){
+        sc->zpixels = (c3d_intuc *)realloc(sc->zpixels, zn);
+        if (sc->zpixels == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_kittyencode.\n");
+            exit(EXIT_FAILURE);
+        }
+        sc->zpixels_cap = zn;
+    }
+    if (compress2(sc->zpixels, &zn, pixels, (uLong)n, 1) == Z_OK){
+        payload = sc->zpixels;
+        payload_size = zn;
+        compressed = true;
+    }
+    #endif
+
+    c3d_outstr(o, "\x1b[H");
+
+    // base64 turns 3 bytes into 4 characters, so this keeps each chunk
+    // at C3D_KITTY_CHUNK characters, as the protocol asks for.
+    size_t chunk = C3D_KITTY_CHUNK / 4 * 3;
+    size_t off = 0;
+    do {
+        size_t len = min(chunk, payload_size - off);
+        bool more = off + len < payload_size;
+
+        if (off == 0){
+            c3d_outstr(o, "\x1b_Ga=T,i=1,q=2,C=1,f=");
+            c3d_outuint(o, channels * 8);
+            c3d_outstr(o, ",s=");
+            c3d_outuint(o, w);
+            c3d_outstr(o, ",v=");
+            c3d_outuint(o, h);
+            if (compressed) c3d_outstr(o, ",o=z");
+            c3d_outstr(o, ",m=");
+        } else {
+            c3d_outstr(o, "\x1b_Gm=");
+        }
+        c3d_outchar(o, more ? '1' : '0');
+        c3d_outchar(o, ';');
+        c3d_outbase64(o, payload + off, len);
+        c3d_outstr(o, "\x1b\\");
+
+        off += len;
+    } while (off < payload_size);
+}
+
+/*
+ * =============================================================================
+ *               SHADING, TEXTURING, RENDERING AND RASTERIZING
+ * =============================================================================
+ */
+
+/**
+ * Function for displaying all buffers.
+ * 
+ * This function uses the ANSI escape character \033[ and defines
+ * 38;2 for coloring on the screen, and the last three digits,
+ * separated by the semicolons, are the R, G and B, 48;2 for bg
+ * coloring.
+ */ 
+STDC3DDEF void c3d_render(display *d, wchar_t **buffer, COLORREF **colorBuffer) {
+    c3d_outbuf *o = c3d_outbegin(d);
+
+    if (C3D_OUTPUT_ISBITMAP(d->output)) {
+        if (d->output == C3D_OUTPUT_SIXEL)      c3d_sixelencode(d, buffer, colorBuffer, o);
+        else if (d->output == C3D_OUTPUT_KITTY) c3d_kittyencode(d, buffer, colorBuffer, o);
+        else                                    c3d_y4mencode(d, buffer, colorBuffer, o);
+        c3d_outend(d, o);
+        return;
+    }
+
+    if (d->output == C3D_OUTPUT_ASCII) {
+        c3d_asciiencode(d, buffer, o);
+        c3d_outend(d, o);
+        return;
+    }
+
+    int w = d->display_width;
+    int h = d->display_height;
+    int bandc = min(C3D_ENCODE_BANDS, max(h, 1));
+    if ((size_t)w * h < C3D_ENCODE_MIN_CELLS) bandc = 1;
+
+    // Every band gets a worst-case slice of the same buffer so the
+    // threads never have to grow it, and the slices are packed back
+    // together afterwards for one single write.
+    size_t head = 64;
+    size_t rows_per_band = (h + bandc - 1) / bandc;
+    size_t band_cap = rows_per_band * ((size_t)w * C3D_ANSI_CELL_MAX + 1);
+
+    c3d_outreserve(o, head + band_cap * bandc + head);
+
+    COLORREF bg = c3d_bgcolor(d);
+    c3d_outstr(o, "\x1b[48;2;");
+    c3d_outuint(o, GetRValue(bg));
+    c3d_outchar(o, ';');
+    c3d_outuint(o, GetGValue(bg));
+    c3d_outchar(o, ';');
+    c3d_outuint(o, GetBValue(bg));
+    c3d_outstr(o, "m\x1b[H");
+
+    c3d_band bands[C3D_ENCODE_BANDS];
+
+    for (int i = 0; i < bandc; i++) {
+        bands[i].buffer = buffer;
+        bands[i].colorBuffer = colorBuffer;
+        bands[i].width = w;
+        bands[i].y0 = min((int)(i * rows_per_band), h);
+        bands[i].y1 = min((int)((i + 1) * rows_per_band), h);
+        bands[i].out = o->data + head + band_cap * i;
+        bands[i].len = 0;
+    }
+
+    if (bandc > 1) {
+        c3d_encpoolstart(d);
+        c3d_encpoolrun(d->encpool, bands, bandc);
+    } else {
+        c3d_bandencode(&bands[0]);
+    }
+
+    for (int i = 0; i < bandc; i++) {
+        memmove(o->data + o->len, bands[i].out, bands[i].len);
+        o->len += bands[i].len;
+    }
+
+    c3d_outstr(o, "\x1b[0m");
+    c3d_outend(d, o);
+}
+
+/**
+ * Whether a point is hidden from a light by its shadow map.
+ */
+STDC3DDEF bool c3d_shadowed(const c3d_shadowmap *sm, vec3 p){
+    vec3 v = {p.x - sm->position.x, p.y - sm->position.y, p.z - sm->position.z};
+    float ax = fabsf(v.x), ay = fabsf(v.y), az = fabsf(v.z);
+    int axis;
+    if (ax >= ay && ax >= az) axis = (v.x >= 0.0f) ? 0 : 1;
+    else if (ay >= az)        axis = (v.y >= 0.0f) ? 2 : 3;
+    else                      axis = (v.z >= 0.0f) ? 4 : 5;
+
+    int face = sm->face_of_axis[axis];
+    vec4 clip = c3d_mat4vec4(p, sm->faces[face]);
+    if (clip.w <= 0.0f) return false;
+
+    vec2 tex = c3d_project_vec3vec2((vec3){clip.x / clip.w, clip.y / clip.w, 0.0f}, sm->size, sm->size);
+    int tx = (int)c3d_clampf(tex.x, 0.0f, sm->size - 1);
+    int ty = (int)c3d_clampf(tex.y, 0.0f, sm->size - 1);
+
+    // a texel covers more of the surface the further it is, so the bias grows with it
+    float bias = C3D_SHADOW_BIAS + 2.0f * clip.w / sm->size;
+    return clip.w > sm->depth[((c3d_intui)face * sm->size + ty) * sm->size + tx] + bias;
+}
+
+/**
+ * The center of a mesh and the radius of a sphere around it that holds
+ * all of its vertices.
+ */
+STDC3DDEF void c3d_meshbounds(const mesh *m, vec3 *center, float *radius){
+    *center = (vec3){0.0f, 0.0f, 0.0f};
+    *radius = 0.0f;
+    if (m->tri_count <= 0) return;
+
+    *center = c3d_meshcenter(*m);
+    for (int i = 0; i < m->tri_count; i++){
+        const vec3 *v = &m->tris[i].vx;
+        for (int k = 0; k < 3; k++){
+            vec3 e = {v[k].x - center->x, v[k].y - center->y, v[k].z - center->z};
+            *radius = max(*radius, sqrtf(c3d_vec3dot(e, e)));
+        }
+    }
+}
+
+/**
+ * Computes the mesh's bounding sphere, as c3d_meshbounds() does, again
+ * if it was transformed since.
+ */
+STDC3DDEF void c3d_meshsphere(mesh *m){
+    if (m->sphere_version == m->version && m->sphere_version != 0) return;
+    m->sphere_version = m->version;
+    c3d_meshbounds(m, &m->sphere_center, &m->sphere_radius);
+}
+
+/**
+ * Computes the mesh's bounding box again if it was transformed since.
+ */
+STDC3DDEF void c3d_meshbox(mesh *m){
+    if (m->box_version == m->version && m->box_version != 0) return;
+    m->box_version = m->version;
+    m->box_min = (vec3){0.0f, 0.0f, 0.0f};
+    m->box_max = (vec3){0.0f, 0.0f, 0.0f};
+    if (m->tri_count <= 0) return;
+
+    m->box_min = m->box_max = m->tris[0].vx;
+    for (int i = 0; i < m->tri_count; i++){
+        const vec3 *v = &m->tris[i].vx;
+        for (int k = 0; k < 3; k++){
+            m->box_min.x = min(m->box_min.x, v[k].x);
+            m->box_min.y = min(m->box_min.y, v[k].y);
+            m->box_min.z = min(m->box_min.z, v[k].z);
+            m->box_max.x = max(m->box_max.x, v[k].x);
+            m->box_max.y = max(m->box_max.y, v[k].y);
+            m->box_max.z = max(m->box_max.z, v[k].z);
+        }
+    }
+}
+
+/**
+ * Whether a light is one of the dynamic lights if dynamic is 1, of the
+ * static ones if it is 0. Every light is if it is -1.
+ */
+STDC3DDEF bool c3d_lightkept(const light *L, int dynamic){
+    return dynamic < 0 || L->dynamic == (dynamic != 0);
+}
+
+/**
+ * Lays the display's lights out as arrays for c3d_bphongshade(), padded
+ * to a multiple of 4 with lights that never reach anything. Only the
+ * lights c3d_lightkept() keeps are laid out, minus the ones skip (if
+ * not NULL) is true for.
+ */
+STDC3DDEF void c3d_lightsoafill(c3d_lightsoa *soa, const display *d, int dynamic, const bool *skip){
+    c3d_intui kept = 0;
+    for (c3d_intui i = 0; i < d->light_count; i++){
+        if (c3d_lightkept(&d->lights[i], dynamic) && !(skip && skip[i])) kept++;
+    }
+    c3d_intui padded = (kept + 3) & ~3u;
+
+    if (padded > soa->cap){
+        free(soa->data);
+        free(soa->shadow);
+        soa->data = (float *)malloc(padded * 8 * sizeof(float));
+        soa->shadow = (const c3d_shadowmap **)malloc(padded * sizeof(c3d_shadowmap *));
+        if (soa->data == NULL || soa->shadow == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_lightsoafill.\n");
+            exit(EXIT_FAILURE);
+        }
+        soa->cap = padded;
+    }
+
+    soa->px = soa->data;
+    soa->py = soa->px + padded;
+    soa->pz = soa->py + padded;
+    soa->r = soa->pz + padded;
+    soa->g = soa->r + padded;
+    soa->b = soa->g + padded;
+    soa->radius2 = soa->b + padded;
+    soa->inv_radius2 = soa->radius2 + padded;
+
+    c3d_intui i = 0;
+    for (c3d_intui j = 0; j < d->light_count; j++){
+        const light *L = &d->lights[j];
+        if (!c3d_lightkept(L, dynamic) || (skip && skip[j])) continue;
+        soa->px[i] = L->position.x;
+        soa->py[i] = L->position.y;
+        soa->pz[i] = L->position.z;
+        soa->r[i] = L->color.x * L->brightness;
+        soa->g[i] = L->color.y * L->brightness;
+        soa->b[i] = L->color.z * L->brightness;
+        soa->radius2[i] = L->radius * L->radius;
+        soa->inv_radius2[i] = 1.0f / soa->radius2[i];
+        if (soa->shadow != NULL) soa->shadow[i] = d->shadow_size ? &d->shadows[j] : NULL;
+        i++;
+    }
+    for (; i < padded; i++){
+        soa->px[i] = soa->py[i] = soa->pz[i] = 0.0f;
+        soa->r[i] = soa->g[i] = soa->b[i] = 0.0f;
+        soa->radius2[i] = -1.0f;
+        soa->inv_radius2[i] = 0.0f;
+        if (soa->shadow != NULL) soa->shadow[i] = NULL;
+    }
+
+    soa->count = kept;
+    soa->built = d->draw_frame;
+    soa->padded = padded;
+    soa->shadowed = (d->shadow_size != 0);
+}
+
+/**
+ * Rebuilds the display's light arrays for this frame. All the lights are
+ * laid out even when baking, for c3d_rasterize() to shade with.
+ */
+STDC3DDEF void c3d_lightsoabuild(display *d){
+    c3d_lightsoafill(&d->lightsoa, d, -1, NULL);
+    if (d->bake.enabled){
+        c3d_lightsoafill(&d->bake.dynamic, d, 1, NULL);
+        c3d_lightsoafill(&d->bake.fixed, d, 0, NULL);
+    }
+}
+
+/**
+ * The diffuse light the static lights throw at a point, before the
+ * material's color. Matches the light loop of c3d_bphongshade().
+ */
+STDC3DDEF vec3 c3d_bakepoint(const display *d, vec3 normal, vec3 space){
+    vec3 sum = {0.0f, 0.0f, 0.0f};
+    c3d_vec3normalize(&normal);
+
+    for (c3d_intui i = 0; i < d->light_count; i++){
+        const light *L = &d->lights[i];
+        if (L->dynamic) continue;
+
+        vec3 toLight = {L->position.x - space.x, L->position.y - space.y, L->position.z - space.z};
+        float dist = sqrtf(toLight.x*toLight.x + toLight.y*toLight.y + toLight.z*toLight.z);
+        c3d_vec3normalize(&toLight);
+
+        if (c3d_vec3dot(normal, toLight) <= 0.0f || dist > L->radius) continue;
+        if (d->shadow_size && c3d_shadowed(&d->shadows[i], space)) continue;
+        sum.x += L->color.x * L->brightness;
+        sum.y += L->color.y * L->brightness;
+        sum.z += L->color.z * L->brightness;
+    }
+    return sum;
+}
+
+/**
+ * Bakes the static lights' diffuse light at every triangle corner of a
+ * mesh.
+ */
+STDC3DDEF void c3d_bakemesh(display *d, mesh *m){
+    if (m->tri_count > 0){
+        vec3 *baked = (vec3 *)realloc(m->baked, m->tri_count * 3 * sizeof(vec3));
+        if (baked == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_bakemesh.\n");
+            exit(EXIT_FAILURE);
+        }
+        m->baked = baked;
+    }
+
+    for (int i = 0; i < m->tri_count; i++){
+        const tri *t = &m->tris[i];
+        m->baked[i * 3 + 0] = c3d_bakepoint(d, t->nvx, t->vx);
+        m->baked[i * 3 + 1] = c3d_bakepoint(d, t->nvy, t->vy);
+        m->baked[i * 3 + 2] = c3d_bakepoint(d, t->nvz, t->vz);
+    }
+
+    m->baked_version = m->version;
+    m->baked_lights = d->bake.watch.version;
+    m->baked_shadows = d->shadow_version;
+}
+
+STDC3DDEF bool c3d_lightsame(const light *a, const light *b){
+    return a->position.x == b->position.x && a->position.y == b->position.y && a->position.z == b->position.z &&
+           a->color.x == b->color.x && a->color.y == b->color.y && a->color.z == b->color.z &&
+           a->brightness == b->brightness && a->radius == b->radius && a->dynamic == b->dynamic;
+}
+
+/**
+ * Compares the lights c3d_lightkept() keeps to the watch's copy of them,
+ * and takes a new copy and bumps the version if any was added, removed
+ * or changed.
+ */
+STDC3DDEF void c3d_lightwatchupdate(c3d_lightwatch *w, const display *d, int dynamic){
+    c3d_intui n = 0;
+    bool same = (w->version != 0);
+    for (c3d_intui i = 0; i < d->light_count; i++){
+        if (!c3d_lightkept(&d->lights[i], dynamic)) continue;
+        if (n >= w->count || !c3d_lightsame(&w->lights[n], &d->lights[i])) same = false;
+        n++;
+    }
+    if (n != w->count) same = false;
+    if (same) return;
+
+    light *copy = (light *)realloc(w->lights, (n ? n : 1) * sizeof(light));
+    if (copy == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_lightwatchupdate.\n");
+        exit(EXIT_FAILURE);
+    }
+    w->lights = copy;
+    n = 0;
+    for (c3d_intui i = 0; i < d->light_count; i++){
+        if (c3d_lightkept(&d->lights[i], dynamic)) w->lights[n++] = d->lights[i];
+    }
+    w->count = n;
+    w->version++;
+}
+
+/**
+ * Bakes again whatever went stale since the last frame: every mesh if a
+ * static light was added, removed or changed, otherwise only the meshes
+ * that were transformed.
+ */
+STDC3DDEF void c3d_bakeupdate(display *d){
+    c3d_bake *bk = &d->bake;
+    c3d_lightwatchupdate(&bk->watch, d, 0);
+
+    for (c3d_intui i = 0; i < d->mesh_count; i++){
+        mesh *m = &d->meshes[i];
+        if (m->baked == NULL || m->baked_version != m->version || m->baked_lights != bk->watch.version ||
+            m->baked_shadows != d->shadow_version){
+            c3d_bakemesh(d, m);
+        }
+    }
+}
+
+/**
+ * The baked light at a point of a triangle, from the light baked at its
+ * corners. Used for the corners of triangles cut by the near plane.
+ */
+STDC3DDEF vec3 c3d_bakedat(const tri *t, const vec3 *baked, vec3 p){
+    vec3 e0 = {t->vy.x - t->vx.x, t->vy.y - t->vx.y, t->vy.z - t->vx.z};
+    vec3 e1 = {t->vz.x - t->vx.x, t->vz.y - t->vx.y, t->vz.z - t->vx.z};
+    vec3 ep = {p.x - t->vx.x, p.y - t->vx.y, p.z - t->vx.z};
+
+    float d00 = c3d_vec3dot(e0, e0), d01 = c3d_vec3dot(e0, e1), d11 = c3d_vec3dot(e1, e1);
+    float d20 = c3d_vec3dot(ep, e0), d21 = c3d_vec3dot(ep, e1);
+    float denom = d00 * d11 - d01 * d01;
+    if (denom == 0.0f) return baked[0];
+
+    float b1 = (d11 * d20 - d01 * d21) / denom;
+    float b2 = (d00 * d21 - d01 * d20) / denom;
+    return c3d_vec3bary(baked[0], baked[1], baked[2], 1.0f - b1 - b2, b1, b2);
+}
+
+/**
+ * Splits the lights into the ones near a mesh and the ones further than
+ * d->sh_distance from its bounding sphere, and projects the latter onto
+ * its spherical harmonics. Baked lights are left to the bake.
+ */
+STDC3DDEF void c3d_shbuild(display *d, mesh *m){
+    c3d_shlights *sh = m->sh;
+    int candidates = d->bake.enabled ? 1 : -1;
+
+    c3d_meshsphere(m);
+    vec3 center = m->sphere_center;
+    float bound = m->sphere_radius;
+
+    bool *distant = (bool *)realloc(sh->distant, (d->light_count ? d->light_count : 1) * sizeof(bool));
+    if (distant == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_shbuild.\n");
+        exit(EXIT_FAILURE);
+    }
+    sh->distant = distant;
+
+    for (int k = 0; k < 4; k++) sh->coeffs[k] = (vec3){0.0f, 0.0f, 0.0f};
+
+    for (c3d_intui i = 0; i < d->light_count; i++){
+        const light *L = &d->lights[i];
+        vec3 dir = {L->position.x - center.x, L->position.y - center.y, L->position.z - center.z};
+        float dist = sqrtf(c3d_vec3dot(dir, dir));
+
+        sh->distant[i] = c3d_lightkept(L, candidates) && dist - bound > d->sh_distance;
+        if (!sh->distant[i] || dist > L->radius) continue;
+
+        dir.x /= dist; dir.y /= dist; dir.z /= dist;
+        vec3 c = {L->color.x * L->brightness, L->color.y * L->brightness, L->color.z * L->brightness};
+        float y[4] = {0.282095f, 0.488603f * dir.y, 0.488603f * dir.z, 0.488603f * dir.x};
+        for (int k = 0; k < 4; k++){
+            sh->coeffs[k].x += c.x * y[k];
+            sh->coeffs[k].y += c.y * y[k];
+            sh->coeffs[k].z += c.z * y[k];
+        }
+    }
+
+    c3d_lightsoafill(&sh->nearby, d, candidates, sh->distant);
+    sh->mesh_version = m->version;
+    sh->light_version = d->sh_watch.version;
+}
+
+/**
+ * Rebuilds the spherical harmonics of the meshes that moved, or of all
+ * of them if any light changed.
+ */
+STDC3DDEF void c3d_shupdate(display *d){
+    c3d_lightwatchupdate(&d->sh_watch, d, -1);
+
+    for (c3d_intui i = 0; i < d->mesh_count; i++){
+        mesh *m = &d->meshes[i];
+        if (m->sh == NULL){
+            m->sh = (c3d_shlights *)calloc(1, sizeof(c3d_shlights));
+            if (m->sh == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_shupdate.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (m->sh->mesh_version == m->version && m->sh->light_version == d->sh_watch.version){
+            continue;
+        }
+        c3d_shbuild(d, m);
+    }
+}
+
+/**
+ * The diffuse light the distant lights throw on a surface facing normal,
+ * before the material's color: the harmonics convolved with the
+ * hemisphere step, 2 pi for band 0 and pi for band 1.
+ */
+STDC3DDEF vec3 c3d_sheval(const c3d_shlights *sh, vec3 normal){
+    float y[4] = {
+        2.0f * C3D_PI * 0.282095f,
+        C3D_PI * 0.488603f * normal.y,
+        C3D_PI * 0.488603f * normal.z,
+        C3D_PI * 0.488603f * normal.x,
+    };
+    vec3 e = {0.0f, 0.0f, 0.0f};
+    for (int k = 0; k < 4; k++){
+        e.x += sh->coeffs[k].x * y[k];
+        e.y += sh->coeffs[k].y * y[k];
+        e.z += sh->coeffs[k].z * y[k];
+    }
+    e.x = max(e.x, 0.0f);
+    e.y = max(e.y, 0.0f);
+    e.z = max(e.z, 0.0f);
+    return e;
+}
+
+/**
+ * Frees what a mesh keeps for lighting. It is built again on the next
+ * frame if still needed.
+ */
+STDC3DDEF void c3d_meshfreelighting(mesh *m){
+    free(m->baked);
+    m->baked = NULL;
+    free(m->vlights);
+    free(m->vlight_ids);
+    m->vlights = NULL;
+    m->vlight_ids = NULL;
+    if (m->sh != NULL){
+        free(m->sh->distant);
+        free(m->sh->nearby.data);
+        free(m->sh);
+        m->sh = NULL;
+    }
+}
+
+/**
+ * Frees a mesh's levels of detail.
+ */
+STDC3DDEF void c3d_meshfreelods(mesh *m){
+    for (int i = 0; i < m->lod_count; i++) free(m->lods[i].tris);
+    free(m->lods);
+    m->lods = NULL;
+    m->lod_count = 0;
+    m->lod = 0;
+}
+
+/**
+ * Welds the corners of the level of detail a mesh is drawn with that
+ * share a position and a normal into one vertex, for per-vertex lighting
+ * to shade each of them once a frame. Nothing is done if they were welded
+ * for this version and level already.
+ */
+STDC3DDEF void c3d_meshweld(mesh *m){
+    if (m->vlights != NULL && m->vlight_version == m->version && m->vlight_lod == m->lod) return;
+
+    const tri *tris = m->lod ? m->lods[m->lod - 1].tris : m->tris;
+    int count = m->lod ? m->lods[m->lod - 1].tri_count : m->tri_count;
+    int slots = 1;
+    while (slots < count * 6) slots <<= 1;
+
+    free(m->vlights);
+    free(m->vlight_ids);
+    m->vlights = (c3d_vertexlight *)malloc((count ? count * 3 : 1) * sizeof(c3d_vertexlight));
+    m->vlight_ids = (c3d_intui *)malloc((count ? count * 3 : 1) * sizeof(c3d_intui));
+    int *table = (int *)malloc(slots * sizeof(int));
+    if (m->vlights == NULL || m->vlight_ids == NULL || table == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_meshweld.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < slots; i++) table[i] = -1;
+
+    // the table holds the first corner of each vertex
+    c3d_intui vertex_count = 0;
+    for (int i = 0; i < count * 3; i++){
+        vec3 p = (&tris[i / 3].vx)[i % 3], n = (&tris[i / 3].nvx)[i % 3];
+
+        int slot = (int)((c3d_vec3hash(p) ^ (c3d_vec3hash(n) * 2654435761u)) & (slots - 1));
+        while (table[slot] >= 0){
+            int f = table[slot];
+            vec3 fp = (&tris[f / 3].vx)[f % 3], fn = (&tris[f / 3].nvx)[f % 3];
+            if (fp.x == p.x && fp.y == p.y && fp.z == p.z && fn.x == n.x && fn.y == n.y && fn.z == n.z) break;
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (table[slot] < 0){
+            table[slot] = i;
+            m->vlights[vertex_count].frame = 0;
+            m->vlight_ids[i] = vertex_count++;
+        } else {
+            m->vlight_ids[i] = m->vlight_ids[table[slot]];
+        }
+    }
+    free(table);
+
+    m->vlight_version = m->version;
+    m->vlight_lod = m->lod;
+}
+
+#ifdef C3D_SSE2
+
+/**
+ * 1 / sqrt(x) on 4 lanes, to the same precision as c3d_rsqrtf().
+ */
+STDC3DDEF __m128 c3d_rsqrt4(__m128 x){
+    #if !defined(C3D_FASTMATH) || C3D_FASTMATH_BITS > 22
+    return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(x));
+    #else
+    __m128 r = _mm_rsqrt_ps(x);
+    #if C3D_FASTMATH_BITS > 11
+    __m128 rr = _mm_mul_ps(_mm_mul_ps(x, r), r);
+    r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_set1_ps(0.5f), rr)));
+    #endif
+    return r;
+    #endif
+}
+
+STDC3DDEF float c3d_hsum4(__m128 v){
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+/**
+ * The light loop of c3d_bphongshade(), 4 lights at a time. Adds the
+ * lights' diffuse and specular colors, before the material's, to
+ * out_diffuse and out_specular.
+ */
+STDC3DDEF void c3d_bphongshade4(const c3d_lightsoa *soa, vec3 normal, vec3 space, vec3 viewDir, float shininess,
+                                vec3 *out_diffuse, vec3 *out_specular){
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 sx = _mm_set1_ps(space.x), sy = _mm_set1_ps(space.y), sz = _mm_set1_ps(space.z);
+    __m128 nx = _mm_set1_ps(normal.x), ny = _mm_set1_ps(normal.y), nz = _mm_set1_ps(normal.z);
+    __m128 vx = _mm_set1_ps(viewDir.x), vy = _mm_set1_ps(viewDir.y), vz = _mm_set1_ps(viewDir.z);
+    __m128 dr = zero, dg = zero, db = zero;
+    __m128 sr = zero, sg = zero, sb = zero;
+
+    for (c3d_intui i = 0; i < soa->padded; i += 4){
+        __m128 lx = _mm_sub_ps(_mm_loadu_ps(soa->px + i), sx);
+        __m128 ly = _mm_sub_ps(_mm_loadu_ps(soa->py + i), sy);
+        __m128 lz = _mm_sub_ps(_mm_loadu_ps(soa->pz + i), sz);
+        __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+
+        // dist <= radius is len2 <= radius^2, padding has a negative radius^2
+        __m128 lit = _mm_and_ps(_mm_cmpgt_ps(len2, zero), _mm_cmple_ps(len2, _mm_loadu_ps(soa->radius2 + i)));
+        if (_mm_movemask_ps(lit) == 0) continue;
+
+        __m128 inv = c3d_rsqrt4(len2);
+        lx = _mm_mul_ps(lx, inv);
+        ly = _mm_mul_ps(ly, inv);
+        lz = _mm_mul_ps(lz, inv);
+
+        __m128 ndotl = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, lx), _mm_mul_ps(ny, ly)), _mm_mul_ps(nz, lz));
+        lit = _mm_and_ps(lit, _mm_cmpgt_ps(ndotl, zero));
+        int lanes = _mm_movemask_ps(lit);
+        if (lanes == 0) continue;
+
+        if (soa->shadowed) {
+            for (int k = 0; k < 4; k++) {
+                const c3d_shadowmap *sm = soa->shadow[i + k];
+                if ((lanes & (1 << k)) && sm != NULL && c3d_shadowed(sm, space)) lanes &= ~(1 << k);
+            }
+            if (lanes == 0) continue;
+            lit = _mm_castsi128_ps(_mm_set_epi32(-((lanes >> 3) & 1), -((lanes >> 2) & 1), -((lanes >> 1) & 1), -(lanes & 1)));
+        }
+
+        __m128 attenuation = _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(len2, _mm_loadu_ps(soa->inv_radius2 + i))));
+
+        __m128 hx = _mm_add_ps(vx, lx), hy = _mm_add_ps(vy, ly), hz = _mm_add_ps(vz, lz);
+        __m128 hlen2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(hx, hx), _mm_mul_ps(hy, hy)), _mm_mul_ps(hz, hz));
+        __m128 ndoth = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, hx), _mm_mul_ps(ny, hy)), _mm_mul_ps(nz, hz));
+        // a zero half vector stays zero when normalized, like c3d_vec3normalize() leaves it
+        ndoth = _mm_and_ps(_mm_mul_ps(ndoth, c3d_rsqrt4(hlen2)), _mm_cmpgt_ps(hlen2, zero));
+        ndoth = _mm_max_ps(ndoth, zero);
+
+        // the power stays scalar, only for the lanes that are lit
+        float nh[4], att[4], spec[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        _mm_storeu_ps(nh, ndoth);
+        _mm_storeu_ps(att, attenuation);
+        for (int k = 0; k < 4; k++){
+            if (lanes & (1 << k)) spec[k] = c3d_specpow(nh[k], shininess) * att[k];
+        }
+        __m128 sf = _mm_loadu_ps(spec);
+
+        __m128 cr = _mm_and_ps(_mm_loadu_ps(soa->r + i), lit);
+        __m128 cg = _mm_and_ps(_mm_loadu_ps(soa->g + i), lit);
+        __m128 cb = _mm_and_ps(_mm_loadu_ps(soa->b + i), lit);
+        dr = _mm_add_ps(dr, cr);
+        dg = _mm_add_ps(dg, cg);
+        db = _mm_add_ps(db, cb);
+        sr = _mm_add_ps(sr, _mm_mul_ps(cr, sf));
+        sg = _mm_add_ps(sg, _mm_mul_ps(cg, sf));
+        sb = _mm_add_ps(sb, _mm_mul_ps(cb, sf));
+    }
+
+    out_diffuse->x += c3d_hsum4(dr);
+    out_diffuse->y += c3d_hsum4(dg);
+    out_diffuse->z += c3d_hsum4(db);
+    out_specular->x += c3d_hsum4(sr);
+    out_specular->y += c3d_hsum4(sg);
+    out_specular->z += c3d_hsum4(sb);
+}
+
+#endif
+
+/**
+ * Compute illumination for a given material using Blinn-Phong's algorithm.
+ * 
+ * If baked is not NULL it is the diffuse light of the static lights at
+ * this point (see c3d_bakemesh()), and those lights only add their
+ * specular highlights. If sh is not NULL the lights it holds add their
+ * diffuse light through it, and no specular highlights.
+ *
+ * https://en.wikipedia.org/wiki/Blinn–Phong_reflection_model
+ */
+STDC3DDEF void c3d_bphongshade(display *d, vec3 normal, vec3 space, material *mtl, const vec3 *baked, const c3d_shlights *sh, vec3 *out_ambient, vec3 *out_diffuse, vec3 *out_specular) {
+    *out_ambient = mtl->ambient_color; 
+    out_diffuse->x = 0.0f; out_diffuse->y = 0.0f; out_diffuse->z = 0.0f;
+    out_specular->x = 0.0f; out_specular->y = 0.0f; out_specular->z = 0.0f;
+
+    vec3 viewDir = {d->camera.pos.x - space.x, d->camera.pos.y - space.y, d->camera.pos.z - space.z};
+    c3d_vec3normalize(&viewDir);
+
+    // without a specular color the static lights have nothing left to add
+    bool shiny = mtl->specular_color.x > 0.0f || mtl->specular_color.y > 0.0f || mtl->specular_color.z > 0.0f;
+    vec3 prelit = {0.0f, 0.0f, 0.0f};
+    if (baked != NULL) prelit = *baked;
+    if (sh != NULL) {
+        vec3 e = c3d_sheval(sh, normal);
+        prelit.x += e.x; prelit.y += e.y; prelit.z += e.z;
+    }
+    out_diffuse->x = mtl->diffuse_color.x * prelit.x;
+    out_diffuse->y = mtl->diffuse_color.y * prelit.y;
+    out_diffuse->z = mtl->diffuse_color.z * prelit.z;
+
+    #ifdef C3D_SSE2
+    // the lights shaded one by one; any set may be empty, the kernel then has nothing to loop over.
+    // The display's sets are laid out as each frame starts, sh's nearby lights whenever a light changes
+    const c3d_lightsoa *direct = (sh != NULL) ? &sh->nearby : (baked != NULL) ? &d->bake.dynamic : &d->lightsoa;
+    if ((sh != NULL || direct->built == d->draw_frame) && (baked == NULL || d->bake.fixed.built == d->draw_frame)) {
+        vec3 light_diffuse = {0.0f, 0.0f, 0.0f};
+        vec3 light_specular = {0.0f, 0.0f, 0.0f};
+        c3d_bphongshade4(direct, normal, space, viewDir, mtl->shininess, &light_diffuse, &light_specular);
+        if (baked != NULL && shiny) {
+            vec3 unused = {0.0f, 0.0f, 0.0f};
+            c3d_bphongshade4(&d->bake.fixed, normal, space, viewDir, mtl->shininess, &unused, &light_specular);
+        }
+
+        out_diffuse->x += mtl->diffuse_color.x * light_diffuse.x;
+        out_diffuse->y += mtl->diffuse_color.y * light_diffuse.y;
+        out_diffuse->z += mtl->diffuse_color.z * light_diffuse.z;
+
+        out_specular->x = mtl->specular_color.x * light_specular.x;
+        out_specular->y = mtl->specular_color.y * light_specular.y;
+        out_specular->z = mtl->specular_color.z * light_specular.z;
+    } else
+    #endif
+    for (int i = 0; i < d->light_count; i++) {
+        const light *L = &d->lights[i];
+        bool is_baked = (baked != NULL && !L->dynamic);
+        if (is_baked && !shiny) continue;
+        if (sh != NULL && sh->distant[i]) continue;
+
+        vec3 toLight = {L->position.x - space.x, L->position.y - space.y, L->position.z - space.z};
+        #ifdef C3D_FASTMATH
+        // one reciprocal square root gives both the distance and the direction
+        float len2 = toLight.x*toLight.x + toLight.y*toLight.y + toLight.z*toLight.z;
+        float inv_dist = (len2 > 0.0f) ? c3d_rsqrtf(len2) : 0.0f;
+        float dist = max(len2 * inv_dist, 0.0001f);
+        toLight.x *= inv_dist;
+        toLight.y *= inv_dist;
+        toLight.z *= inv_dist;
+        #else
+        float dist = sqrtf(toLight.x*toLight.x + toLight.y*toLight.y + toLight.z*toLight.z);
+        if (dist <= 0.0001f) dist = 0.0001f;
+        c3d_vec3normalize(&toLight);
+        #endif
+
+        float NdotL = max(0.0f, c3d_vec3dot(normal, toLight));
+        if (NdotL > 0.0f) {
+            if (dist > L->radius) continue; 
+            if (d->shadow_size && c3d_shadowed(&d->shadows[i], space)) continue;
+            float attenuation = 1.0f / (1.0f + (dist / L->radius) * (dist / L->radius));
+
+            vec3 halfDir = {viewDir.x + toLight.x, viewDir.y + toLight.y, viewDir.z + toLight.z};
+            c3d_vec3normalize(&halfDir);
+
+            float NdotH = max(0.0f, c3d_vec3dot(normal, halfDir));
+            float specular_factor = c3d_specpow(NdotH, mtl->shininess);
+
+            if (!is_baked) {
+                out_diffuse->x += mtl->diffuse_color.x * L->color.x * L->brightness;
+                out_diffuse->y += mtl->diffuse_color.y * L->color.y * L->brightness;
+                out_diffuse->z += mtl->diffuse_color.z * L->color.z * L->brightness;
+            }
+
+            out_specular->x += mtl->specular_color.x * L->color.x * L->brightness * specular_factor * attenuation;
+            out_specular->y += mtl->specular_color.y * L->color.y * L->brightness * specular_factor * attenuation;
+            out_specular->z += mtl->specular_color.z * L->color.z * L->brightness * specular_factor * attenuation;
+        }
+    }
+    out_ambient->x = c3d_clampf(out_ambient->x, 0.0f, 1.0f);
+    out_ambient->y = c3d_clampf(out_ambient->y, 0.0f, 1.0f);
+    out_ambient->z = c3d_clampf(out_ambient->z, 0.0f, 1.0f);
+
+    out_diffuse->x = c3d_clampf(out_diffuse->x, 0.0f, 1.0f);
+    out_diffuse->y = c3d_clampf(out_diffuse->y, 0.0f, 1.0f);
+    out_diffuse->z = c3d_clampf(out_diffuse->z, 0.0f, 1.0f);
+
+    out_specular->x = c3d_clampf(out_specular->x, 0.0f, 1.0f);
+    out_specular->y = c3d_clampf(out_specular->y, 0.0f, 1.0f);
+    out_specular->z = c3d_clampf(out_specular->z, 0.0f, 1.0f);
+}
+
+/**
+ * The light at a corner of a triangle with per-vertex lighting, from the
+ * mesh's vertex vl if it was shaded this frame already, otherwise shaded
+ * and kept there. vl is NULL for the corners the near plane made, they
+ * are shaded every time.
+ */
+STDC3DDEF void c3d_vertexshade(display *d, c3d_vertexlight *vl, vec3 normal, vec3 space, material *mtl, const vec3 *baked, const c3d_shlights *sh,
+                               vec3 *out_ambient, vec3 *out_diffuse, vec3 *out_specular) {
+    if (vl != NULL && vl->frame == d->draw_frame) {
+        *out_ambient = vl->ambient;
+        *out_diffuse = vl->diffuse;
+        *out_specular = vl->specular;
+        return;
+    }
+    c3d_vec3normalize(&normal);
+    c3d_bphongshade(d, normal, space, mtl, baked, sh, out_ambient, out_diffuse, out_specular);
+    if (vl != NULL) {
+        vl->ambient = *out_ambient;
+        vl->diffuse = *out_diffuse;
+        vl->specular = *out_specular;
+        vl->frame = d->draw_frame;
+    }
+}
+
+/**
+ * Samples a texture
+ */
+STDC3DDEF vec3 c3d_texsample(texture *tex, float u, float v) {
+    if (tex->data == NULL) {
+        vec3 default_color = {1.0f, 1.0f, 1.0f};
+        return default_color;
+    }
+
+    u = c3d_clampf(u, 0.0f, 1.0f);
+    v = c3d_clampf(v, 0.0f, 1.0f);
+
+    int tex_x = (int)(u * (tex->width - 1));
+    int tex_y = (int)((1.0f - v) * (tex->height - 1)); 
+
+    int index = tex_y * tex->width + tex_x;
+
+    vec3 color = tex->data[index];
+
+    color.x = c3d_clampf(color.x, 0.0f, 1.0f);
+    color.y = c3d_clampf(color.y, 0.0f, 1.0f);
+    color.z = c3d_clampf(color.z, 0.0f, 1.0f);
+
+    return color;
+}
+
+/**
+ * Picks the glyph of the ASCII density ramp that matches the luminance
+ * of the light reaching a fragment.
+ */
+STDC3DDEF wchar_t c3d_rampglyph(vec3 ambient, vec3 diffuse, vec3 specular){
+    static const char ramp[] = C3D_ASCII_RAMP;
+    const int steps = (int)sizeof(ramp) - 2;
+
+    float r = ambient.x + diffuse.x + specular.x;
+    float g = ambient.y + diffuse.y + specular.y;
+    float b = ambient.z + diffuse.z + specular.z;
+    float lum = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    lum = c3d_clampf(lum, 0.0f, 1.0f);
+
+    return (wchar_t)ramp[(int)(lum * steps + 0.5f)];
+}
+
+STDC3DDEF void c3d_bresenham(display *d, wchar_t **buffer, wchar_t **colorBuffer, vec2 v0, vec2 v1){
+
+    int x1 = v0.x;
+    int y1 = v0.y;
+
+    int x2 = v1.x;
+    int y2 = v1.y;
+
+    int dx = abs(x2 - x1);
+    int dy = abs(y2 - y1);
+
+    int sx = x1 < x2 ? 1 : -1;
+    int sy = y1 < y2 ? 1 : -1;
+    int err = dx - dy;
+
+    while (1) {
+        if (x1 >= 0 && x1 < d->display_width && y1 >= 0 && y1 < d->display_height) {
+            COLORREF color = RGB(255, 255, 255);
+            buffer[y1][x1] = C3D_PXCHAR;
+            colorBuffer[y1][x1] = color;
+        }
+
+        if (x1 == x2 && y1 == y2) break;
+
+        int e2 = 2 * err;
+        if (e2 > -dy) {
+            err -= dy;
+            x1 += sx;
+        }
+        if (e2 < dx) {
+            err += dx;
+            y1 += sy;
+        }
+    }
+}
+
+static const c3d_intuc c3d_ratew[] = {1, 2, 2, 4};
+static const c3d_intuc c3d_rateh[] = {1, 1, 2, 2};
+
+STDC3DDEF c3d_shadingrate c3d_parserate(const char *s){
+    if (!strcmp(s, "2x1")) return C3D_RATE_2X1;
+    if (!strcmp(s, "2x2")) return C3D_RATE_2X2;
+    if (!strcmp(s, "4x2")) return C3D_RATE_4X2;
+    return C3D_RATE_1X1;
+}
+
+/**
+ * Swaps the temporal cache's frames and decides whether last frame may be
+ * reused at all, before drawing.
+ */
+STDC3DDEF void c3d_temporalbegin(display *d){
+    c3d_temporal *tc = &d->temporal;
+    size_t n = (size_t)d->display_width * d->display_height;
+
+    c3d_intui lights = tc->watch.version;
+    c3d_lightwatchupdate(&tc->watch, d, -1);
+
+    if (tc->cur == NULL || tc->width != d->display_width || tc->height != d->display_height) {
+        free(tc->prev);
+        free(tc->cur);
+        tc->prev = (c3d_temporalcell *)malloc((n ? n : 1) * sizeof(c3d_temporalcell));
+        tc->cur = (c3d_temporalcell *)malloc((n ? n : 1) * sizeof(c3d_temporalcell));
+        if (tc->prev == NULL || tc->cur == NULL) {
+            fprintf(stderr, "Memory allocation failed in c3d_temporalbegin.\n");
+            exit(EXIT_FAILURE);
+        }
+        tc->width = d->display_width;
+        tc->height = d->display_height;
+        tc->drawn = false;
+    } else {
+        c3d_temporalcell *swap = tc->prev;
+        tc->prev = tc->cur;
+        tc->cur = swap;
+    }
+
+    tc->reuse = tc->drawn && lights == tc->watch.version && tc->shadow_version == d->shadow_version;
+    tc->shadow_version = d->shadow_version;
+    memset(tc->cur, 0, n * sizeof(c3d_temporalcell));
+}
+
+/**
+ * Clears the hierarchical depth tiles for a new frame, reallocating them
+ * if the display was resized.
+ */
+STDC3DDEF void c3d_hizbegin(display *d){
+    c3d_hiz *h = &d->hiz;
+    c3d_intus columns = (c3d_intus)((d->display_width + C3D_HIZ_TILE - 1) / C3D_HIZ_TILE);
+    c3d_intus rows = (c3d_intus)((d->display_height + C3D_HIZ_TILE - 1) / C3D_HIZ_TILE);
+    c3d_intui n = (c3d_intui)columns * rows;
+
+    if (n > h->cap || h->tiles == NULL) {
+        free(h->tiles);
+        h->tiles = (c3d_hiztile *)malloc((n ? n : 1) * sizeof(c3d_hiztile));
+        if (h->tiles == NULL) {
+            fprintf(stderr, "Memory allocation failed in c3d_hizbegin.\n");
+            exit(EXIT_FAILURE);
+        }
+        h->cap = n ? n : 1;
+    }
+    h->columns = columns;
+    h->rows = rows;
+    for (c3d_intui i = 0; i < n; i++) h->tiles[i] = (c3d_hiztile){INFINITY, INFINITY, false};
+}
+
+/**
+ * Recomputes the farthest depth of the tile whose top left cell is at
+ * x, y from the depth buffer. Only the rows the rasterizer may draw to
+ * are read, a cluster worker has no others.
+ */
+STDC3DDEF void c3d_hizrefresh(const display *d, float **depthBuffer, c3d_hiztile *tile, int x, int y){
+    int x1 = min(x + C3D_HIZ_TILE, (int)d->display_width);
+    int y0 = max(y, (int)d->region_y0);
+    int y1 = min(y + C3D_HIZ_TILE, (int)(d->region_y1 ? d->region_y1 : d->display_height));
+    float zmax = -INFINITY;
+    for (int j = y0; j < y1; j++) {
+        for (int i = x; i < x1; i++) {
+            if (depthBuffer[j][i] > zmax) zmax = depthBuffer[j][i];
+        }
+    }
+    tile->zmax = zmax;
+    tile->dirty = false;
+}
+
+/**
+ * Fetches the lighting last frame shaded where space, drawn this frame for
+ * the mesh at mesh_id, was, filtered between the four nearest cells. Fails
+ * if any of them was drawn for another mesh, before the mesh was last
+ * transformed, with another level of detail, or at another depth.
+ */
+STDC3DDEF bool c3d_temporalfetch(const display *d, vec3 space, int mesh_id, vec3 *lit, vec3 *specular){
+    const c3d_temporal *tc = &d->temporal;
+    vec4 clip = c3d_mat4vec4(space, tc->matcam);
+    if (clip.w <= 0.0f) return false;
+
+    vec3 ndc = {clip.x / clip.w, clip.y / clip.w, clip.z / clip.w};
+    vec2 p = c3d_project_vec3vec2(ndc, d->display_width, d->display_height);
+    float fx = p.x - 0.5f, fy = p.y - 0.5f;
+    if (!(fx > -1.0f && fy > -1.0f && fx < d->display_width && fy < d->display_height)) return false;
+
+    int x0 = (int)floorf(fx), y0 = (int)floorf(fy);
+    fx -= x0;
+    fy -= y0;
+    int xs[2] = {max(x0, 0), min(x0 + 1, d->display_width - 1)};
+    int ys[2] = {max(y0, 0), min(y0 + 1, d->display_height - 1)};
+    float wx[2] = {1.0f - fx, fx}, wy[2] = {1.0f - fy, fy};
+
+    c3d_intui version = d->meshes[mesh_id].version;
+    c3d_intus lod = (c3d_intus)d->meshes[mesh_id].lod;
+    *lit = (vec3){0.0f, 0.0f, 0.0f};
+    *specular = (vec3){0.0f, 0.0f, 0.0f};
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < 2; i++) {
+            const c3d_temporalcell *c = &tc->prev[ys[j] * d->display_width + xs[i]];
+            if (c->mesh != (c3d_intui)mesh_id + 1 || c->version != version || c->lod != lod) return false;
+            if (fabsf(c->w - clip.w) > C3D_TEMPORAL_DEPTH * clip.w) return false;
+
+            float k = wx[i] * wy[j];
+            lit->x += k * c->lit.x;
+            lit->y += k * c->lit.y;
+            lit->z += k * c->lit.z;
+            specular->x += k * c->specular.x;
+            specular->y += k * c->specular.y;
+            specular->z += k * c->specular.z;
+        }
+    }
+    return true;
+}
+
+/**
+ * The features of a material c3d_rasterizewith() is compiled for, as a
+ * mask of C3D_RASTER_ bits.
+ */
+STDC3DDEF int c3d_mtlfeatures(const material *mtl){
+    int features = 0;
+    if (mtl->diffuse_tex != NULL && mtl->diffuse_tex->data != NULL) features |= C3D_RASTER_TEXTURED;
+    if (mtl->illumination_model != 0) features |= C3D_RASTER_LIT;
+    if (mtl->transparency < 1.0f) features |= C3D_RASTER_BLENDED;
+    return features;
+}
+
+/**
+ * The features of the display c3d_rasterizewith() is compiled for, as a
+ * mask of C3D_RASTER_ bits.
+ */
+STDC3DDEF int c3d_displayfeatures(const display *d){
+    int features = 0;
+    if (d->lighting == C3D_LIGHTING_VERTEX) features |= C3D_RASTER_VERTEX;
+    if (C3D_OUTPUT_ISASCII(d->output)) features |= C3D_RASTER_ASCII;
+    return features;
+}
+
+/**
+ * Whether the normals of a triangle differ between its corners, and so
+ * have to be interpolated across it.
+ */
+STDC3DDEF bool c3d_trismooth(const tri *t){
+    return t->nvx.x != t->nvy.x || t->nvx.y != t->nvy.y || t->nvx.z != t->nvy.z ||
+           t->nvx.x != t->nvz.x || t->nvx.y != t->nvz.y || t->nvx.z != t->nvz.z;
+}
+
+/**
+ * Algorithm to fill triangles on any given display, for the features
+ * given as a mask of C3D_RASTER_ bits, those of the material and of the
+ * display's lighting and output. It is always inlined into a wrapper
+ * with a constant mask, so each wrapper is compiled without the work its
+ * features don't need. With C3D_RASTER_DEPTH only the depth
+ * buffer is written, with the clip w (the distance along the view axis)
+ * instead of the NDC z, or the NDC z with C3D_RASTER_PREPASS too. After
+ * a depth pre-pass only the cells at the depth it left are shaded.
+ * Lighting is shared by the cells of each block of
+ * the given rate, or coarser if the triangle lies outside the fovea.
+ * With the temporal cache enabled, mesh_id is the index of the
+ * triangle's mesh, and cells reuse last frame's lighting where it still
+ * holds.
+ */
+STDC3DDEF C3D_FORCEINLINE void c3d_rasterizewith(const int features, display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer,
+               vec3 v0_ndc, vec3 v1_ndc, vec3 v2_ndc,
+               float w0_clip, float w1_clip, float w2_clip,
+               tri t, material *mtl, const vec3 *baked, c3d_vertexlight *const *vlights,
+               const c3d_shlights *sh, c3d_shadingrate rate, int mesh_id) {
+
+    const bool depth_only = (features & C3D_RASTER_DEPTH) != 0;
+    const bool prepass = depth_only && (features & C3D_RASTER_PREPASS) != 0;
+    const bool equal = !depth_only && d->depth_prepass;
+    const bool textured = !depth_only && (features & C3D_RASTER_TEXTURED) != 0;
+    const bool lit = !depth_only && (features & C3D_RASTER_LIT) != 0;
+    const bool blended = !depth_only && (features & C3D_RASTER_BLENDED) != 0;
+    const bool smooth = lit && (features & C3D_RASTER_SMOOTH) != 0;
+    const bool per_vertex = lit && (features & C3D_RASTER_VERTEX) != 0;
+    const bool ascii = !depth_only && (features & C3D_RASTER_ASCII) != 0;
+
+    vec2 pv0 = c3d_project_vec3vec2(v0_ndc, d->display_width, d->display_height);
+    vec2 pv1 = c3d_project_vec3vec2(v1_ndc, d->display_width, d->display_height);
+    vec2 pv2 = c3d_project_vec3vec2(v2_ndc, d->display_width, d->display_height);
+
+    int minx = max(C3D_MIN(pv0.x, pv1.x, pv2.x), 0);
+    int maxx = min(C3D_MAX(pv0.x, pv1.x, pv2.x), d->display_width - 1);
+    int miny = max(C3D_MIN(pv0.y, pv1.y, pv2.y), d->region_y0);
+    int maxy = min(C3D_MAX(pv0.y, pv1.y, pv2.y), (d->region_y1 ? d->region_y1 : d->display_height) - 1);
+    if (minx > maxx || miny > maxy) return;
+
+    float area = c3d_edge(pv0, pv1, pv2);
+    if (area == 0) return;
+
+    float inv_w0 = 1.0f / w0_clip;
+    float inv_w1 = 1.0f / w1_clip;
+    float inv_w2 = 1.0f / w2_clip;
+
+    vec3 wPos0 = t.vx;
+    vec3 wPos1 = t.vy;
+    vec3 wPos2 = t.vz;
+
+    vec3 n0 = t.nvx;
+    vec3 n1 = t.nvy;
+    vec3 n2 = t.nvz;
+
+    vec2 uv0 = t.uvx;
+    vec2 uv1 = t.uvy;
+    vec2 uv2 = t.uvz;
+
+    // a flat triangle has the same normal everywhere
+    vec3 flat_normal = n0;
+    if (lit && !smooth) c3d_vec3normalize(&flat_normal);
+
+    // per-vertex lighting shades the corners, once the triangle is known to be drawn, the cells only interpolate
+    bool vertex_shaded = false;
+    vec3 v_ambient[3], v_diffuse[3], v_specular[3];
+
+    if (lit && d->vrs.edge_rate > rate) {
+        float hw = 0.5f * d->display_width, hh = 0.5f * d->display_height;
+        if (maxx < hw * (1.0f - d->vrs.fovea) || minx > hw * (1.0f + d->vrs.fovea) ||
+            maxy < hh * (1.0f - d->vrs.fovea) || miny > hh * (1.0f + d->vrs.fovea)) {
+            rate = d->vrs.edge_rate;
+        }
+    }
+
+    // the blocks of the current row of blocks, indexed from the one holding minx
+    int bw = c3d_ratew[rate], bh = c3d_rateh[rate];
+    bool coarse = (lit && rate != C3D_RATE_1X1 && !per_vertex);
+    c3d_vrsblock *blocks = NULL;
+    if (coarse) {
+        c3d_intui columns = (c3d_intui)(maxx / bw - minx / bw + 1);
+        if (columns > d->vrs.block_cap) {
+            free(d->vrs.blocks);
+            d->vrs.blocks = (c3d_vrsblock *)malloc(columns * sizeof(c3d_vrsblock));
+            if (d->vrs.blocks == NULL) {
+                fprintf(stderr, "Memory allocation failed in c3d_rasterize.\n");
+                exit(EXIT_FAILURE);
+            }
+            d->vrs.block_cap = columns;
+        }
+        blocks = d->vrs.blocks;
+        for (c3d_intui i = 0; i < columns; i++) blocks[i].row = -1;
+    }
+
+    bool temporal = (lit && d->temporal.enabled && !per_vertex && mesh_id >= 0);
+    bool reuse = (temporal && d->temporal.reuse);
+
+    COLORREF mesh_color = 0;
+    if (ascii) {
+        mesh_color = RGB(
+            (int)(c3d_clampf(mtl->diffuse_color.x, 0.0f, 1.0f) * 255.0f),
+            (int)(c3d_clampf(mtl->diffuse_color.y, 0.0f, 1.0f) * 255.0f),
+            (int)(c3d_clampf(mtl->diffuse_color.z, 0.0f, 1.0f) * 255.0f)
+        );
+    }
+
+    // walked tile by tile with hierarchical depth, otherwise as one tile
+    const bool hiz = ((!depth_only || prepass) && d->hiz.enabled && d->hiz.tiles != NULL);
+    const int ts = hiz ? C3D_HIZ_TILE : 65536;
+
+    // depth is interpolated between the corners', so the triangle is within their range
+    float tri_zmin = C3D_MIN(v0_ndc.z, v1_ndc.z, v2_ndc.z);
+    float tri_zmax = C3D_MAX(v0_ndc.z, v1_ndc.z, v2_ndc.z);
+
+    for (int ty = miny - miny % ts; ty <= maxy; ty += ts) {
+        for (int tx = minx - minx % ts; tx <= maxx; tx += ts) {
+            c3d_hiztile *tile = NULL;
+            bool accept = false;
+            if (hiz) {
+                tile = &d->hiz.tiles[(ty / ts) * d->hiz.columns + tx / ts];
+                // after a pre-pass the triangle may still be the one at zmax
+                if (equal ? tri_zmin > tile->zmax : tri_zmin >= tile->zmax) continue;
+                if (tile->dirty) {
+                    c3d_hizrefresh(d, depthBuffer, tile, tx, ty);
+                    if (equal ? tri_zmin > tile->zmax : tri_zmin >= tile->zmax) continue;
+                }
+                accept = (!equal && tri_zmax < tile->zmin);
+            }
+            if (per_vertex && !vertex_shaded) {
+                const vec3 corner_pos[3] = {wPos0, wPos1, wPos2};
+                const vec3 corner_normal[3] = {n0, n1, n2};
+                for (int k = 0; k < 3; k++) {
+                    c3d_vertexshade(d, vlights ? vlights[k] : NULL, corner_normal[k], corner_pos[k], mtl, baked ? &baked[k] : NULL, sh,
+                                    &v_ambient[k], &v_diffuse[k], &v_specular[k]);
+                }
+                vertex_shaded = true;
+            }
+            int x0 = max(tx, minx), x1 = min(tx + ts - 1, maxx);
+            int y0 = max(ty, miny), y1 = min(ty + ts - 1, maxy);
+
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    vec2 vxy = {x + 0.5f, y + 0.5f};
+                    float w0 = c3d_edge(pv1, pv2, vxy) / area;
+                    float w1 = c3d_edge(pv2, pv0, vxy) / area;
+                    float w2 = c3d_edge(pv0, pv1, vxy) / area;
+
+                    if (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f) {
+                        float denom = w0 * inv_w0 + w1 * inv_w1 + w2 * inv_w2;
+                        if (denom == 0.0f) continue;
+                        float z;
+                        if (depth_only && !prepass) z = 1.0f / denom; // the exact distance along the view axis, for shadow maps
+                        else z = (v0_ndc.z * w0 / w0_clip + v1_ndc.z * w1 / w1_clip + v2_ndc.z * w2 / w2_clip) / denom ;
+
+                        if (equal ? z == depthBuffer[y][x] : (accept || z < depthBuffer[y][x])) {
+                            depthBuffer[y][x] = z;
+                            if (tile != NULL && !equal) {
+                                if (z < tile->zmin) tile->zmin = z;
+                                tile->dirty = true;
+                            }
+                            if (depth_only) continue;
+
+                            // unlit materials show their diffuse color as it is
+                            vec3 ambient, diffuse, specular;
+                            c3d_vrsblock *block = coarse ? &blocks[x / bw - minx / bw] : NULL;
+                            if (!lit) {
+                                ambient = mtl->diffuse_color;
+                                diffuse = (vec3){0.0f, 0.0f, 0.0f};
+                                specular = (vec3){0.0f, 0.0f, 0.0f};
+                            } else if (block != NULL && block->row == y / bh) {
+                                ambient = block->ambient;
+                                diffuse = block->diffuse;
+                                specular = block->specular;
+                            } else if (per_vertex) {
+                                float b0 = inv_w0 * w0 / denom;
+                                float b1 = inv_w1 * w1 / denom;
+                                float b2 = inv_w2 * w2 / denom;
+                                ambient = c3d_vec3bary(v_ambient[0], v_ambient[1], v_ambient[2], b0, b1, b2);
+                                diffuse = c3d_vec3bary(v_diffuse[0], v_diffuse[1], v_diffuse[2], b0, b1, b2);
+                                specular = c3d_vec3bary(v_specular[0], v_specular[1], v_specular[2], b0, b1, b2);
+                            } else {
+                                vec3 space;
+                                space.x = (wPos0.x*inv_w0*w0 + wPos1.x*inv_w1*w1 + wPos2.x*inv_w2*w2) / denom;
+                                space.y = (wPos0.y*inv_w0*w0 + wPos1.y*inv_w1*w1 + wPos2.y*inv_w2*w2) / denom;
+                                space.z = (wPos0.z*inv_w0*w0 + wPos1.z*inv_w1*w1 + wPos2.z*inv_w2*w2) / denom;
+
+                                // the refresh is staggered across the cells so no frame shades them all
+                                if (reuse && (d->frame_count + x + 3 * y) % C3D_TEMPORAL_REFRESH != 0 &&
+                                    c3d_temporalfetch(d, space, mesh_id, &ambient, &specular)) {
+                                    diffuse = (vec3){0.0f, 0.0f, 0.0f};
+                                } else {
+                                    vec3 normal = flat_normal;
+                                    if (smooth) {
+                                        normal.x = (n0.x * inv_w0 * w0 + n1.x * inv_w1 * w1 + n2.x * inv_w2 * w2) / denom;
+                                        normal.y = (n0.y * inv_w0 * w0 + n1.y * inv_w1 * w1 + n2.y * inv_w2 * w2) / denom;
+                                        normal.z = (n0.z * inv_w0 * w0 + n1.z * inv_w1 * w1 + n2.z * inv_w2 * w2) / denom;
+                                        c3d_vec3normalize(&normal);
+                                    }
+
+                                    vec3 light;
+                                    if (baked != NULL) {
+                                        light.x = (baked[0].x * inv_w0 * w0 + baked[1].x * inv_w1 * w1 + baked[2].x * inv_w2 * w2) / denom;
+                                        light.y = (baked[0].y * inv_w0 * w0 + baked[1].y * inv_w1 * w1 + baked[2].y * inv_w2 * w2) / denom;
+                                        light.z = (baked[0].z * inv_w0 * w0 + baked[1].z * inv_w1 * w1 + baked[2].z * inv_w2 * w2) / denom;
+                                    }
+
+                                    c3d_bphongshade(d, normal, space, mtl, baked ? &light : NULL, sh, &ambient, &diffuse, &specular);
+                                }
+
+                                // the first cell of a block that gets drawn shades it for the rest
+                                if (block != NULL) {
+                                    block->ambient = ambient;
+                                    block->diffuse = diffuse;
+                                    block->specular = specular;
+                                    block->row = y / bh;
+                                }
+                            }
+
+                            if (temporal) {
+                                c3d_temporalcell *c = &d->temporal.cur[y * d->display_width + x];
+                                c->lit = (vec3){ambient.x + diffuse.x, ambient.y + diffuse.y, ambient.z + diffuse.z};
+                                c->specular = specular;
+                                c->w = 1.0f / denom;
+                                c->mesh = (c3d_intui)mesh_id + 1;
+                                c->version = d->meshes[mesh_id].version;
+                                c->lod = (c3d_intus)d->meshes[mesh_id].lod;
+                            }
+
+                            // the ASCII outputs only need the intensity, and at most a flat mesh color
+                            if (ascii) {
+                                buffer[y][x] = c3d_rampglyph(ambient, diffuse, specular);
+                                colorBuffer[y][x] = mesh_color;
+                                continue;
+                            }
+
+                            vec3 tex_color = {1.0f, 1.0f, 1.0f};
+                            if (textured) {
+                                float u = (uv0.x*inv_w0*w0 + uv1.x*inv_w1*w1 + uv2.x*inv_w2*w2) / denom;
+                                float v = (uv0.y*inv_w0*w0 + uv1.y*inv_w1*w1 + uv2.y*inv_w2*w2) / denom;
+                                tex_color = c3d_texsample(mtl->diffuse_tex, u, v);
+                            }
+
+                            vec3 final_color;
+                            final_color.x = (ambient.x + diffuse.x) * tex_color.x + specular.x;
+                            final_color.y = (ambient.y + diffuse.y) * tex_color.y + specular.y;
+                            final_color.z = (ambient.z + diffuse.z) * tex_color.z + specular.z;
+
+                            if (blended) {
+                                final_color.x = (1.0f - mtl->transparency) * d->background_color.x + mtl->transparency * final_color.x;
+                                final_color.y = (1.0f - mtl->transparency) * d->background_color.y + mtl->transparency * final_color.y;
+                                final_color.z = (1.0f - mtl->transparency) * d->background_color.z + mtl->transparency * final_color.z;
+                            }
+
+                            final_color.x = c3d_clampf(final_color.x, 0.0f, 1.0f);
+                            final_color.y = c3d_clampf(final_color.y, 0.0f, 1.0f);
+                            final_color.z = c3d_clampf(final_color.z, 0.0f, 1.0f);
+
+                            COLORREF color = RGB(
+                                (int)(final_color.x * 255.0f),
+                                (int)(final_color.y * 255.0f),
+                                (int)(final_color.z * 255.0f)
+                            );
+
+                            buffer[y][x] = C3D_PXCHAR;
+                            colorBuffer[y][x] = color;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// One wrapper of c3d_rasterizewith() per feature mask.
+#define C3D_RASTER_VARIANT(name, features) \
+    STDC3DDEF void name(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer, \
+                   vec3 v0_ndc, vec3 v1_ndc, vec3 v2_ndc, float w0_clip, float w1_clip, float w2_clip, \
+                   tri t, material *mtl, const vec3 *baked, c3d_vertexlight *const *vlights, \
+                   const c3d_shlights *sh, c3d_shadingrate rate, int mesh_id) { \
+        c3d_rasterizewith(features, d, buffer, colorBuffer, depthBuffer, v0_ndc, v1_ndc, v2_ndc, \
+                          w0_clip, w1_clip, w2_clip, t, mtl, baked, vlights, sh, rate, mesh_id); \
+    }
+
+// Eight wrappers at a time, c3d_rasterize<hi><lo> for the mask hi * 8 + lo.
+#define C3D_RASTER_VARIANT8(hi) \
+    C3D_RASTER_VARIANT(c3d_rasterize##hi##0, (hi) * 8 + 0) C3D_RASTER_VARIANT(c3d_rasterize##hi##1, (hi) * 8 + 1) \
+    C3D_RASTER_VARIANT(c3d_rasterize##hi##2, (hi) * 8 + 2) C3D_RASTER_VARIANT(c3d_rasterize##hi##3, (hi) * 8 + 3) \
+    C3D_RASTER_VARIANT(c3d_rasterize##hi##4, (hi) * 8 + 4) C3D_RASTER_VARIANT(c3d_rasterize##hi##5, (hi) * 8 + 5) \
+    C3D_RASTER_VARIANT(c3d_rasterize##hi##6, (hi) * 8 + 6) C3D_RASTER_VARIANT(c3d_rasterize##hi##7, (hi) * 8 + 7)
+#define C3D_RASTER_NAMES8(hi) \
+    c3d_rasterize##hi##0, c3d_rasterize##hi##1, c3d_rasterize##hi##2, c3d_rasterize##hi##3, \
+    c3d_rasterize##hi##4, c3d_rasterize##hi##5, c3d_rasterize##hi##6, c3d_rasterize##hi##7
+
+C3D_RASTER_VARIANT(c3d_rasterizedepth, C3D_RASTER_DEPTH)
+C3D_RASTER_VARIANT(c3d_rasterizeprepass, C3D_RASTER_DEPTH | C3D_RASTER_PREPASS)
+C3D_RASTER_VARIANT8(0)
+C3D_RASTER_VARIANT8(1)
+C3D_RASTER_VARIANT8(2)
+C3D_RASTER_VARIANT8(3)
+C3D_RASTER_VARIANT8(4)
+C3D_RASTER_VARIANT8(5)
+C3D_RASTER_VARIANT8(6)
+C3D_RASTER_VARIANT8(7)
+
+// The wrappers, indexed by feature mask.
+static const c3d_rasterfn c3d_rastervariants[C3D_RASTER_VARIANTS] = {
+    C3D_RASTER_NAMES8(0), C3D_RASTER_NAMES8(1), C3D_RASTER_NAMES8(2), C3D_RASTER_NAMES8(3),
+    C3D_RASTER_NAMES8(4), C3D_RASTER_NAMES8(5), C3D_RASTER_NAMES8(6), C3D_RASTER_NAMES8(7)
+};
+
+/**
+ * Fills a triangle with the variant of c3d_rasterizewith() for its
+ * material and normals, or only its depth if buffer is NULL. It is lit
+ * by every light at full rate, without baked lighting, spherical
+ * harmonics or the temporal cache; the draw loop calls the variants
+ * itself to use those.
+ */
+STDC3DDEF void c3d_rasterize(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer,
+               vec3 v0_ndc, vec3 v1_ndc, vec3 v2_ndc,
+               float w0_clip, float w1_clip, float w2_clip,
+               tri t, material *mtl) {
+    c3d_rasterfn fill = c3d_rasterizedepth;
+    if (buffer != NULL) fill = c3d_rastervariants[c3d_mtlfeatures(mtl) | c3d_displayfeatures(d) | (c3d_trismooth(&t) ? C3D_RASTER_SMOOTH : 0)];
+    fill(d, buffer, colorBuffer, depthBuffer, v0_ndc, v1_ndc, v2_ndc, w0_clip, w1_clip, w2_clip, t, mtl, NULL, NULL, NULL, C3D_RATE_1X1, -1);
+}
+
+STDC3DDEF bool c3d_shadowreaches(const light *L, vec3 center, float bound){
+    vec3 e = {center.x - L->position.x, center.y - L->position.y, center.z - L->position.z};
+    return sqrtf(c3d_vec3dot(e, e)) <= L->radius + bound;
+}
+
+/**
+ * Rasterizes a mesh seen through mat into rows, depth only. d need only
+ * have the size of rows.
+ */
+STDC3DDEF void c3d_depthmesh(display *d, float **rows, mesh *m, mat4 mat){
+    for (int j = 0; j < m->tri_count; j++){
+        tri t_clipped[2];
+        int tri_count = c3d_nearclip(m->tris[j], mat, t_clipped);
+
+        for (int c = 0; c < tri_count; c++){
+            tri t = t_clipped[c];
+            vec4 v0_clip = c3d_mat4vec4(t.vx, mat);
+            vec4 v1_clip = c3d_mat4vec4(t.vy, mat);
+            vec4 v2_clip = c3d_mat4vec4(t.vz, mat);
+
+            vec3 v0_ndc = {v0_clip.x / v0_clip.w, v0_clip.y / v0_clip.w, v0_clip.z / v0_clip.w};
+            vec3 v1_ndc = {v1_clip.x / v1_clip.w, v1_clip.y / v1_clip.w, v1_clip.z / v1_clip.w};
+            vec3 v2_ndc = {v2_clip.x / v2_clip.w, v2_clip.y / v2_clip.w, v2_clip.z / v2_clip.w};
+
+            if ((v0_ndc.x < -1.0f && v1_ndc.x < -1.0f && v2_ndc.x < -1.0f) ||
+                (v0_ndc.x >  1.0f && v1_ndc.x >  1.0f && v2_ndc.x >  1.0f) ||
+                (v0_ndc.y < -1.0f && v1_ndc.y < -1.0f && v2_ndc.y < -1.0f) ||
+                (v0_ndc.y >  1.0f && v1_ndc.y >  1.0f && v2_ndc.y >  1.0f) ||
+                (v0_ndc.z < -1.0f && v1_ndc.z < -1.0f && v2_ndc.z < -1.0f) ||
+                (v0_ndc.z >  1.0f && v1_ndc.z >  1.0f && v2_ndc.z >  1.0f)) {
+                continue;
+            }
+
+            c3d_rasterizedepth(d, NULL, NULL, rows, v0_ndc, v1_ndc, v2_ndc, v0_clip.w, v1_clip.w, v2_clip.w, t, m->mtl, NULL, NULL, NULL, C3D_RATE_1X1, -1);
+        }
+    }
+}
+
+/**
+ * Renders a light's shadow map with the rasterizer, depth only, one cube
+ * face at a time. bounds holds each mesh's center and radius.
+ */
+STDC3DDEF void c3d_shadowrender(display *d, c3d_shadowmap *sm, const light *L, const vec4 *bounds){
+    c3d_intus size = d->shadow_size;
+    if (sm->size != size || sm->depth == NULL){
+        free(sm->depth);
+        sm->depth = (float *)malloc((size_t)size * size * 6 * sizeof(float));
+        sm->size = size;
+    }
+    if (sm->mesh_count != d->mesh_count){
+        free(sm->meshes);
+        sm->meshes = (c3d_shadowmesh *)malloc((d->mesh_count ? d->mesh_count : 1) * sizeof(c3d_shadowmesh));
+        sm->mesh_count = d->mesh_count;
+    }
+    float **rows = (float **)malloc(size * sizeof(float *));
+    if (sm->depth == NULL || sm->meshes == NULL || rows == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_shadowrender.\n");
+        exit(EXIT_FAILURE);
+    }
+    sm->position = L->position;
+    sm->radius = L->radius;
+
+    for (c3d_intui i = 0; i < d->mesh_count; i++){
+        const mesh *m = &d->meshes[i];
+        sm->meshes[i] = (c3d_shadowmesh){m->tris, m->tri_count, m->version,
+                                         c3d_shadowreaches(L, (vec3){bounds[i].x, bounds[i].y, bounds[i].z}, bounds[i].w)};
+    }
+
+    // the rasterizer only needs the size of what it draws into
+    display sd = *d;
+    sd.display_width = size;
+    sd.display_height = size;
+    sd.region_y0 = 0;
+    sd.region_y1 = 0;
+
+    mat4 proj = c3d_mat4prj(C3D_SHADOW_NEAR, max(L->radius, 2.0f * C3D_SHADOW_NEAR), 90.0f, 1.0f);
+    mat4 tra = c3d_mat4tra(-L->position.x, -L->position.y, -L->position.z);
+    mat4 rot[6] = {
+        c3d_mat4rty(0.0f), c3d_mat4rty(0.5f * C3D_PI), c3d_mat4rty(C3D_PI), c3d_mat4rty(-0.5f * C3D_PI),
+        c3d_mat4rtx(0.5f * C3D_PI), c3d_mat4rtx(-0.5f * C3D_PI),
+    };
+
+    for (int f = 0; f < 6; f++){
+        mat4 mat = c3d_mat4mul(proj, c3d_mat4mul(rot[f], tra));
+        sm->faces[f] = mat;
+
+        // the face looks down -z of its view, whichever world axis that is
+        vec3 fwd = {-rot[f].m[2][0], -rot[f].m[2][1], -rot[f].m[2][2]};
+        float ax = fabsf(fwd.x), ay = fabsf(fwd.y), az = fabsf(fwd.z);
+        if (ax >= ay && ax >= az) sm->face_of_axis[fwd.x > 0.0f ? 0 : 1] = f;
+        else if (ay >= az)        sm->face_of_axis[fwd.y > 0.0f ? 2 : 3] = f;
+        else                      sm->face_of_axis[fwd.z > 0.0f ? 4 : 5] = f;
+
+        for (c3d_intus y = 0; y < size; y++){
+            rows[y] = sm->depth + ((size_t)f * size + y) * size;
+            for (c3d_intus x = 0; x < size; x++) rows[y][x] = INFINITY;
+        }
+
+        for (c3d_intui i = 0; i < d->mesh_count; i++){
+            mesh *m = &d->meshes[i];
+            if (!sm->meshes[i].inside) continue;
+
+            c3d_depthmesh(&sd, rows, m, mat);
+        }
+    }
+
+    free(rows);
+}
+
+/**
+ * Renders again the shadow maps that went stale since the last frame.
+ */
+STDC3DDEF void c3d_shadowupdate(display *d){
+    if (d->shadow_count != d->light_count){
+        for (c3d_intui i = d->light_count; i < d->shadow_count; i++){
+            free(d->shadows[i].depth);
+            free(d->shadows[i].meshes);
+        }
+        c3d_shadowmap *shadows = (c3d_shadowmap *)realloc(d->shadows, (d->light_count ? d->light_count : 1) * sizeof(c3d_shadowmap));
+        if (shadows == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_shadowupdate.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (c3d_intui i = d->shadow_count; i < d->light_count; i++) shadows[i] = (c3d_shadowmap){0};
+        d->shadows = shadows;
+        d->shadow_count = d->light_count;
+    }
+
+    vec4 *bounds = (vec4 *)malloc((d->mesh_count ? d->mesh_count : 1) * sizeof(vec4));
+    if (bounds == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_shadowupdate.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (c3d_intui i = 0; i < d->mesh_count; i++){
+        mesh *m = &d->meshes[i];
+        c3d_meshsphere(m);
+        bounds[i] = (vec4){m->sphere_center.x, m->sphere_center.y, m->sphere_center.z, m->sphere_radius};
+    }
+
+    for (c3d_intui i = 0; i < d->light_count; i++){
+        const light *L = &d->lights[i];
+        c3d_shadowmap *sm = &d->shadows[i];
+
+        bool stale = sm->depth == NULL || sm->size != d->shadow_size || sm->mesh_count != d->mesh_count ||
+                     sm->position.x != L->position.x || sm->position.y != L->position.y ||
+                     sm->position.z != L->position.z || sm->radius != L->radius;
+
+        for (c3d_intui j = 0; !stale && j < d->mesh_count; j++){
+            const mesh *m = &d->meshes[j];
+            c3d_shadowmesh *was = &sm->meshes[j];
+            if (was->tris == m->tris && was->tri_count == m->tri_count && was->version == m->version) continue;
+
+            bool inside = c3d_shadowreaches(L, (vec3){bounds[j].x, bounds[j].y, bounds[j].z}, bounds[j].w);
+            if (was->inside || inside) stale = true;
+            else *was = (c3d_shadowmesh){m->tris, m->tri_count, m->version, false};
+        }
+
+        if (stale){
+            c3d_shadowrender(d, sm, L, bounds);
+            if (!L->dynamic) d->shadow_version++;
+        }
+    }
+
+    free(bounds);
+}
+
+/**
+ * Whether a box is behind the occluders everywhere it lands on the
+ * occlusion buffer. A box reaching behind the camera never is.
+ */
+STDC3DDEF bool c3d_occluded(const display *d, vec3 bmin, vec3 bmax, mat4 matcam){
+    const c3d_occlusion *oc = &d->occlusion;
+    float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY, nearest = INFINITY;
+
+    for (int k = 0; k < 8; k++){
+        vec3 p = {(k & 1) ? bmax.x : bmin.x, (k & 2) ? bmax.y : bmin.y, (k & 4) ? bmax.z : bmin.z};
+        vec4 clip = c3d_mat4vec4(p, matcam);
+        if (clip.w <= d->camera.fnear) return false;
+
+        vec2 s = c3d_project_vec3vec2((vec3){clip.x / clip.w, clip.y / clip.w, 0.0f}, oc->width, oc->height);
+        x0 = min(x0, s.x);
+        y0 = min(y0, s.y);
+        x1 = max(x1, s.x);
+        y1 = max(y1, s.y);
+        nearest = min(nearest, clip.w);
+    }
+
+    // off the buffer, it's for the frustum test to say
+    int cx0 = max((int)floorf(x0), 0), cx1 = min((int)floorf(x1), oc->width - 1);
+    int cy0 = max((int)floorf(y0), 0), cy1 = min((int)floorf(y1), oc->height - 1);
+    if (cx0 > cx1 || cy0 > cy1) return false;
+
+    for (int y = cy0; y <= cy1; y++){
+        const float *row = oc->depth + (size_t)y * oc->width;
+        for (int x = cx0; x <= cx1; x++){
+            if (row[x] >= nearest) return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Draws an occluder into the occlusion buffer. A cell only takes a
+ * triangle that covers all of it, at the farthest the triangle is over
+ * the cell, so the buffer never claims more is hidden than is. Cells
+ * an edge crosses are left to other triangles that cover them whole.
+ */
+STDC3DDEF void c3d_occluderdraw(c3d_occlusion *oc, const mesh *m, mat4 matcam){
+    for (int j = 0; j < m->tri_count; j++){
+        tri t_clipped[2];
+        int tri_count = c3d_nearclip(m->tris[j], matcam, t_clipped);
+
+        for (int c = 0; c < tri_count; c++){
+            const vec3 *v = &t_clipped[c].vx;
+            vec2 pv[3];
+            float inv_w[3];
+            for (int k = 0; k < 3; k++){
+                vec4 clip = c3d_mat4vec4(v[k], matcam);
+                pv[k] = c3d_project_vec3vec2((vec3){clip.x / clip.w, clip.y / clip.w, 0.0f}, oc->width, oc->height);
+                inv_w[k] = 1.0f / clip.w;
+            }
+            float area = c3d_edge(pv[0], pv[1], pv[2]);
+            if (area == 0.0f) continue;
+
+            // the cells within the triangle's bounds, corners included
+            int x0 = max((int)ceilf(C3D_MIN(pv[0].x, pv[1].x, pv[2].x)), 0);
+            int y0 = max((int)ceilf(C3D_MIN(pv[0].y, pv[1].y, pv[2].y)), 0);
+            int x1 = min((int)floorf(C3D_MAX(pv[0].x, pv[1].x, pv[2].x)) - 1, oc->width - 1);
+            int y1 = min((int)floorf(C3D_MAX(pv[0].y, pv[1].y, pv[2].y)) - 1, oc->height - 1);
+
+            for (int y = y0; y <= y1; y++){
+                for (int x = x0; x <= x1; x++){
+                    // the depth is the reciprocal of a plane across the
+                    // screen, so it is farthest at one of the corners
+                    float far_w = 0.0f;
+                    bool inside = true;
+                    for (int k = 0; inside && k < 4; k++){
+                        vec2 p = {(float)(x + (k & 1)), (float)(y + (k >> 1))};
+                        float w0 = c3d_edge(pv[1], pv[2], p) / area;
+                        float w1 = c3d_edge(pv[2], pv[0], p) / area;
+                        float w2 = c3d_edge(pv[0], pv[1], p) / area;
+                        inside = (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f);
+                        far_w = max(far_w, 1.0f / (w0 * inv_w[0] + w1 * inv_w[1] + w2 * inv_w[2]));
+                    }
+
+                    float *cell = &oc->depth[(size_t)y * oc->width + x];
+                    if (inside && far_w < *cell) *cell = far_w;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Draws the occluders into the occlusion buffer and marks the meshes
+ * hidden behind them.
+ */
+STDC3DDEF void c3d_occlusionupdate(display *d, mat4 matcam){
+    c3d_occlusion *oc = &d->occlusion;
+    oc->height = (c3d_intus)max(1, (int)oc->width * d->display_height / max(d->display_width, 1));
+    c3d_intui cells = (c3d_intui)oc->width * oc->height;
+
+    if (oc->size != cells){
+        free(oc->depth);
+        oc->depth = (float *)malloc(cells * sizeof(float));
+        oc->size = cells;
+    }
+    if (oc->culled_cap < d->mesh_count){
+        free(oc->culled);
+        oc->culled = (bool *)malloc(d->mesh_count * sizeof(bool));
+        oc->culled_cap = d->mesh_count;
+    }
+    if (oc->depth == NULL || (oc->culled == NULL && d->mesh_count)){
+        fprintf(stderr, "Memory allocation failed in c3d_occlusionupdate.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (c3d_intui i = 0; i < cells; i++) oc->depth[i] = INFINITY;
+
+    bool any = false;
+    for (c3d_intui i = 0; i < d->mesh_count; i++){
+        if (!d->meshes[i].occluder) continue;
+        c3d_occluderdraw(oc, &d->meshes[i], matcam);
+        any = true;
+    }
+
+    oc->culled_count = 0;
+    for (c3d_intui i = 0; i < d->mesh_count; i++){
+        mesh *m = &d->meshes[i];
+        oc->culled[i] = false;
+        if (!any || m->occluder || m->tri_count <= 0) continue;
+
+        c3d_meshbox(m);
+        oc->culled[i] = c3d_occluded(d, m->box_min, m->box_max, matcam);
+        oc->culled_count += oc->culled[i];
+    }
+}
+
+/**
+ * Sorts the meshes nearest first into d->order, by the distance of their
+ * bounding box's center along the view axis. Last frame's order is kept
+ * if it is still sorted, and otherwise is where a two-pass radix sort on
+ * 16-bit keys starts from, so meshes at the same distance keep their
+ * place from frame to frame.
+ */
+STDC3DDEF void c3d_sortmeshes(display *d, mat4 matcam){
+    c3d_draworder *o = &d->order;
+    c3d_intui n = d->mesh_count;
+
+    if (o->cap < n){
+        c3d_intui *ids = (c3d_intui *)realloc(o->ids, n * sizeof(c3d_intui));
+        c3d_intui *scratch = (c3d_intui *)realloc(o->scratch, n * sizeof(c3d_intui));
+        c3d_intus *keys = (c3d_intus *)realloc(o->keys, n * sizeof(c3d_intus));
+        if (ids == NULL || scratch == NULL || keys == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_sortmeshes.\n");
+            exit(EXIT_FAILURE);
+        }
+        o->ids = ids;
+        o->scratch = scratch;
+        o->keys = keys;
+        o->cap = n;
+    }
+    if (o->count != n){
+        for (c3d_intui i = 0; i < n; i++) o->ids[i] = i;
+        o->count = n;
+    }
+
+    float span = d->camera.ffar - d->camera.fnear;
+    for (c3d_intui i = 0; i < n; i++){
+        mesh *m = &d->meshes[i];
+        c3d_meshbox(m);
+        vec3 c = {(m->box_min.x + m->box_max.x) * 0.5f, (m->box_min.y + m->box_max.y) * 0.5f, (m->box_min.z + m->box_max.z) * 0.5f};
+        float t = (c3d_mat4vec4(c, matcam).w - d->camera.fnear) / span;
+        o->keys[i] = (c3d_intus)(c3d_clampf(t, 0.0f, 1.0f) * 65535.0f);
+    }
+
+    bool sorted = true;
+    for (c3d_intui i = 1; i < n && sorted; i++) sorted = o->keys[o->ids[i - 1]] <= o->keys[o->ids[i]];
+    if (sorted) return;
+
+    // low byte then high byte, each pass stable
+    c3d_intui *from = o->ids, *to = o->scratch;
+    for (int shift = 0; shift < 16; shift += 8){
+        c3d_intui start[256] = {0};
+        for (c3d_intui i = 0; i < n; i++) start[(o->keys[from[i]] >> shift) & 0xFF]++;
+        for (c3d_intui b = 0, sum = 0; b < 256; b++){
+            c3d_intui count = start[b];
+            start[b] = sum;
+            sum += count;
+        }
+        for (c3d_intui i = 0; i < n; i++) to[start[(o->keys[from[i]] >> shift) & 0xFF]++] = from[i];
+
+        c3d_intui *swap = from;
+        from = to;
+        to = swap;
+    }
+}
+
+/**
+ * Runs the display's behaviors for the frame about to be drawn.
+ */
+STDC3DDEF void c3d_runbehaviors(display *d){
+    for (int i = 0; i < d->behavior_count; i++) {
+        behavior *b = &d->behaviors[i];
+        if (b->func != NULL) {
+            switch (b->type){
+                case C3D_CONTINUOUS_BEHAVIOR: b->func(d, b->argc, b->args); break;
+                case C3D_STARTUP_BEHAVIOR: if (d->frame_count == 0) b->func(d, b->argc, b->args); break;
+            }
+        }
+    }
+}
+
+/**
+ * The rate a mesh is shaded at this frame, before c3d_rasterize() looks
+ * at where each triangle lands.
+ */
+STDC3DDEF c3d_shadingrate c3d_meshrate(const display *d, const mesh *m){
+    c3d_shadingrate rate = m->rate;
+
+    if (d->vrs.flat_rate > rate && (m->mtl->diffuse_tex == NULL || m->mtl->diffuse_tex->data == NULL)) {
+        rate = d->vrs.flat_rate;
+    }
+    if (d->vrs.far_rate > rate && m->tri_count > 0) {
+        vec3 c = c3d_meshcenter(*m);
+        vec3 e = {c.x - d->camera.pos.x, c.y - d->camera.pos.y, c.z - d->camera.pos.z};
+        if (c3d_vec3dot(e, e) > d->vrs.far_distance * d->vrs.far_distance) rate = d->vrs.far_rate;
+    }
+    return rate;
+}
+
+/**
+ * Picks the level of detail each mesh is drawn with this frame: the
+ * finest with at most C3D_LOD_DENSITY triangles per cell its bounding
+ * sphere covers. A mesh only changes level once it is C3D_LOD_HYSTERESIS
+ * past that budget, so one on the edge doesn't flicker between two.
+ * The mesh's version is left alone, its geometry didn't change: shadow
+ * maps, harmonics and bounds are of the full mesh, and the temporal
+ * cache tells the levels apart itself.
+ */
+STDC3DDEF void c3d_lodselect(display *d, mat4 matcam){
+    float f = 1.0f / tanf(0.5f * C3D_DEG2RAD(d->camera.fov));
+
+    for (c3d_intui i = 0; i < d->mesh_count; i++){
+        mesh *m = &d->meshes[i];
+        if (m->lod_count == 0) continue;
+
+        // baked light is kept per corner of the full mesh
+        int lod = 0;
+        if (d->lod && !d->bake.enabled){
+            c3d_meshbox(m);
+            vec3 c = {(m->box_min.x + m->box_max.x) * 0.5f, (m->box_min.y + m->box_max.y) * 0.5f, (m->box_min.z + m->box_max.z) * 0.5f};
+            vec3 e = {m->box_max.x - c.x, m->box_max.y - c.y, m->box_max.z - c.z};
+            float r = sqrtf(c3d_vec3dot(e, e));
+            float w = c3d_mat4vec4(c, matcam).w;
+
+            if (w > r){
+                float sx = r * f / d->camera.aspect / w * 0.5f * d->display_width;
+                float sy = r * f / w * 0.5f * d->display_height;
+                float budget = C3D_LOD_DENSITY * C3D_PI * sx * sy;
+
+                // the levels it may be drawn with, from the finest to the coarsest
+                int finest = m->lod_count, coarsest = m->lod_count;
+                for (int k = m->lod_count; k >= 0; k--){
+                    int count = k ? m->lods[k - 1].tri_count : m->tri_count;
+                    if (count <= budget * C3D_LOD_HYSTERESIS) finest = k;
+                    if (count <= budget / C3D_LOD_HYSTERESIS) coarsest = k;
+                }
+                lod = m->lod;
+                if (lod < finest) lod = finest;
+                else if (lod > coarsest) lod = coarsest;
+            }
+        }
+
+        m->lod = lod;
+    }
+}
+
+/**
+ * Transforms, clips and rasterizes the meshes not culled this frame, in
+ * draw order. With prepass, only their depth is written, for the shading
+ * pass after to be tested against.
+ */
+STDC3DDEF void c3d_drawmeshes(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer, mat4 matcam, bool prepass){
+    for (c3d_intui n = 0; n < d->mesh_count; n++) {
+        int i = d->order.enabled ? (int)d->order.ids[n] : (int)n;
+        mesh* m = &d->meshes[i];
+        if (d->mesh_parts && i % d->mesh_parts != d->mesh_part) continue;
+        if (d->occlusion.width && d->occlusion.culled[i]) continue;
+        c3d_shadingrate rate = prepass ? C3D_RATE_1X1 : c3d_meshrate(d, m);
+        int features = c3d_mtlfeatures(m->mtl) | c3d_displayfeatures(d);
+        const tri *tris = m->lod ? m->lods[m->lod - 1].tris : m->tris;
+        int count = m->lod ? m->lods[m->lod - 1].tri_count : m->tri_count;
+
+        // with per-vertex lighting each distinct corner is shaded once, by the first triangle drawn with it
+        bool per_vertex = (!prepass && (features & C3D_RASTER_LIT) && (features & C3D_RASTER_VERTEX));
+        if (per_vertex) c3d_meshweld(m);
+
+        for (int j = 0; j < count; j++) {
+            tri t = tris[j];
+
+            tri t_clipped[2];
+            int tri_count = c3d_nearclip(t, matcam, t_clipped);
+
+            const vec3 *baked = (d->bake.enabled && !prepass) ? &m->baked[j * 3] : NULL;
+
+            for (int c = 0; c < tri_count; c++) {
+                tri t = t_clipped[c];
+
+                #ifdef BACKFACE_CULLING
+                if (c3d_backface(t, d->camera.pos)) continue;
+                #endif
+
+                vec4 v0_clip = c3d_mat4vec4(t.vx, matcam);
+                vec4 v1_clip = c3d_mat4vec4(t.vy, matcam);
+                vec4 v2_clip = c3d_mat4vec4(t.vz, matcam);
+
+                vec3 v0_ndc = {v0_clip.x / v0_clip.w, v0_clip.y / v0_clip.w, v0_clip.z / v0_clip.w};
+                vec3 v1_ndc = {v1_clip.x / v1_clip.w, v1_clip.y / v1_clip.w, v1_clip.z / v1_clip.w};
+                vec3 v2_ndc = {v2_clip.x / v2_clip.w, v2_clip.y / v2_clip.w, v2_clip.z / v2_clip.w};
+
+                if ((v0_ndc.x < -1.0f && v1_ndc.x < -1.0f && v2_ndc.x < -1.0f) ||
+                    (v0_ndc.x >  1.0f && v1_ndc.x >  1.0f && v2_ndc.x >  1.0f) ||
+                    (v0_ndc.y < -1.0f && v1_ndc.y < -1.0f && v2_ndc.y < -1.0f) ||
+                    (v0_ndc.y >  1.0f && v1_ndc.y >  1.0f && v2_ndc.y >  1.0f) ||
+                    (v0_ndc.z < -1.0f && v1_ndc.z < -1.0f && v2_ndc.z < -1.0f) ||
+                    (v0_ndc.z >  1.0f && v1_ndc.z >  1.0f && v2_ndc.z >  1.0f)) {
+                    continue;
+                }
+
+                // the corners the near plane made are not vertices of the mesh, their baked light is found on the original triangle
+                bool whole = (tri_count == 1 && c3d_triwhole(&t, &tris[j]));
+                const vec3 *corner_baked = baked;
+                vec3 clipped_baked[3];
+                if (baked != NULL && !whole) {
+                    clipped_baked[0] = c3d_bakedat(&tris[j], baked, t.vx);
+                    clipped_baked[1] = c3d_bakedat(&tris[j], baked, t.vy);
+                    clipped_baked[2] = c3d_bakedat(&tris[j], baked, t.vz);
+                    corner_baked = clipped_baked;
+                }
+                c3d_vertexlight *vlights[3] = {NULL, NULL, NULL};
+                if (per_vertex && whole) {
+                    for (int k = 0; k < 3; k++) vlights[k] = &m->vlights[m->vlight_ids[j * 3 + k]];
+                }
+
+                #ifndef NO_FILL
+                c3d_rasterfn fill = prepass ? c3d_rasterizeprepass : c3d_rastervariants[features | (c3d_trismooth(&t) ? C3D_RASTER_SMOOTH : 0)];
+                fill(d, buffer, colorBuffer, depthBuffer, v0_ndc, v1_ndc, v2_ndc, v0_clip.w, v1_clip.w, v2_clip.w, t, m->mtl,
+                     corner_baked, vlights, d->sh_distance > 0.0f ? m->sh : NULL, rate, i);
+                #else
+                // c3d_bresenham()
+                #endif
+            }
+        }
+    }
+}
+
+/**
+ * Gets what drawing a frame needs ready, except the temporal cache: the
+ * shadow maps, light arrays, bakes and harmonics, the hierarchical depth
+ * tiles, the meshes hidden, their order and levels of detail. Returns the
+ * camera's view-projection.
+ */
+STDC3DDEF mat4 c3d_framebegin(display *d){
+    d->draw_frame++;
+    if (d->shadow_size) c3d_shadowupdate(d);
+    c3d_lightsoabuild(d);
+    if (d->bake.enabled) c3d_bakeupdate(d);
+    if (d->sh_distance > 0.0f) c3d_shupdate(d);
+    if (d->hiz.enabled) c3d_hizbegin(d);
+
+    mat4 matproj = c3d_mat4prj(d->camera.fnear, d->camera.ffar, d->camera.fov, d->camera.aspect);
+    mat4 camtranslate = c3d_mat4tra(-d->camera.pos.x, -d->camera.pos.y, -d->camera.pos.z);
+    mat4 camview = c3d_mat4mul(d->camera.matrot, camtranslate);
+    mat4 matcam = c3d_mat4mul(matproj, camview);
+
+    if (d->occlusion.width) c3d_occlusionupdate(d, matcam);
+    if (d->order.enabled) c3d_sortmeshes(d, matcam);
+    c3d_lodselect(d, matcam);
+    return matcam;
+}
+
+/**
+ * Transforms, clips and rasterizes every mesh into the buffers.
+ */
+STDC3DDEF void c3d_drawscene(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer){
+    mat4 matcam = c3d_framebegin(d);
+    if (d->temporal.enabled) c3d_temporalbegin(d);
+
+    if (d->depth_prepass) c3d_drawmeshes(d, NULL, NULL, depthBuffer, matcam, true);
+    c3d_drawmeshes(d, buffer, colorBuffer, depthBuffer, matcam, false);
+
+    if (d->temporal.enabled) {
+        d->temporal.matcam = matcam;
+        d->temporal.drawn = true;
+    }
+}
+
+/**
+ * Allocates the buffers of a frame, cleared.
+ */
+STDC3DDEF void c3d_framealloc(display *d, wchar_t ***out_buffer, COLORREF ***out_colorBuffer, float ***out_depthBuffer){
+    float** depthBuffer = (float**)malloc(d->display_height * sizeof(float*));
+    wchar_t** buffer = (wchar_t**)malloc(d->display_height * sizeof(wchar_t*));
+    COLORREF** colorBuffer = (COLORREF**)malloc(d->display_height * sizeof(COLORREF*));
+    
+    for (int i = 0; i < d->display_height; i++) {
+        depthBuffer[i] = (float*)malloc(d->display_width * sizeof(float));
+        buffer[i] = (wchar_t*)malloc(d->display_width * sizeof(wchar_t));
+        colorBuffer[i] = (COLORREF*)malloc(d->display_width * sizeof(COLORREF));
+        
+        for (int j = 0; j < d->display_width; j++) {
+            buffer[i][j] = L' ';
+            colorBuffer[i][j] = RGB(0, 0, 0);
+            depthBuffer[i][j] = INFINITY;
+        }
+    }
+
+    *out_buffer = buffer;
+    *out_colorBuffer = colorBuffer;
+    *out_depthBuffer = depthBuffer;
+}
+
+/**
+ * Hands a drawn frame to the recorder, shared memory, server and the
+ * terminal, then frees its buffers.
+ */
+STDC3DDEF void c3d_framesubmit(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer){
+    d->frame_count++;
+    if (d->recorder != NULL) c3d_recframe(d, buffer, colorBuffer);
+    if (d->shm != NULL) c3d_shmframe(d, buffer, colorBuffer, depthBuffer);
+    #ifdef C3D_NET
+    if (d->server != NULL) c3d_serverframe(d, buffer, colorBuffer);
+    #endif
+    c3d_render(d, buffer, colorBuffer);
+    for (int i = 0; i < d->display_height; i++) {
+        free(buffer[i]);
+        free(colorBuffer[i]);
+        free(depthBuffer[i]);
+    }
+    free(buffer);
+    free(colorBuffer);
+    free(depthBuffer);
+}
+
+/**
+ * Updates all buffers.
+ */
+void c3d_update(display* d){
+    c3d_runbehaviors(d);
+    wchar_t **buffer;
+    COLORREF **colorBuffer;
+    float **depthBuffer;
+    c3d_framealloc(d, &buffer, &colorBuffer, &depthBuffer);
+
+    bool drawn = false;
+    #ifdef C3D_NET
+    if (d->cluster != NULL) drawn = c3d_clusterframe(d, buffer, colorBuffer);
+    #endif
+    if (!drawn) c3d_drawscene(d, buffer, colorBuffer, depthBuffer);
+
+    c3d_framesubmit(d, buffer, colorBuffer, depthBuffer);
+}
+
+/*
+ * =============================================================================
+ *                        FRAME RECORDING AND PLAYBACK
+ * =============================================================================
+ */
+
+/*
+ * A .c3drec file starts with the "C3DREC" magic and a 16-bit version,
+ * followed by frames. Every frame has a 20 byte header:
+ *
+ *     u8  type        'K' keyframe or 'D' delta
+ *     u8  flags       C3D_REC_FLAG_* bits
+ *     u16 width
+ *     u16 height
+ *     u32 background  COLORREF of the display's background
+ *     u32 time        milliseconds since the recording started
+ *     u32 size        payload size in bytes
+ *     u16 reserved
+ *
+ * The payload is the framebuffer split into 5 byte planes (glyph low,
+ * glyph high, red, green, blue), run-length encoded. Delta frames XOR
+ * the planes against the previous frame first, so unchanged cells turn
+ * into long runs of zeroes. The payload is zlib compressed when the
+ * C3D_REC_FLAG_ZLIB flag is set.
+ */
+
+/**
+ * Splits a framebuffer into the 5 byte planes the frame codec works on.
+ */
+STDC3DDEF void c3d_fbplanes(wchar_t **buffer, COLORREF **colorBuffer, int w, int h, c3d_intuc *planes){
+    size_t n = (size_t)w * h;
+    c3d_intuc *glo = planes;
+    c3d_intuc *ghi = planes + n;
+    c3d_intuc *r = planes + 2 * n;
+    c3d_intuc *g = planes + 3 * n;
+    c3d_intuc *b = planes + 4 * n;
+
+    size_t i = 0;
+    for (int y = 0; y < h; y++){
+        for (int x = 0; x < w; x++, i++){
+            c3d_intus wc = (c3d_intus)buffer[y][x];
+            COLORREF c = colorBuffer[y][x];
+            glo[i] = (c3d_intuc)(wc & 0xFF);
+            ghi[i] = (c3d_intuc)(wc >> 8);
+            r[i] = GetRValue(c);
+            g[i] = GetGValue(c);
+            b[i] = GetBValue(c);
+        }
+    }
+}
+
+/**
+ * Puts byte planes back into a framebuffer.
+ */
+STDC3DDEF void c3d_fbunplanes(const c3d_intuc *planes, int w, int h, wchar_t **buffer, COLORREF **colorBuffer){
+    size_t n = (size_t)w * h;
+    const c3d_intuc *glo = planes;
+    const c3d_intuc *ghi = planes + n;
+    const c3d_intuc *r = planes + 2 * n;
+    const c3d_intuc *g = planes + 3 * n;
+    const c3d_intuc *b = planes + 4 * n;
+
+    size_t i = 0;
+    for (int y = 0; y < h; y++){
+        for (int x = 0; x < w; x++, i++){
+            buffer[y][x] = (wchar_t)(glo[i] | (ghi[i] << 8));
+            colorBuffer[y][x] = RGB(r[i], g[i], b[i]);
+        }
+    }
+}
+
+/**
+ * Run-length encodes n bytes of src, XORed against prev when prev is
+ * given. A control byte c below 128 is followed by c + 1 literal bytes,
+ * otherwise the next byte repeats c - 126 times. Literals only give way
+ * to runs of three or more, which pay for the control byte of the next
+ * literal, so the output never grows past n + n / 128 + 2 bytes.
+ */
+STDC3DDEF void c3d_fbencode(const c3d_intuc *src, const c3d_intuc *prev, size_t n, c3d_outbuf *o){
+    #define C3D__FBVAL(i) (prev ? (c3d_intuc)(src[i] ^ prev[i]) : src[i])
+
+    // worst case is one control byte per 128 literals
+    c3d_outreserve(o, n + n / 128 + 2);
+
+    size_t i = 0;
+    while (i < n){
+        c3d_intuc v = C3D__FBVAL(i);
+        size_t run = 1;
+        while (i + run < n && run < 129 && C3D__FBVAL(i + run) == v) run++;
+
+        if (run >= 2){
+            o->data[o->len++] = (char)(run + 126);
+            o->data[o->len++] = (char)v;
+            i += run;
+            continue;
+        }
+
+        size_t start = i;
+        size_t lit = 0;
+        while (i < n && lit < 128){
+            if (i + 2 < n && C3D__FBVAL(i + 1) == C3D__FBVAL(i) && C3D__FBVAL(i + 2) == C3D__FBVAL(i)) break;
+            i++;
+            lit++;
+        }
+
+        o->data[o->len++] = (char)(lit - 1);
+        for (size_t k = start; k < start + lit; k++) o->data[o->len++] = (char)C3D__FBVAL(k);
+    }
+
+    #undef C3D__FBVAL
+}
+
+/**
+ * Decodes a payload made by c3d_fbencode() into dst. For deltas dst must
+ * hold the previous frame and is XORed in place, so zero runs cost
+ * nothing. Returns false on a malformed payload.
+ */
+STDC3DDEF bool c3d_fbdecode(const c3d_intuc *src, size_t len, c3d_intuc *dst, size_t n, bool delta){
+    size_t i = 0, o = 0;
+
+    while (i < len && o < n){
+        c3d_intuc c = src[i++];
+
+        if (c < 128){
+            size_t lit = (size_t)c + 1;
+            if (i + lit > len || o + lit > n) return false;
+            if (delta) for (size_t k = 0; k < lit; k++) dst[o + k] ^= src[i + k];
+            else       memcpy(dst + o, src + i, lit);
+            i += lit;
+            o += lit;
+        } else {
+            size_t run = (size_t)c - 126;
+            if (i >= len || o + run > n) return false;
+            c3d_intuc v = src[i++];
+            if (!delta)      memset(dst + o, v, run);
+            else if (v != 0) for (size_t k = 0; k < run; k++) dst[o + k] ^= v;
+            o += run;
+        }
+    }
+
+    return o == n;
+}
+
+STDC3DDEF bool c3d_fwriteu16(FILE *f, c3d_intus v){
+    c3d_intuc b[2] = {(c3d_intuc)v, (c3d_intuc)(v >> 8)};
+    return fwrite(b, 1, 2, f) == 2;
+}
+
+STDC3DDEF void c3d_putu16(c3d_intuc *b, c3d_intus v){
+    b[0] = (c3d_intuc)v;
+    b[1] = (c3d_intuc)(v >> 8);
+}
+
+STDC3DDEF void c3d_putu32(c3d_intuc *b, c3d_intui v){
+    b[0] = (c3d_intuc)v;
+    b[1] = (c3d_intuc)(v >> 8);
+    b[2] = (c3d_intuc)(v >> 16);
+    b[3] = (c3d_intuc)(v >> 24);
+}
+
+STDC3DDEF c3d_intui c3d_getu32(const c3d_intuc *b){
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((c3d_intui)b[3] << 24);
+}
+
+/**
+ * Encodes the framebuffer as the next frame of a stream, as a keyframe
+ * every C3D_REC_KEYINTERVAL frames, when the size changes or when key
+ * is set, and as a delta against the last frame otherwise. The frame
+ * header is left in e->header, and the payload is returned.
+ */
+STDC3DDEF const c3d_intuc *c3d_fbencodeframe(c3d_fbencoder *e, display *d, wchar_t **buffer, COLORREF **colorBuffer, bool key, size_t *size){
+    int w = d->display_width;
+    int h = d->display_height;
+    size_t n = (size_t)w * h * 5;
+
+    if (e->frames == 0){
+        QueryPerformanceFrequency(&e->freq);
+        QueryPerformanceCounter(&e->start);
+    }
+
+    key = key || (e->frames % C3D_REC_KEYINTERVAL == 0) || w != e->width || h != e->height;
+
+    if (w != e->width || h != e->height){
+        e->prev = (c3d_intuc *)realloc(e->prev, n);
+        e->cur = (c3d_intuc *)realloc(e->cur, n);
+        if (e->prev == NULL || e->cur == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_fbencodeframe.\n");
+            exit(EXIT_FAILURE);
+        }
+        e->width = (c3d_intus)w;
+        e->height = (c3d_intus)h;
+    }
+
+    c3d_fbplanes(buffer, colorBuffer, w, h, e->cur);
+
+    e->pack.len = 0;
+    c3d_fbencode(e->cur, key ? NULL : e->prev, n, &e->pack);
+
+    const c3d_intuc *payload = (const c3d_intuc *)e->pack.data;
+    size_t payload_size = e->pack.len;
+    c3d_intuc flags = 0;
+
+    #ifdef C3D_REC_ZLIB
+    uLongf zn = compressBound((uLong)payload_size);
+    if (zn > e->zpack_cap){
+        e->zpack = (c3d_intuc *)realloc(e->zpack, zn);
+        if (e->zpack == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_fbencodeframe.\n");
+            exit(EXIT_FAILURE);
+        }
+        e->zpack_cap = zn;
+    }
+    if (compress2(e->zpack, &zn, payload, (uLong)payload_size, 1) == Z_OK && zn < payload_size){
+        payload = e->zpack;
+        payload_size = zn;
+        flags |= C3D_REC_FLAG_ZLIB;
+    }
+    #endif
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    c3d_intui ms = (c3d_intui)((now.QuadPart - e->start.QuadPart) * 1000 / e->freq.QuadPart);
+
+    e->header[0] = key ? 'K' : 'D';
+    e->header[1] = flags;
+    c3d_putu16(e->header + 2, (c3d_intus)w);
+    c3d_putu16(e->header + 4, (c3d_intus)h);
+    c3d_putu32(e->header + 6, c3d_bgcolor(d));
+    c3d_putu32(e->header + 10, ms);
+    c3d_putu32(e->header + 14, (c3d_intui)payload_size);
+    c3d_putu16(e->header + 18, 0);
+
+    c3d_intuc *tmp = e->prev;
+    e->prev = e->cur;
+    e->cur = tmp;
+    e->frames++;
+
+    *size = payload_size;
+    return payload;
+}
+
+STDC3DDEF void c3d_fbencoderfree(c3d_fbencoder *e){
+    free(e->prev);
+    free(e->cur);
+    free(e->pack.data);
+    #ifdef C3D_REC_ZLIB
+    free(e->zpack);
+    #endif
+    memset(e, 0, sizeof(c3d_fbencoder));
+}
+
+/**
+ * Whether a frame header is believable: at least one and no more than
+ * C3D_REC_MAXCELLS cells, and with no more payload than a frame of its
+ * size can encode to. Checked before the payload is read, so a broken
+ * file or a rogue server can't make the decoder allocate gigabytes, or
+ * nothing at all.
+ */
+STDC3DDEF bool c3d_fbheaderok(const c3d_intuc *hdr){
+    size_t cells = (size_t)(hdr[2] | (hdr[3] << 8)) * (hdr[4] | (hdr[5] << 8));
+    if (cells == 0 || cells > C3D_REC_MAXCELLS) return false;
+
+    // the rle stream of n plane bytes is at most n + n / 128 + 2 bytes
+    // long, and zlib adds less than a thousandth and a few bytes to that
+    size_t n = cells * 5;
+    size_t rle = n + n / 128 + 2;
+    return c3d_getu32(hdr + 14) <= rle + rle / 1024 + 64;
+}
+
+/**
+ * Makes room for a frame's payload in the decoder and returns where to
+ * read it to.
+ */
+STDC3DDEF c3d_intuc *c3d_fbdecoderpayload(c3d_fbdecoder *p, size_t size){
+    if (size > p->payload_cap){
+        p->payload = (c3d_intuc *)realloc(p->payload, size);
+        if (p->payload == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_fbdecoderpayload.\n");
+            exit(EXIT_FAILURE);
+        }
+        p->payload_cap = size;
+    }
+    return p->payload;
+}
+
+/**
+ * Decodes the frame whose payload was read into c3d_fbdecoderpayload().
+ * Returns false if the frame can't be shown, either because it's broken
+ * or because it's a delta and no keyframe was decoded yet.
+ */
+STDC3DDEF bool c3d_fbdecodeframe(c3d_fbdecoder *p, const c3d_intuc *hdr){
+    bool key = (hdr[0] == 'K');
+    c3d_intuc flags = hdr[1];
+    int fw = hdr[2] | (hdr[3] << 8);
+    int fh = hdr[4] | (hdr[5] << 8);
+    size_t size = c3d_getu32(hdr + 14);
+
+    if (fw != p->width || fh != p->height){
+        // a new size always starts with a keyframe
+        if (!key) return false;
+        for (int y = 0; y < p->height; y++){
+            free(p->buffer[y]);
+            free(p->colorBuffer[y]);
+        }
+        free(p->buffer);
+        free(p->colorBuffer);
+
+        p->width = fw;
+        p->height = fh;
+        p->planes = (c3d_intuc *)realloc(p->planes, (size_t)fw * fh * 5);
+        p->buffer = (wchar_t **)malloc(fh * sizeof(wchar_t *));
+        p->colorBuffer = (COLORREF **)malloc(fh * sizeof(COLORREF *));
+        if (p->planes == NULL || p->buffer == NULL || p->colorBuffer == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_fbdecodeframe.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int y = 0; y < fh; y++){
+            p->buffer[y] = (wchar_t *)malloc(fw * sizeof(wchar_t));
+            p->colorBuffer[y] = (COLORREF *)malloc(fw * sizeof(COLORREF));
+            if (p->buffer[y] == NULL || p->colorBuffer[y] == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_fbdecodeframe.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (!key && !p->have_key) return false;
+
+    size_t n = (size_t)fw * fh * 5;
+    const c3d_intuc *data = p->payload;
+    size_t data_size = size;
+
+    if (flags & C3D_REC_FLAG_ZLIB){
+        #ifdef C3D_REC_ZLIB
+        // the rle stream is at most n + n / 128 + 2 bytes long
+        uLongf un = (uLongf)(n + n / 128 + 2);
+        if (un > p->unpacked_cap){
+            p->unpacked = (c3d_intuc *)realloc(p->unpacked, un);
+            if (p->unpacked == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_fbdecodeframe.\n");
+                exit(EXIT_FAILURE);
+            }
+            p->unpacked_cap = un;
+        }
+        if (uncompress(p->unpacked, &un, p->payload, (uLong)size) != Z_OK){
+            p->have_key = false;
+            return false;
+        }
+        data = p->unpacked;
+        data_size = un;
+        #else
+        p->have_key = false;
+        return false;
+        #endif
+    }
+
+    if (!c3d_fbdecode(data, data_size, p->planes, n, !key)){
+        // wait for the next keyframe rather than show garbage
+        p->have_key = false;
+        return false;
+    }
+    p->have_key = true;
+    p->background = c3d_getu32(hdr + 6);
+    p->time = c3d_getu32(hdr + 10);
+    return true;
+}
+
+/**
+ * Shows the last decoded frame through the display's output backend.
+ * The display takes the frame's size and background only while it is
+ * encoded, and gets its own back afterwards.
+ */
+STDC3DDEF void c3d_fbshow(display *d, c3d_fbdecoder *p){
+    COLORREF bg = p->background;
+    c3d_intus width = d->display_width;
+    c3d_intus height = d->display_height;
+    vec3 background = d->background_color;
+
+    c3d_fbunplanes(p->planes, p->width, p->height, p->buffer, p->colorBuffer);
+    d->display_width = (c3d_intus)p->width;
+    d->display_height = (c3d_intus)p->height;
+    d->background_color = (vec3){GetRValue(bg), GetGValue(bg), GetBValue(bg)};
+    c3d_render(d, p->buffer, p->colorBuffer);
+
+    d->display_width = width;
+    d->display_height = height;
+    d->background_color = background;
+}
+
+STDC3DDEF void c3d_fbdecoderfree(c3d_fbdecoder *p){
+    for (int y = 0; y < p->height; y++){
+        free(p->buffer[y]);
+        free(p->colorBuffer[y]);
+    }
+    free(p->buffer);
+    free(p->colorBuffer);
+    free(p->planes);
+    free(p->payload);
+    #ifdef C3D_REC_ZLIB
+    free(p->unpacked);
+    #endif
+    memset(p, 0, sizeof(c3d_fbdecoder));
+}
+
+/**
+ * Starts recording every frame the display renders into a .c3drec file.
+ */
+STDC3DDEF bool c3d_recstart(display *d, const char *path){
+    if (d->recorder != NULL) return false;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL){
+        fprintf(stderr, "Could not open %s for recording.\n", path);
+        return false;
+    }
+
+    c3d_recorder *r = (c3d_recorder *)calloc(1, sizeof(c3d_recorder));
+    if (r == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_recstart.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fwrite(C3D_REC_MAGIC, 1, 6, f) != 6 || !c3d_fwriteu16(f, C3D_REC_VERSION)){
+        fprintf(stderr, "Could not write to %s.\n", path);
+        fclose(f);
+        free(r);
+        return false;
+    }
+
+    r->f = f;
+    d->recorder = r;
+    return true;
+}
+
+/**
+ * Stops recording and closes the file.
+ */
+STDC3DDEF void c3d_recstop(display *d){
+    c3d_recorder *r = d->recorder;
+    if (r == NULL) return;
+
+    if (fclose(r->f) != 0) fprintf(stderr, "Could not finish writing the recording.\n");
+    c3d_fbencoderfree(&r->enc);
+    free(r);
+    d->recorder = NULL;
+}
+
+/**
+ * Appends the framebuffer to the recording. If the file can't take it
+ * (a full disk, say) the recording is stopped where it is, since every
+ * later frame could be a delta against the one that was lost.
+ */
+STDC3DDEF void c3d_recframe(display *d, wchar_t **buffer, COLORREF **colorBuffer){
+    c3d_recorder *r = d->recorder;
+    size_t size;
+
+    const c3d_intuc *payload = c3d_fbencodeframe(&r->enc, d, buffer, colorBuffer, false, &size);
+    if (fwrite(r->enc.header, 1, sizeof(r->enc.header), r->f) != sizeof(r->enc.header) ||
+        fwrite(payload, 1, size, r->f) != size){
+        fprintf(stderr, "Could not write frame %u of the recording, recording stopped.\n", r->enc.frames);
+        c3d_recstop(d);
+    }
+}
+
+/**
+ * Plays a .c3drec recording back through the display's output backend,
+ * without running the renderer. speed scales the recorded timing (2.0
+ * plays twice as fast), and a speed of 0 plays as fast as the terminal
+ * takes it. Returns the number of frames played.
+ */
+STDC3DDEF c3d_intui c3d_playrec(display *d, const char *path, float speed){
+    FILE *f = fopen(path, "rb");
+    if (f == NULL){
+        fprintf(stderr, "Could not open recording %s.\n", path);
+        return 0;
+    }
+
+    char magic[6];
+    c3d_intuc version[2];
+    if (fread(magic, 1, 6, f) != 6 || memcmp(magic, C3D_REC_MAGIC, 6) != 0 ||
+        fread(version, 1, 2, f) != 2 || (version[0] | (version[1] << 8)) != C3D_REC_VERSION){
+        fprintf(stderr, "%s is not a C3D recording.\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    c3d_fbdecoder p;
+    memset(&p, 0, sizeof(p));
+    c3d_intui played = 0;
+
+    LARGE_INTEGER freq, start;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    c3d_intuc hdr[20];
+    while (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)){
+        size_t size = c3d_getu32(hdr + 14);
+        if (!c3d_fbheaderok(hdr)){
+            fprintf(stderr, "%s is broken after frame %u.\n", path, played);
+            break;
+        }
+        if (fread(c3d_fbdecoderpayload(&p, size), 1, size, f) != size) break;
+
+        #ifndef C3D_REC_ZLIB
+        if (hdr[1] & C3D_REC_FLAG_ZLIB){
+            fprintf(stderr, "%s is compressed, rebuild with C3D_REC_ZLIB to play it.\n", path);
+            break;
+        }
+        #endif
+
+        if (!c3d_fbdecodeframe(&p, hdr)) continue;
+
+        if (speed > 0.0f){
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            double elapsed = (double)(now.QuadPart - start.QuadPart) * 1000.0 / (double)freq.QuadPart;
+            double due = p.time / speed;
+            if (due > elapsed) Sleep((DWORD)(due - elapsed));
+        }
+
+        c3d_fbshow(d, &p);
+        played++;
+    }
+
+    c3d_fbdecoderfree(&p);
+    fclose(f);
+
+    return played;
+}
+
+/*
+ * =============================================================================
+ *                       SHARED-MEMORY FRAMEBUFFER EXPORT
+ * =============================================================================
+ */
+
+/*
+ * The shared framebuffer is a named file mapping laid out as a
+ * c3d_shmheader followed by two slots. Each slot holds max_width *
+ * max_height COLORREFs (empty cells already carry the background
+ * color) followed by as many floats of depth (INFINITY where nothing
+ * was drawn). Rows are max_width apart, whatever the frame's size.
+ *
+ * The renderer always writes the slot that is not the front one and
+ * then swaps, bumping seq to odd before the swap and back to even after
+ * it. Readers work seqlock style:
+ *
+ *     c3d_intui seq = c3d_shmreadbegin(h);
+ *     ... read c3d_shmcolor(h, h->front), c3d_shmdepth(h, h->front) ...
+ *     if (c3d_shmreadretry(h, seq)) ... the frame changed underneath, read again
+ */
+
+/**
+ * Returns the color plane of a slot.
+ */
+STDC3DDEF COLORREF *c3d_shmcolor(c3d_shmheader *h, c3d_intui slot){
+    size_t cells = (size_t)h->max_width * h->max_height;
+    c3d_intuc *base = (c3d_intuc *)h + sizeof(c3d_shmheader);
+    return (COLORREF *)(base + slot * cells * (sizeof(COLORREF) + sizeof(float)));
+}
+
+/**
+ * Returns the depth plane of a slot.
+ */
+STDC3DDEF float *c3d_shmdepth(c3d_shmheader *h, c3d_intui slot){
+    size_t cells = (size_t)h->max_width * h->max_height;
+    return (float *)(c3d_shmcolor(h, slot) + cells);
+}
+
+/**
+ * Creates the shared framebuffer a display exports its frames to. Frames
+ * larger than max_width x max_height are cropped.
+ */
+STDC3DDEF bool c3d_shmopen(display *d, const char *name, int max_width, int max_height){
+    if (d->shm != NULL) return false;
+
+    size_t cells = (size_t)max_width * max_height;
+    size_t size = sizeof(c3d_shmheader) + 2 * cells * (sizeof(COLORREF) + sizeof(float));
+
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                        (DWORD)((uint64_t)size >> 32), (DWORD)size, name);
+    if (mapping == NULL){
+        fprintf(stderr, "Could not create shared framebuffer %s.\n", name);
+        return false;
+    }
+
+    c3d_shmheader *h = (c3d_shmheader *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (h == NULL){
+        fprintf(stderr, "Could not map shared framebuffer %s.\n", name);
+        CloseHandle(mapping);
+        return false;
+    }
+
+    c3d_shm *shm = (c3d_shm *)malloc(sizeof(c3d_shm));
+    if (shm == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_shmopen.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(h, 0, sizeof(c3d_shmheader));
+    h->version = C3D_SHM_VERSION;
+    h->max_width = max_width;
+    h->max_height = max_height;
+    MemoryBarrier();
+    h->magic = C3D_SHM_MAGIC;
+
+    shm->mapping = mapping;
+    shm->header = h;
+    d->shm = shm;
+    return true;
+}
+
+/**
+ * Stops exporting frames and releases the mapping. Readers that still
+ * have it mapped keep the last frame.
+ */
+STDC3DDEF void c3d_shmclose(display *d){
+    if (d->shm == NULL) return;
+
+    UnmapViewOfFile(d->shm->header);
+    CloseHandle(d->shm->mapping);
+    free(d->shm);
+    d->shm = NULL;
+}
+
+/**
+ * Copies the frame into the back slot and makes it the front one.
+ */
+STDC3DDEF void c3d_shmframe(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer){
+    c3d_shmheader *h = d->shm->header;
+    c3d_intui back = h->front ^ 1;
+    int w = min((int)d->display_width, (int)h->max_width);
+    int hh = min((int)d->display_height, (int)h->max_height);
+    COLORREF bg = c3d_bgcolor(d);
+
+    COLORREF *color = c3d_shmcolor(h, back);
+    float *depth = c3d_shmdepth(h, back);
+
+    for (int y = 0; y < hh; y++){
+        COLORREF *crow = color + (size_t)y * h->max_width;
+        for (int x = 0; x < w; x++){
+            crow[x] = (buffer[y][x] == L' ') ? bg : colorBuffer[y][x];
+        }
+        memcpy(depth + (size_t)y * h->max_width, depthBuffer[y], w * sizeof(float));
+    }
+
+    InterlockedIncrement(&h->seq);
+    h->slots[back].width = w;
+    h->slots[back].height = hh;
+    h->slots[back].frame = d->frame_count;
+    h->front = back;
+    InterlockedIncrement(&h->seq);
+}
+
+/**
+ * Maps a shared framebuffer exported by another process, read only.
+ * Returns NULL if there's none by that name.
+ */
+STDC3DDEF c3d_shmheader *c3d_shmattach(const char *name){
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (mapping == NULL) return NULL;
+
+    c3d_shmheader *h = (c3d_shmheader *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); // the view keeps the mapping alive
+
+    if (h != NULL && (h->magic != C3D_SHM_MAGIC || h->version != C3D_SHM_VERSION)){
+        UnmapViewOfFile(h);
+        return NULL;
+    }
+    return h;
+}
+
+/**
+ * Waits until no swap is in progress and returns the sequence number to
+ * hand to c3d_shmreadretry() once done reading.
+ */
+STDC3DDEF c3d_intui c3d_shmreadbegin(c3d_shmheader *h){
+    LONG seq;
+    while ((seq = h->seq) & 1) Sleep(0);
+    MemoryBarrier();
+    return (c3d_intui)seq;
+}
+
+/**
+ * Returns true if the frame changed while it was being read.
+ */
+STDC3DDEF bool c3d_shmreadretry(c3d_shmheader *h, c3d_intui seq){
+    MemoryBarrier();
+    return (c3d_intui)h->seq != seq;
+}
+
+/*
+ * =============================================================================
+ *                            FRAME BROADCAST SERVER
+ * =============================================================================
+ */
+
+#ifdef C3D_NET
+
+/*
+ * The server speaks the .c3drec format over TCP. A viewer is sent the
+ * magic and version, then frames, starting from a keyframe. Every frame
+ * is encoded once and queued to each viewer's socket without blocking.
+ * A viewer that hasn't taken the last frame yet skips frames until the
+ * next keyframe, so it can't slow the renderer or the other viewers.
+ */
+
+/**
+ * Sends as much of a viewer's queued bytes as its socket takes right
+ * now. Returns false if the viewer is gone.
+ */
+STDC3DDEF bool c3d_netflush(c3d_netclient *c){
+    while (c->sent < c->pending.len){
+        int n = send(c->s, c->pending.data + c->sent, (int)min(c->pending.len - c->sent, (size_t)INT_MAX), 0);
+        if (n == SOCKET_ERROR) return WSAGetLastError() == WSAEWOULDBLOCK;
+        c->sent += n;
+    }
+    c->pending.len = 0;
+    c->sent = 0;
+    return true;
+}
+
+/**
+ * Disconnects a viewer. The last one takes its place.
+ */
+STDC3DDEF void c3d_netdrop(c3d_server *sv, int i){
+    closesocket(sv->clients[i].s);
+    free(sv->clients[i].pending.data);
+    sv->clients[i] = sv->clients[--sv->client_count];
+}
+
+/**
+ * Accepts every viewer waiting on the listening socket.
+ */
+STDC3DDEF void c3d_netaccept(c3d_server *sv){
+    SOCKET s;
+    while ((s = accept(sv->listen, NULL, NULL)) != INVALID_SOCKET){
+        u_long nonblocking = 1;
+        BOOL nodelay = TRUE;
+        ioctlsocket(s, FIONBIO, &nonblocking);
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+
+        if (sv->client_count == sv->client_cap){
+            sv->client_cap = sv->client_cap ? sv->client_cap * 2 : 8;
+            sv->clients = (c3d_netclient *)realloc(sv->clients, sv->client_cap * sizeof(c3d_netclient));
+            if (sv->clients == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_netaccept.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        c3d_netclient *c = &sv->clients[sv->client_count++];
+        memset(c, 0, sizeof(c3d_netclient));
+        c->s = s;
+        c->need_key = true;
+        c->joined = true;
+
+        c3d_intuc version[2];
+        c3d_putu16(version, C3D_REC_VERSION);
+        c3d_outappend(&c->pending, C3D_REC_MAGIC, 6);
+        c3d_outappend(&c->pending, (const char *)version, 2);
+    }
+}
+
+/**
+ * Opens a TCP socket listening on host:port, host being an IPv4 address
+ * or NULL for localhost. Winsock must be initialized.
+ */
+STDC3DDEF SOCKET c3d_netlisten(const char *host, c3d_intus port){
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (host == NULL) addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    else if (inet_pton(AF_INET, host, &addr.sin_addr) != 1){
+        fprintf(stderr, "Invalid address to listen on: %s.\n", host);
+        return INVALID_SOCKET;
+    }
+
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOL reuse = TRUE;
+    if (s != INVALID_SOCKET &&
+        (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) == SOCKET_ERROR ||
+         bind(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+         listen(s, SOMAXCONN) == SOCKET_ERROR)){
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    return s;
+}
+
+/**
+ * Connects to host:port, host being a name or an address, localhost if
+ * NULL. Winsock must be initialized.
+ */
+STDC3DDEF SOCKET c3d_netconnect(const char *host, c3d_intus port){
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    SOCKET s = INVALID_SOCKET;
+    if (getaddrinfo(host ? host : "localhost", service, &hints, &res) == 0){
+        for (struct addrinfo *a = res; a != NULL && s == INVALID_SOCKET; a = a->ai_next){
+            s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (s != INVALID_SOCKET && connect(s, a->ai_addr, (int)a->ai_addrlen) == SOCKET_ERROR){
+                closesocket(s);
+                s = INVALID_SOCKET;
+            }
+        }
+        freeaddrinfo(res);
+    }
+    return s;
+}
+
+/**
+ * Starts serving the display's frames on host:port. host is an IPv4
+ * address to listen on, localhost if NULL.
+ */
+STDC3DDEF bool c3d_serverstart(display *d, const char *host, c3d_intus port){
+    if (d->server != NULL) return false;
+
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+        fprintf(stderr, "Could not initialize Winsock.\n");
+        return false;
+    }
+
+    SOCKET s = c3d_netlisten(host, port);
+    u_long nonblocking = 1;
+    if (s == INVALID_SOCKET || ioctlsocket(s, FIONBIO, &nonblocking) == SOCKET_ERROR){
+        fprintf(stderr, "Could not serve on port %u.\n", port);
+        if (s != INVALID_SOCKET) closesocket(s);
+        WSACleanup();
+        return false;
+    }
+
+    c3d_server *sv = (c3d_server *)calloc(1, sizeof(c3d_server));
+    if (sv == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_serverstart.\n");
+        exit(EXIT_FAILURE);
+    }
+    sv->listen = s;
+    d->server = sv;
+    return true;
+}
+
+/**
+ * Disconnects every viewer and stops serving.
+ */
+STDC3DDEF void c3d_serverstop(display *d){
+    c3d_server *sv = d->server;
+    if (sv == NULL) return;
+
+    for (int i = 0; i < sv->client_count; i++){
+        closesocket(sv->clients[i].s);
+        free(sv->clients[i].pending.data);
+    }
+    closesocket(sv->listen);
+    c3d_fbencoderfree(&sv->enc);
+    free(sv->clients);
+    free(sv);
+    WSACleanup();
+    d->server = NULL;
+}
+
+/**
+ * Encodes the framebuffer once and queues it to every viewer that's
+ * keeping up. Nothing is encoded while nobody is watching.
+ */
+STDC3DDEF void c3d_serverframe(display *d, wchar_t **buffer, COLORREF **colorBuffer){
+    c3d_server *sv = d->server;
+
+    c3d_netaccept(sv);
+
+    // whatever is still queued goes out first, so we know who can take a frame
+    for (int i = 0; i < sv->client_count; ){
+        if (!c3d_netflush(&sv->clients[i])){
+            c3d_netdrop(sv, i);
+            continue;
+        }
+        i++;
+    }
+    if (sv->client_count == 0) return;
+
+    // a new viewer gets one keyframe as soon as it has taken the
+    // handshake, instead of waiting for the next one
+    bool key = false;
+    for (int i = 0; i < sv->client_count; i++){
+        key = key || (sv->clients[i].joined && sv->clients[i].pending.len == 0);
+    }
+
+    size_t size;
+    const c3d_intuc *payload = c3d_fbencodeframe(&sv->enc, d, buffer, colorBuffer, key, &size);
+    key = (sv->enc.header[0] == 'K');
+
+    for (int i = 0; i < sv->client_count; ){
+        c3d_netclient *c = &sv->clients[i];
+
+        if (c->pending.len > 0 || (c->need_key && !key)){
+            // still behind, resume at the next keyframe
+            c->need_key = true;
+            c->skipped++;
+        } else {
+            c3d_outappend(&c->pending, (const char *)sv->enc.header, sizeof(sv->enc.header));
+            c3d_outappend(&c->pending, (const char *)payload, size);
+            c->need_key = false;
+            c->joined = false;
+            if (!c3d_netflush(c)){
+                c3d_netdrop(sv, i);
+                continue;
+            }
+        }
+        i++;
+    }
+}
+
+STDC3DDEF bool c3d_netrecvall(SOCKET s, void *data, size_t n){
+    char *p = (char *)data;
+    while (n > 0){
+        int got = recv(s, p, (int)min(n, (size_t)INT_MAX), 0);
+        if (got <= 0) return false;
+        p += got;
+        n -= got;
+    }
+    return true;
+}
+
+/**
+ * Connects to a frame server and shows what it sends through the
+ * display's output backend until the server goes away. Returns the
+ * number of frames shown.
+ */
+STDC3DDEF c3d_intui c3d_netview(display *d, const char *host, c3d_intus port){
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+        fprintf(stderr, "Could not initialize Winsock.\n");
+        return 0;
+    }
+
+    SOCKET s = c3d_netconnect(host, port);
+    if (s == INVALID_SOCKET){
+        fprintf(stderr, "Could not connect to %s:%u.\n", host ? host : "localhost", port);
+        WSACleanup();
+        return 0;
+    }
+
+    char magic[6];
+    c3d_intuc version[2];
+    if (!c3d_netrecvall(s, magic, 6) || memcmp(magic, C3D_REC_MAGIC, 6) != 0 ||
+        !c3d_netrecvall(s, version, 2) || (version[0] | (version[1] << 8)) != C3D_REC_VERSION){
+        fprintf(stderr, "%s:%u is not a C3D frame server.\n", host ? host : "localhost", port);
+        closesocket(s);
+        WSACleanup();
+        return 0;
+    }
+
+    c3d_fbdecoder p;
+    memset(&p, 0, sizeof(p));
+    c3d_intui shown = 0;
 
-    vec2 pv0 = c3d_project_vec3vec2(v0_ndc, d->display_width, d->display_height);
-    vec2 pv1 = c3d_project_vec3vec2(v1_ndc, d->display_width, d->display_height);
-    vec2 pv2 = c3d_project_vec3vec2(v2_ndc, d->display_width, d->display_height);
+    c3d_intuc hdr[20];
+    while (c3d_netrecvall(s, hdr, sizeof(hdr))){
+        size_t size = c3d_getu32(hdr + 14);
+        if (!c3d_fbheaderok(hdr)){
+            fprintf(stderr, "%s:%u sent a frame larger than its size allows, disconnecting.\n", host ? host : "localhost", port);
+            break;
+        }
+        if (!c3d_netrecvall(s, c3d_fbdecoderpayload(&p, size), size)) break;
+        if (!c3d_fbdecodeframe(&p, hdr)) continue;
 
-    int minx = max(C3D_MIN(pv0.x, pv1.x, pv2.x), 0);
-    int maxx = min(C3D_MAX(pv0.x, pv1.x, pv2.x), d->display_width - 1);
-    int miny = max(C3D_MIN(pv0.y, pv1.y, pv2.y), 0);
-    int maxy = min(C3D_MAX(pv0.y, pv1.y, pv2.y), d->display_height - 1);
+        c3d_fbshow(d, &p);
+        shown++;
+    }
 
-    float area = c3d_edge(pv0, pv1, pv2);
-    if (area == 0) return;
+    c3d_fbdecoderfree(&p);
+    closesocket(s);
+    WSACleanup();
 
-    float inv_w0 = 1.0f / w0_clip;
-    float inv_w1 = 1.0f / w1_clip;
-    float inv_w2 = 1.0f / w2_clip;
+    return shown;
+}
 
-    vec3 wPos0 = t.vx; 
-    vec3 wPos1 = t.vy;
-    vec3 wPos2 = t.vz;
+#endif // C3D_NET
 
-    vec3 n0 = t.nvx;
-    vec3 n1 = t.nvy;
-    vec3 n2 = t.nvz;
+/*
+ * =============================================================================
+ *                        SORT-FIRST DISTRIBUTED RENDERING
+ * =============================================================================
+ */
 
-    vec2 uv0 = t.uvx;
-    vec2 uv1 = t.uvy;
-    vec2 uv2 = t.uvz;
+#ifdef C3D_NET
+
+/*
+ * A cluster splits the screen into bands of rows, one per worker
+ * process. Workers load the same scene as the coordinator and run its
+ * behaviors in lockstep, so behaviors must only depend on the frame
+ * count. Everything else changes through small messages, only sent
+ * when something changed:
+ *
+ *     'C' cam                       the camera
+ *     'L' u32 count, light[count]   the lights
+ *     'T' u32 mesh, u8 relative, mat4   a transform, see c3d_clusterxform()
+ *     'F' u16 width, height, y0, y1, vec3 background   render rows [y0, y1)
+ *     'Q'                           quit
+ *
+ * Structs are sent as they are in memory, so the coordinator and the
+ * workers must be built alike. A worker answers every frame with a
+ * 12 byte header ('R', u8 keyframe, u8 incomplete, u8 reserved, u32
+ * render time in microseconds, u32 size) and its rows encoded with
+ * c3d_fbencode(), as a delta against its last frame when the band
+ * didn't move.
+ *
+ * Every C3D_CLUSTER_REBALANCE frames the bands are resized so that each
+ * worker gets rows in proportion to how fast it rendered them. When a
+ * worker is lost the others split its rows, and the frame it was lost
+ * in is drawn locally.
+ *
+ * A sort-last cluster splits the meshes instead: worker k of n draws the
+ * meshes with index % n == k and renders the whole screen. The
+ * coordinator starts it with
+ *
+ *     'P' u16 index, u16 count, count * (u16 length, "host:port")
+ *
+ * after which the workers connect to each other and composite in a
+ * binary tree: in round r, worker k + 2^r sends its frame to worker k
+ * (for k a multiple of 2^(r+1)), which keeps the nearer of the two at
+ * every cell. A frame travels as its depth rows, laid out as in
+ * c3d_update(), followed by its color rows and glyph rows. Only worker
+ * 0 answers with cells, the others answer with an empty payload.
+ *
+ * Workers keep the triangles of every mesh, so every mesh casts shadows
+ * on every worker, and when a worker is lost the coordinator sends the
+ * others a new 'P' and they split its meshes among themselves. Where two
+ * meshes meet at exactly the same depth, the composite keeps the lower
+ * numbered worker's cell, which may not be the mesh a local render
+ * draws there.
+ */
+
+/**
+ * Sends all of data, blocking. Returns false if the peer is gone.
+ */
+STDC3DDEF bool c3d_netsendall(SOCKET s, const void *data, size_t n){
+    const char *p = (const char *)data;
+    while (n > 0){
+        int sent = send(s, p, (int)min(n, (size_t)INT_MAX), 0);
+        if (sent == SOCKET_ERROR) return false;
+        p += sent;
+        n -= sent;
+    }
+    return true;
+}
+
+/**
+ * Connects to a "host:port" address.
+ */
+STDC3DDEF SOCKET c3d_netdial(const char *addr){
+    char host[256];
+    const char *colon = strrchr(addr, ':');
+    size_t host_len = colon ? (size_t)(colon - addr) : 0;
+
+    if (colon == NULL || host_len >= sizeof(host)) return INVALID_SOCKET;
+    memcpy(host, addr, host_len);
+    host[host_len] = '\0';
+
+    SOCKET s = c3d_netconnect(host, (c3d_intus)atoi(colon + 1));
+    if (s != INVALID_SOCKET){
+        BOOL nodelay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+    }
+    return s;
+}
 
-    for (int y = miny; y <= maxy; y++) {
-        for (int x = minx; x <= maxx; x++) {
-            vec2 vxy = {x + 0.5f, y + 0.5f};
-            float w0 = c3d_edge(pv1, pv2, vxy) / area;
-            float w1 = c3d_edge(pv2, pv0, vxy) / area;
-            float w2 = c3d_edge(pv0, pv1, vxy) / area;
+STDC3DDEF void c3d_clusterdrop(c3d_cluster *cl, int i){
+    c3d_clusterworker *wk = &cl->workers[i];
 
-            if (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f) {
-                float denom = w0 * inv_w0 + w1 * inv_w1 + w2 * inv_w2;
-                if (denom == 0.0f) continue;
-                float z = (v0_ndc.z * w0 / w0_clip + v1_ndc.z * w1 / w1_clip + v2_ndc.z * w2 / w2_clip) / denom ;
+    fprintf(stderr, "Lost cluster worker %s.\n", wk->addr);
+    closesocket(wk->s);
+    free(wk->planes);
+    free(wk->payload);
+    free(wk->addr);
 
-                if (z < depthBuffer[y][x]) {
-                    depthBuffer[y][x] = z;
+    // the order is kept, a sort-last worker's index is its place
+    cl->worker_count--;
+    memmove(&cl->workers[i], &cl->workers[i + 1], (cl->worker_count - i) * sizeof(c3d_clusterworker));
+
+    // the others split its rows evenly until the next rebalance
+    for (int k = 0; k < cl->worker_count; k++) cl->workers[k].share = 1.0f / cl->worker_count;
+}
+
+/**
+ * Tells every worker of a sort-last cluster which meshes it draws and
+ * where its peers are. Returns false if a worker is gone, with the
+ * others left waiting for peers that won't come.
+ */
+STDC3DDEF bool c3d_clusterpartition(c3d_cluster *cl){
+    int count = cl->worker_count;
+
+    for (int i = 0; i < count; i++){
+        c3d_intuc head[5] = {'P'};
+        c3d_putu16(head + 1, (c3d_intus)i);
+        c3d_putu16(head + 3, (c3d_intus)count);
+        c3d_outappend(&cl->msg, (const char *)head, sizeof(head));
+
+        for (int k = 0; k < count; k++){
+            c3d_intuc len[2];
+            c3d_putu16(len, (c3d_intus)strlen(cl->workers[k].addr));
+            c3d_outappend(&cl->msg, (const char *)len, 2);
+            c3d_outstr(&cl->msg, cl->workers[k].addr);
+        }
+
+        bool sent = c3d_netsendall(cl->workers[i].s, cl->msg.data, cl->msg.len);
+        cl->msg.len = 0;
+        if (!sent){
+            fprintf(stderr, "Could not start cluster worker %s.\n", cl->workers[i].addr);
+            return false;
+        }
+        cl->workers[i].root = (i == 0);
+    }
+    return true;
+}
+
+/**
+ * Connects to the workers, given as "host:port" strings, and renders
+ * through them from the next c3d_update() on. In a sort-last cluster
+ * the workers reach each other through the same addresses.
+ */
+STDC3DDEF bool c3d_clusterstart(display *d, const char **workers, int count, c3d_clustermode mode){
+    if (d->cluster != NULL || count <= 0) return false;
+    if (mode == C3D_CLUSTER_SORTLAST && count > (1 << C3D_CLUSTER_MAXROUNDS)) return false;
+
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+        fprintf(stderr, "Could not initialize Winsock.\n");
+        return false;
+    }
+
+    c3d_cluster *cl = (c3d_cluster *)calloc(1, sizeof(c3d_cluster));
+    if (cl == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_clusterstart.\n");
+        exit(EXIT_FAILURE);
+    }
+    cl->workers = (c3d_clusterworker *)calloc(count, sizeof(c3d_clusterworker));
+    if (cl->workers == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_clusterstart.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++){
+        SOCKET s = c3d_netdial(workers[i]);
+        if (s == INVALID_SOCKET){
+            fprintf(stderr, "Could not connect to cluster worker %s.\n", workers[i]);
+            for (int k = 0; k < cl->worker_count; k++){
+                closesocket(cl->workers[k].s);
+                free(cl->workers[k].addr);
+            }
+            free(cl->workers);
+            free(cl);
+            WSACleanup();
+            return false;
+        }
+
+        // a worker that hangs is dropped like one that disconnects
+        DWORD timeout = C3D_CLUSTER_TIMEOUT;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+
+        c3d_clusterworker *wk = &cl->workers[cl->worker_count];
+        wk->s = s;
+        wk->share = 1.0f / count;
+        wk->root = true;
+        wk->addr = _strdup(workers[i]);
+        if (wk->addr == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_clusterstart.\n");
+            exit(EXIT_FAILURE);
+        }
+        cl->worker_count++;
+    }
+
+    cl->mode = mode;
+    d->cluster = cl;
+    if (mode == C3D_CLUSTER_SORTLAST && !c3d_clusterpartition(cl)){
+        c3d_clusterstop(d);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Tells the workers to quit and goes back to rendering locally.
+ */
+STDC3DDEF void c3d_clusterstop(display *d){
+    c3d_cluster *cl = d->cluster;
+    if (cl == NULL) return;
+
+    for (int i = 0; i < cl->worker_count; i++){
+        c3d_netsendall(cl->workers[i].s, "Q", 1);
+        closesocket(cl->workers[i].s);
+        free(cl->workers[i].planes);
+        free(cl->workers[i].payload);
+        free(cl->workers[i].addr);
+    }
+    free(cl->workers);
+    free(cl->msg.data);
+    free(cl->lights);
+    free(cl);
+    WSACleanup();
+    d->cluster = NULL;
+}
+
+/**
+ * Transforms a mesh like c3d_meshrel() (or c3d_meshabs() if relative
+ * is false), on the coordinator and on every worker.
+ */
+STDC3DDEF void c3d_clusterxform(display *d, c3d_intui id, mat4 m, bool relative){
+    if (id >= d->mesh_count) return;
+
+    if (relative) c3d_meshrel(&d->meshes[id], m);
+    else          c3d_meshabs(&d->meshes[id], m);
+
+    if (d->cluster == NULL) return;
+
+    c3d_intuc head[6] = {'T'};
+    c3d_putu32(head + 1, id);
+    head[5] = relative;
+    c3d_outappend(&d->cluster->msg, (const char *)head, sizeof(head));
+    c3d_outappend(&d->cluster->msg, (const char *)&m, sizeof(mat4));
+}
+
+/**
+ * Splits the rows among the workers, resizing the bands by each
+ * worker's speed every C3D_CLUSTER_REBALANCE frames.
+ */
+STDC3DDEF void c3d_clustersplit(c3d_cluster *cl, int h){
+    int count = cl->worker_count;
+
+    // the whole screen for everyone, only the root of the tree answers with cells
+    if (cl->mode == C3D_CLUSTER_SORTLAST){
+        for (int i = 0; i < count; i++){
+            cl->workers[i].y0 = 0;
+            cl->workers[i].y1 = (c3d_intus)h;
+        }
+        return;
+    }
+
+    if (cl->frames > 0 && cl->frames % C3D_CLUSTER_REBALANCE == 0){
+        float speed_sum = 0.0f;
+        for (int i = 0; i < count; i++){
+            c3d_clusterworker *wk = &cl->workers[i];
+            wk->speed = (wk->y1 - wk->y0 + 1) / (float)max(wk->time, 1.0);
+            speed_sum += wk->speed;
+        }
+        // halfway to the measured split, so one slow frame doesn't swing it
+        for (int i = 0; i < count; i++){
+            c3d_clusterworker *wk = &cl->workers[i];
+            wk->share = 0.5f * wk->share + 0.5f * (wk->speed / speed_sum);
+            wk->time = 0.0;
+        }
+    }
+
+    float acc = 0.0f;
+    int y = 0;
+    for (int i = 0; i < count; i++){
+        c3d_clusterworker *wk = &cl->workers[i];
+        int remaining = count - 1 - i;
+
+        acc += wk->share;
+        int end = (remaining == 0) ? h : (int)(acc * h + 0.5f);
+        end = max(end, y + 1);              // everyone keeps a row to be measured on
+        end = min(end, h - remaining);
+        end = max(end, y);
+
+        wk->y0 = (c3d_intus)y;
+        wk->y1 = (c3d_intus)end;
+        y = end;
+    }
+}
+
+/**
+ * Renders the frame on the workers and gathers their rows into the
+ * framebuffer. Workers only send glyphs and colors, so the depth buffer
+ * stays empty on the coordinator, and a shared-memory export shows no
+ * depth. Returns false when the frame couldn't be rendered remotely and
+ * the caller should draw it locally: once every worker is lost, which
+ * stops the cluster, and in the frame any worker is lost in.
+ */
+STDC3DDEF bool c3d_clusterframe(display *d, wchar_t **buffer, COLORREF **colorBuffer){
+    c3d_cluster *cl = d->cluster;
+    int w = d->display_width;
+    int h = d->display_height;
+
+    if (!cl->synced || memcmp(&cl->camera, &d->camera, sizeof(cam)) != 0){
+        c3d_outchar(&cl->msg, 'C');
+        c3d_outappend(&cl->msg, (const char *)&d->camera, sizeof(cam));
+        cl->camera = d->camera;
+    }
+
+    // compared field by field, the padding of a light is garbage
+    bool lights_same = cl->synced && cl->light_count == d->light_count;
+    for (c3d_intui i = 0; lights_same && i < d->light_count; i++){
+        lights_same = c3d_lightsame(&cl->lights[i], &d->lights[i]);
+    }
+
+    if (!lights_same){
+        c3d_intuc head[5] = {'L'};
+        c3d_putu32(head + 1, d->light_count);
+        c3d_outappend(&cl->msg, (const char *)head, sizeof(head));
+        c3d_outappend(&cl->msg, (const char *)d->lights, d->light_count * sizeof(light));
+
+        cl->lights = (light *)realloc(cl->lights, max(d->light_count, 1) * sizeof(light));
+        if (cl->lights == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_clusterframe.\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(cl->lights, d->lights, d->light_count * sizeof(light));
+        cl->light_count = d->light_count;
+    }
+    cl->synced = true;
+
+    c3d_clustersplit(cl, h);
+    int started = cl->worker_count;
+
+    // all requests go out before any answer is read, so the workers render at the same time
+    for (int i = 0; i < cl->worker_count; ){
+        c3d_clusterworker *wk = &cl->workers[i];
+        c3d_intuc frame[9] = {'F'};
+        c3d_putu16(frame + 1, (c3d_intus)w);
+        c3d_putu16(frame + 3, (c3d_intus)h);
+        c3d_putu16(frame + 5, wk->y0);
+        c3d_putu16(frame + 7, wk->y1);
+
+        if (!c3d_netsendall(wk->s, cl->msg.data, cl->msg.len) ||
+            !c3d_netsendall(wk->s, frame, sizeof(frame)) ||
+            !c3d_netsendall(wk->s, &d->background_color, sizeof(vec3))){
+            c3d_clusterdrop(cl, i);
+            continue;
+        }
+        i++;
+    }
+    cl->msg.len = 0;
+
+    bool complete = true;
+    for (int i = 0; i < cl->worker_count; ){
+        c3d_clusterworker *wk = &cl->workers[i];
+        int rows = wk->root ? wk->y1 - wk->y0 : 0;
+        size_t n = (size_t)w * rows * 5;
+        c3d_intuc head[12];
+
+        bool ok = c3d_netrecvall(wk->s, head, sizeof(head)) && head[0] == 'R';
+        complete = complete && ok && !head[2];
+        size_t size = ok ? c3d_getu32(head + 8) : 0;
+
+        if (ok && size > wk->payload_cap){
+            wk->payload = (c3d_intuc *)realloc(wk->payload, size);
+            if (wk->payload == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_clusterframe.\n");
+                exit(EXIT_FAILURE);
+            }
+            wk->payload_cap = size;
+        }
+        ok = ok && c3d_netrecvall(wk->s, wk->payload, size);
+
+        if (ok && n != wk->planes_size){
+            wk->planes = (c3d_intuc *)realloc(wk->planes, max(n, (size_t)1));
+            if (wk->planes == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_clusterframe.\n");
+                exit(EXIT_FAILURE);
+            }
+            wk->planes_size = n;
+        }
+        ok = ok && c3d_fbdecode(wk->payload, size, wk->planes, n, head[1] == 0);
+
+        if (!ok){
+            c3d_clusterdrop(cl, i);
+            continue;
+        }
+
+        wk->time += c3d_getu32(head + 4);
+        c3d_fbunplanes(wk->planes, w, rows, buffer + wk->y0, colorBuffer + wk->y0);
+        i++;
+    }
+
+    if (cl->worker_count == 0){
+        fprintf(stderr, "Lost every cluster worker, rendering locally.\n");
+        c3d_clusterstop(d);
+        return false;
+    }
+
+    // a lost worker's rows or meshes are missing from this frame, the
+    // survivors take them over from the next one on
+    if (cl->worker_count < started || !complete){
+        if (cl->mode == C3D_CLUSTER_SORTLAST && !c3d_clusterpartition(cl)){
+            fprintf(stderr, "Lost the compositing tree, rendering locally.\n");
+            c3d_clusterstop(d);
+        }
+        return false;
+    }
+
+    cl->frames++;
+    return true;
+}
+
+/**
+ * Connects a sort-last worker to its neighbours in the compositing tree,
+ * dialing its parent and accepting its children on ls. peers[r] ends up
+ * as the socket used in round r.
+ */
+STDC3DDEF bool c3d_workerpeers(SOCKET ls, int index, int count, char **addrs, SOCKET *peers){
+    int children = 0;
+
+    for (int r = 0; (1 << r) < count; r++){
+        int step = 1 << r;
+        if (index & step){
+            c3d_intuc id[2];
+            c3d_putu16(id, (c3d_intus)index);
+            peers[r] = c3d_netdial(addrs[index - step]);
+            if (peers[r] == INVALID_SOCKET || !c3d_netsendall(peers[r], id, 2)) return false;
+            break;
+        }
+        if (index + step < count) children++;
+    }
+
+    // children may dial in any order
+    while (children-- > 0){
+        c3d_intuc id[2];
+        SOCKET s = accept(ls, NULL, NULL);
+        if (s == INVALID_SOCKET || !c3d_netrecvall(s, id, 2)) return false;
+
+        int child = id[0] | (id[1] << 8);
+        int r = 0;
+        while (r < C3D_CLUSTER_MAXROUNDS && index + (1 << r) < child) r++;
+        if (r == C3D_CLUSTER_MAXROUNDS || index + (1 << r) != child) return false;
+
+        BOOL nodelay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+        peers[r] = s;
+    }
+    return true;
+}
+
+/**
+ * Runs this worker's part of the compositing tree: merges the frames of
+ * its children into its own, nearest cell wins, and sends the result to
+ * its parent. Returns false if a peer is gone.
+ */
+STDC3DDEF bool c3d_composite(int index, int count, SOCKET *peers, c3d_outbuf *stage,
+                             wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer, int w, int h){
+    size_t cells = (size_t)w * h;
+    size_t size = cells * (sizeof(float) + sizeof(COLORREF) + sizeof(wchar_t));
+
+    stage->len = 0;
+    c3d_outreserve(stage, size);
+
+    for (int r = 0; (1 << r) < count; r++){
+        int step = 1 << r;
+
+        if (index & step){
+            for (int y = 0; y < h; y++) c3d_outappend(stage, (const char *)depthBuffer[y], w * sizeof(float));
+            for (int y = 0; y < h; y++) c3d_outappend(stage, (const char *)colorBuffer[y], w * sizeof(COLORREF));
+            for (int y = 0; y < h; y++) c3d_outappend(stage, (const char *)buffer[y], w * sizeof(wchar_t));
+            return c3d_netsendall(peers[r], stage->data, stage->len);
+        }
+        if (index + step >= count) continue;
+
+        if (!c3d_netrecvall(peers[r], stage->data, size)) return false;
+
+        const float *z = (const float *)stage->data;
+        const COLORREF *c = (const COLORREF *)(z + cells);
+        const wchar_t *g = (const wchar_t *)(c + cells);
+
+        for (int y = 0; y < h; y++){
+            size_t row = (size_t)y * w;
+            for (int x = 0; x < w; x++){
+                if (z[row + x] < depthBuffer[y][x]){
+                    depthBuffer[y][x] = z[row + x];
+                    colorBuffer[y][x] = c[row + x];
+                    buffer[y][x] = g[row + x];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Serves as a cluster worker for a display loaded with the same scene as
+ * the coordinator's. Waits for a coordinator on host:port (any address
+ * if host is NULL) and renders for it until it quits. Returns the
+ * number of frames rendered.
+ */
+STDC3DDEF c3d_intui c3d_workerserve(display *d, const char *host, c3d_intus port){
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+        fprintf(stderr, "Could not initialize Winsock.\n");
+        return 0;
+    }
+
+    // the listening socket stays open for the peers of a sort-last cluster
+    SOCKET ls = c3d_netlisten(host ? host : "0.0.0.0", port);
+    SOCKET s = (ls != INVALID_SOCKET) ? accept(ls, NULL, NULL) : INVALID_SOCKET;
+    if (s == INVALID_SOCKET){
+        if (ls != INVALID_SOCKET) closesocket(ls);
+        fprintf(stderr, "Could not serve as a cluster worker on port %u.\n", port);
+        WSACleanup();
+        return 0;
+    }
+
+    BOOL nodelay = TRUE;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+
+    c3d_intuc *prev = NULL, *cur = NULL;
+    size_t planes_size = 0;
+    int last_w = -1, last_y0 = -1, last_y1 = -1;
+    c3d_outbuf pack = {0};
+    c3d_outbuf stage = {0};
+    c3d_intui rendered = 0;
+
+    int index = 0, count = 1;
+    SOCKET peers[C3D_CLUSTER_MAXROUNDS];
+    for (int r = 0; r < C3D_CLUSTER_MAXROUNDS; r++) peers[r] = INVALID_SOCKET;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    char type;
+    while (c3d_netrecvall(s, &type, 1) && type != 'Q'){
+        if (type == 'C'){
+            if (!c3d_netrecvall(s, &d->camera, sizeof(cam))) break;
+        } else if (type == 'L'){
+            c3d_intuc count[4];
+            if (!c3d_netrecvall(s, count, 4)) break;
+            d->light_count = c3d_getu32(count);
+            d->lights = (light *)realloc(d->lights, max(d->light_count, 1) * sizeof(light));
+            if (d->lights == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_workerserve.\n");
+                exit(EXIT_FAILURE);
+            }
+            if (!c3d_netrecvall(s, d->lights, d->light_count * sizeof(light))) break;
+        } else if (type == 'T'){
+            c3d_intuc head[5];
+            mat4 m;
+            if (!c3d_netrecvall(s, head, 5) || !c3d_netrecvall(s, &m, sizeof(mat4))) break;
+            c3d_intui id = c3d_getu32(head);
+            if (id < d->mesh_count){
+                if (head[4]) c3d_meshrel(&d->meshes[id], m);
+                else         c3d_meshabs(&d->meshes[id], m);
+            }
+        } else if (type == 'P'){
+            c3d_intuc head[4];
+            if (!c3d_netrecvall(s, head, 4)) break;
+
+            // a new partition after a worker was lost, the tree is built again
+            for (int r = 0; r < C3D_CLUSTER_MAXROUNDS; r++){
+                if (peers[r] != INVALID_SOCKET) closesocket(peers[r]);
+                peers[r] = INVALID_SOCKET;
+            }
+
+            index = head[0] | (head[1] << 8);
+            count = head[2] | (head[3] << 8);
+            if (count == 0 || index >= count || count > (1 << C3D_CLUSTER_MAXROUNDS)) break;
+
+            char **addrs = (char **)calloc(count, sizeof(char *));
+            bool ok = (addrs != NULL);
+            for (int i = 0; ok && i < count; i++){
+                c3d_intuc len[2];
+                ok = c3d_netrecvall(s, len, 2);
+                int n = ok ? (len[0] | (len[1] << 8)) : 0;
+                addrs[i] = (char *)calloc(n + 1, 1);
+                ok = ok && addrs[i] != NULL && c3d_netrecvall(s, addrs[i], n);
+            }
+
+            // the other workers' meshes stay loaded, to be taken over if one is lost
+            d->mesh_part = index;
+            d->mesh_parts = count;
+
+            ok = ok && c3d_workerpeers(ls, index, count, addrs, peers);
+            for (int i = 0; addrs != NULL && i < count; i++) free(addrs[i]);
+            free(addrs);
+            if (!ok){
+                fprintf(stderr, "Could not reach the other cluster workers.\n");
+                break;
+            }
+        } else if (type == 'F'){
+            c3d_intuc frame[8];
+            if (!c3d_netrecvall(s, frame, 8) || !c3d_netrecvall(s, &d->background_color, sizeof(vec3))) break;
+            int w = frame[0] | (frame[1] << 8);
+            int h = frame[2] | (frame[3] << 8);
+            int y0 = frame[4] | (frame[5] << 8);
+            int y1 = frame[6] | (frame[7] << 8);
+            if (y1 > h || y0 > y1) break;
+
+            d->display_width = (c3d_intus)w;
+            d->display_height = (c3d_intus)h;
+            d->region_y0 = (c3d_intus)y0;
+            d->region_y1 = (c3d_intus)y1;
+
+            c3d_runbehaviors(d);
+
+            // only our rows get memory, the rasterizer never leaves them
+            float** depthBuffer = (float**)calloc(h, sizeof(float*));
+            wchar_t** buffer = (wchar_t**)calloc(h, sizeof(wchar_t*));
+            COLORREF** colorBuffer = (COLORREF**)calloc(h, sizeof(COLORREF*));
+            for (int i = y0; i < y1; i++) {
+                depthBuffer[i] = (float*)malloc(w * sizeof(float));
+                buffer[i] = (wchar_t*)malloc(w * sizeof(wchar_t));
+                colorBuffer[i] = (COLORREF*)malloc(w * sizeof(COLORREF));
+
+                for (int j = 0; j < w; j++) {
+                    buffer[i][j] = L' ';
+                    colorBuffer[i][j] = RGB(0, 0, 0);
+                    depthBuffer[i][j] = INFINITY;
+                }
+            }
+
+            LARGE_INTEGER t0, t1;
+            QueryPerformanceCounter(&t0);
+            // a band with no rows is drawn as nothing, region_y1 of 0 would be the whole screen
+            if (y0 < y1) c3d_drawscene(d, buffer, colorBuffer, depthBuffer);
+            QueryPerformanceCounter(&t1);
+            d->frame_count++;
+
+            bool composited = (count == 1) || c3d_composite(index, count, peers, &stage, buffer, colorBuffer, depthBuffer, w, h);
+
+            // the neighbours waiting on us fail too instead of hanging,
+            // until the coordinator sends a new partition
+            if (!composited){
+                for (int r = 0; r < C3D_CLUSTER_MAXROUNDS; r++){
+                    if (peers[r] != INVALID_SOCKET) closesocket(peers[r]);
+                    peers[r] = INVALID_SOCKET;
+                }
+            }
+
+            // only the root of the tree answers with cells
+            int out_y1 = (index > 0) ? y0 : y1;
+
+            size_t n = (size_t)w * (out_y1 - y0) * 5;
+            if (n > planes_size){
+                prev = (c3d_intuc *)realloc(prev, n);
+                cur = (c3d_intuc *)realloc(cur, n);
+                if (prev == NULL || cur == NULL){
+                    fprintf(stderr, "Memory allocation failed in c3d_workerserve.\n");
+                    exit(EXIT_FAILURE);
+                }
+                planes_size = n;
+            }
+            c3d_fbplanes(buffer + y0, colorBuffer + y0, w, out_y1 - y0, cur);
+
+            bool key = (w != last_w || y0 != last_y0 || out_y1 != last_y1);
+            pack.len = 0;
+            c3d_fbencode(cur, key ? NULL : prev, n, &pack);
+
+            c3d_intuc head[12] = {'R', key, !composited};
+            c3d_putu32(head + 4, (c3d_intui)((t1.QuadPart - t0.QuadPart) * 1000000 / freq.QuadPart));
+            c3d_putu32(head + 8, (c3d_intui)pack.len);
+            bool sent = c3d_netsendall(s, head, sizeof(head)) && c3d_netsendall(s, pack.data, pack.len);
+
+            c3d_intuc *tmp = prev;
+            prev = cur;
+            cur = tmp;
+            last_w = w;
+            last_y0 = y0;
+            last_y1 = out_y1;
+
+            for (int i = y0; i < y1; i++) {
+                free(buffer[i]);
+                free(colorBuffer[i]);
+                free(depthBuffer[i]);
+            }
+            free(buffer);
+            free(colorBuffer);
+            free(depthBuffer);
+
+            if (!sent) break;
+            rendered++;
+        } else {
+            fprintf(stderr, "Unknown cluster message '%c'.\n", type);
+            break;
+        }
+    }
+
+    d->region_y0 = 0;
+    d->region_y1 = 0;
+    d->mesh_part = 0;
+    d->mesh_parts = 0;
+    for (int r = 0; r < C3D_CLUSTER_MAXROUNDS; r++) if (peers[r] != INVALID_SOCKET) closesocket(peers[r]);
+    free(prev);
+    free(cur);
+    free(pack.data);
+    free(stage.data);
+    closesocket(s);
+    closesocket(ls);
+    WSACleanup();
+
+    return rendered;
+}
+
+#endif // C3D_NET
+
+/*
+ * =============================================================================
+ *                             MESH SIMPLIFICATION
+ * =============================================================================
+ */
+
+/*
+ * Levels of detail are made by collapsing edges, those that move the
+ * surface least first, as measured by quadric error (Garland & Heckbert).
+ * Instead of keeping every edge in a priority queue, the edges under an
+ * error threshold are collapsed in rounds, the threshold growing from one
+ * round to the next.
+ *
+ * The levels are cached in a .lod file next to the .obj, with the same
+ * name, see c3d_lodpath(). It starts with
+ * the "C3DLOD" magic and a 16-bit version, then u32 fields for the
+ * triangle count of the mesh they were made from, a hash of its
+ * triangles, the size of a tri and the number of levels. Each level
+ * follows as a u32 triangle count and its triangles as laid out in
+ * memory, so a cache is only good on the kind of machine that wrote it.
+ */
+
+// A vertex of a mesh being simplified, where the corners at one position meet.
+typedef struct c3d_qvertex_t {
+    vec3 p;
+    double q[10];               // error quadric, the upper triangle of a symmetric 4x4 matrix
+    int tstart;                 // its triangles in c3d_qmesh.refs
+    int tcount;
+    bool border;                // on an edge only one triangle has
+} c3d_qvertex;
+
+// A triangle of a mesh being simplified. Its corners keep the normals
+// and texture coordinates they had, whichever vertex they end up on.
+typedef struct c3d_qtri_t {
+    int v[3];
+    double err[4];              // error of collapsing each edge, and the least of them
+    vec3 n;
+    bool deleted;
+    bool dirty;                 // changed this round, its errors may be stale
+    tri corners;
+} c3d_qtri;
+
+// A triangle a vertex is a corner of.
+typedef struct c3d_qref_t {
+    int tid;
+    int corner;
+} c3d_qref;
+
+typedef struct c3d_qmesh_t {
+    c3d_qvertex *verts;
+    c3d_qtri *tris;
+    c3d_qref *refs;
+    int vert_count;
+    int tri_count;
+    int ref_count;
+    int ref_cap;
+} c3d_qmesh;
+
+STDC3DDEF void c3d_qplane(double *q, double a, double b, double c, double d){
+    q[0] += a * a; q[1] += a * b; q[2] += a * c; q[3] += a * d;
+    q[4] += b * b; q[5] += b * c; q[6] += b * d;
+    q[7] += c * c; q[8] += c * d;
+    q[9] += d * d;
+}
+
+STDC3DDEF double c3d_qdet(const double *q, int a11, int a12, int a13, int a21, int a22, int a23, int a31, int a32, int a33){
+    return q[a11] * q[a22] * q[a33] + q[a13] * q[a21] * q[a32] + q[a12] * q[a23] * q[a31]
+         - q[a13] * q[a22] * q[a31] - q[a11] * q[a23] * q[a32] - q[a12] * q[a21] * q[a33];
+}
+
+/**
+ * The error of a point against a quadric, the sum of its squared
+ * distances to the planes in it.
+ */
+STDC3DDEF double c3d_qerror(const double *q, double x, double y, double z){
+    return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x + q[4] * y * y
+         + 2 * q[5] * y * z + 2 * q[6] * y + q[7] * z * z + 2 * q[8] * z + q[9];
+}
+
+/**
+ * The error of collapsing the edge between two vertices, and in p where
+ * the vertex left should go: where their summed quadric is least, or
+ * the best of the ends and the middle if that point is ill-defined.
+ */
+STDC3DDEF double c3d_qedge(const c3d_qmesh *qm, int i0, int i1, vec3 *p){
+    const c3d_qvertex *v0 = &qm->verts[i0], *v1 = &qm->verts[i1];
+    double q[10];
+    for (int k = 0; k < 10; k++) q[k] = v0->q[k] + v1->q[k];
+
+    vec3 mid = {(v0->p.x + v1->p.x) * 0.5f, (v0->p.y + v1->p.y) * 0.5f, (v0->p.z + v1->p.z) * 0.5f};
+    vec3 edge = {v1->p.x - v0->p.x, v1->p.y - v0->p.y, v1->p.z - v0->p.z};
+
+    double det = c3d_qdet(q, 0, 1, 2, 1, 4, 5, 2, 5, 7);
+    if (det != 0.0 && !(v0->border && v1->border)){
+        p->x = (float)(-1.0 / det * c3d_qdet(q, 1, 2, 3, 4, 5, 6, 5, 7, 8));
+        p->y = (float)( 1.0 / det * c3d_qdet(q, 0, 2, 3, 1, 5, 6, 2, 7, 8));
+        p->z = (float)(-1.0 / det * c3d_qdet(q, 0, 1, 3, 1, 4, 6, 2, 5, 8));
+
+        // on flat or creased parts the quadric is nearly singular, and the point may land anywhere
+        vec3 off = {p->x - mid.x, p->y - mid.y, p->z - mid.z};
+        if (c3d_vec3dot(off, off) <= c3d_vec3dot(edge, edge)) return c3d_qerror(q, p->x, p->y, p->z);
+    }
+
+    double e0 = c3d_qerror(q, v0->p.x, v0->p.y, v0->p.z);
+    double e1 = c3d_qerror(q, v1->p.x, v1->p.y, v1->p.z);
+    double em = c3d_qerror(q, mid.x, mid.y, mid.z);
+    if (e0 <= e1 && e0 <= em){
+        *p = v0->p;
+        return e0;
+    }
+    if (e1 <= em){
+        *p = v1->p;
+        return e1;
+    }
+    *p = mid;
+    return em;
+}
 
-                    float u = (uv0.x*inv_w0*w0 + uv1.x*inv_w1*w1 + uv2.x*inv_w2*w2) / denom;
-                    float v = (uv0.y*inv_w0*w0 + uv1.y*inv_w1*w1 + uv2.y*inv_w2*w2) / denom;
+STDC3DDEF void c3d_qerrors(const c3d_qmesh *qm, c3d_qtri *t){
+    vec3 p;
+    t->err[0] = c3d_qedge(qm, t->v[0], t->v[1], &p);
+    t->err[1] = c3d_qedge(qm, t->v[1], t->v[2], &p);
+    t->err[2] = c3d_qedge(qm, t->v[2], t->v[0], &p);
+    t->err[3] = min(t->err[0], min(t->err[1], t->err[2]));
+}
+
+STDC3DDEF void c3d_qpushref(c3d_qmesh *qm, c3d_qref r){
+    if (qm->ref_count == qm->ref_cap){
+        int cap = qm->ref_cap ? qm->ref_cap * 2 : 64;
+        c3d_qref *refs = (c3d_qref *)realloc(qm->refs, cap * sizeof(c3d_qref));
+        if (refs == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_qpushref.\n");
+            exit(EXIT_FAILURE);
+        }
+        qm->refs = refs;
+        qm->ref_cap = cap;
+    }
+    qm->refs[qm->ref_count++] = r;
+}
+
+/**
+ * Whether moving vertex i0 to p, with i1 collapsed into it, would fold
+ * one of i0's other triangles over or squash it to a line. Marks in gone
+ * the triangles that have the edge, which the collapse deletes.
+ */
+STDC3DDEF bool c3d_qflips(const c3d_qmesh *qm, vec3 p, int i0, int i1, bool *gone){
+    const c3d_qvertex *v = &qm->verts[i0];
+    for (int k = 0; k < v->tcount; k++){
+        const c3d_qref *r = &qm->refs[v->tstart + k];
+        const c3d_qtri *t = &qm->tris[r->tid];
+        gone[k] = false;
+        if (t->deleted) continue;
+
+        int id1 = t->v[(r->corner + 1) % 3];
+        int id2 = t->v[(r->corner + 2) % 3];
+        if (id1 == i1 || id2 == i1){
+            gone[k] = true;
+            continue;
+        }
+
+        vec3 d1 = {qm->verts[id1].p.x - p.x, qm->verts[id1].p.y - p.y, qm->verts[id1].p.z - p.z};
+        vec3 d2 = {qm->verts[id2].p.x - p.x, qm->verts[id2].p.y - p.y, qm->verts[id2].p.z - p.z};
+        c3d_vec3normalize(&d1);
+        c3d_vec3normalize(&d2);
+        if (fabsf(c3d_vec3dot(d1, d2)) > 0.999f) return true;
+
+        vec3 n = c3d_vec3cross(d1, d2);
+        c3d_vec3normalize(&n);
+        if (c3d_vec3dot(n, t->n) < 0.2f) return true;
+    }
+    return false;
+}
 
-                    vec3 space;
-                    space.x = (wPos0.x*inv_w0*w0 + wPos1.x*inv_w1*w1 + wPos2.x*inv_w2*w2) / denom;
-                    space.y = (wPos0.y*inv_w0*w0 + wPos1.y*inv_w1*w1 + wPos2.y*inv_w2*w2) / denom;
-                    space.z = (wPos0.z*inv_w0*w0 + wPos1.z*inv_w1*w1 + wPos2.z*inv_w2*w2) / denom;
+/**
+ * Hands the triangles of vertex v over to vertex i0, deleting those
+ * marked in gone, and appends them to the refs as part of i0's new list.
+ */
+STDC3DDEF void c3d_qmove(c3d_qmesh *qm, int i0, int v, const bool *gone, int *alive){
+    int tstart = qm->verts[v].tstart, tcount = qm->verts[v].tcount;
+    for (int k = 0; k < tcount; k++){
+        c3d_qref r = qm->refs[tstart + k];
+        c3d_qtri *t = &qm->tris[r.tid];
+        if (t->deleted) continue;
+        if (gone[k]){
+            t->deleted = true;
+            (*alive)--;
+            continue;
+        }
+        t->v[r.corner] = i0;
+        t->dirty = true;
+        c3d_qerrors(qm, t);
+        c3d_qpushref(qm, r);
+    }
+}
+
+/**
+ * Drops the deleted triangles and rebuilds each vertex's list of
+ * triangles. The first time, also sums up the quadrics, and finds which
+ * vertices are on a border.
+ */
+STDC3DDEF void c3d_qrebuild(c3d_qmesh *qm, bool first){
+    int n = 0;
+    for (int i = 0; i < qm->tri_count; i++){
+        if (!qm->tris[i].deleted) qm->tris[n++] = qm->tris[i];
+    }
+    qm->tri_count = n;
+
+    for (int i = 0; i < qm->tri_count; i++){
+        c3d_qtri *t = &qm->tris[i];
+        vec3 p0 = qm->verts[t->v[0]].p, p1 = qm->verts[t->v[1]].p, p2 = qm->verts[t->v[2]].p;
+        t->n = c3d_vec3cross((vec3){p1.x - p0.x, p1.y - p0.y, p1.z - p0.z}, (vec3){p2.x - p0.x, p2.y - p0.y, p2.z - p0.z});
+        c3d_vec3normalize(&t->n);
+        if (first){
+            for (int k = 0; k < 3; k++){
+                c3d_qplane(qm->verts[t->v[k]].q, t->n.x, t->n.y, t->n.z, -c3d_vec3dot(t->n, p0));
+            }
+        }
+    }
+
+    for (int i = 0; i < qm->vert_count; i++) qm->verts[i].tcount = 0;
+    for (int i = 0; i < qm->tri_count; i++){
+        for (int k = 0; k < 3; k++) qm->verts[qm->tris[i].v[k]].tcount++;
+    }
+    int tstart = 0;
+    for (int i = 0; i < qm->vert_count; i++){
+        qm->verts[i].tstart = tstart;
+        tstart += qm->verts[i].tcount;
+        qm->verts[i].tcount = 0;
+    }
+    qm->ref_count = 0;
+    for (int i = 0; i < tstart; i++) c3d_qpushref(qm, (c3d_qref){0, 0});
+    for (int i = 0; i < qm->tri_count; i++){
+        for (int k = 0; k < 3; k++){
+            c3d_qvertex *v = &qm->verts[qm->tris[i].v[k]];
+            qm->refs[v->tstart + v->tcount++] = (c3d_qref){i, k};
+        }
+    }
 
-                    vec3 normal;
-                    normal.x = (n0.x * inv_w0 * w0 + n1.x * inv_w1 * w1 + n2.x * inv_w2 * w2) / denom;
-                    normal.y = (n0.y * inv_w0 * w0 + n1.y * inv_w1 * w1 + n2.y * inv_w2 * w2) / denom;
-                    normal.z = (n0.z * inv_w0 * w0 + n1.z * inv_w1 * w1 + n2.z * inv_w2 * w2) / denom;
-                    c3d_vec3normalize(&normal);
+    if (!first) return;
+
+    for (int i = 0; i < qm->tri_count; i++) c3d_qerrors(qm, &qm->tris[i]);
+
+    // an edge only one of the vertex's triangles has is on a border
+    int *ids = NULL, *counts = NULL, cap = 0;
+    for (int i = 0; i < qm->vert_count; i++){
+        c3d_qvertex *v = &qm->verts[i];
+        if (v->tcount * 3 > cap){
+            cap = v->tcount * 3;
+            free(ids);
+            free(counts);
+            ids = (int *)malloc(cap * sizeof(int));
+            counts = (int *)malloc(cap * sizeof(int));
+            if (ids == NULL || counts == NULL){
+                fprintf(stderr, "Memory allocation failed in c3d_qrebuild.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
 
-                    vec3 ambient, diffuse, specular;
-                    c3d_bphongshade(d, normal, space, mtl, &ambient, &diffuse, &specular);
+        int m = 0;
+        for (int k = 0; k < v->tcount; k++){
+            const c3d_qtri *t = &qm->tris[qm->refs[v->tstart + k].tid];
+            for (int c = 0; c < 3; c++){
+                int j = 0;
+                while (j < m && ids[j] != t->v[c]) j++;
+                if (j == m){
+                    ids[m] = t->v[c];
+                    counts[m++] = 0;
+                }
+                counts[j]++;
+            }
+        }
+        for (int j = 0; j < m; j++){
+            if (counts[j] == 1) qm->verts[ids[j]].border = true;
+        }
+    }
+    free(ids);
+    free(counts);
+}
 
-                    vec3 tex_color = c3d_texsample(mtl->diffuse_tex, u, v);
+/**
+ * Sets a mesh up for simplifying from a triangle soup, welding the
+ * corners at the same position into one vertex.
+ */
+STDC3DDEF void c3d_qbuild(c3d_qmesh *qm, const tri *tris, int tri_count){
+    memset(qm, 0, sizeof(*qm));
+    int slots = 1;
+    while (slots < tri_count * 6) slots <<= 1;
+
+    qm->tris = (c3d_qtri *)malloc((tri_count ? tri_count : 1) * sizeof(c3d_qtri));
+    qm->verts = (c3d_qvertex *)malloc((tri_count ? tri_count * 3 : 1) * sizeof(c3d_qvertex));
+    int *table = (int *)malloc(slots * sizeof(int));
+    if (qm->tris == NULL || qm->verts == NULL || table == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_qbuild.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < slots; i++) table[i] = -1;
+
+    for (int i = 0; i < tri_count; i++){
+        c3d_qtri *t = &qm->tris[i];
+        const vec3 *v = &tris[i].vx;
+        for (int k = 0; k < 3; k++){
+            int slot = (int)(c3d_vec3hash(v[k]) & (slots - 1));
+            while (table[slot] >= 0){
+                vec3 o = qm->verts[table[slot]].p;
+                if (o.x == v[k].x && o.y == v[k].y && o.z == v[k].z) break;
+                slot = (slot + 1) & (slots - 1);
+            }
+            if (table[slot] < 0){
+                c3d_qvertex *nv = &qm->verts[qm->vert_count];
+                memset(nv, 0, sizeof(*nv));
+                nv->p = v[k];
+                table[slot] = qm->vert_count++;
+            }
+            t->v[k] = table[slot];
+        }
+        t->corners = tris[i];
+        t->deleted = false;
+        t->dirty = false;
+    }
+    qm->tri_count = tri_count;
+    free(table);
+}
 
-                    vec3 final_color;
-                    final_color.x = (ambient.x + diffuse.x) * tex_color.x + specular.x;
-                    final_color.y = (ambient.y + diffuse.y) * tex_color.y + specular.y;
-                    final_color.z = (ambient.z + diffuse.z) * tex_color.z + specular.z;
+/**
+ * Simplifies a triangle soup down to about target triangles, and
+ * returns the new triangles, out_count of them.
+ */
+STDC3DDEF tri *c3d_simplify(const tri *tris, int tri_count, int target, int *out_count){
+    c3d_qmesh qm;
+    c3d_qbuild(&qm, tris, tri_count);
+
+    bool *gone0 = NULL, *gone1 = NULL;
+    int gone_cap = 0;
+    int alive = tri_count;
+
+    for (int round = 0; round < 100 && alive > target; round++){
+        if (round % 5 == 0) c3d_qrebuild(&qm, round == 0);
+        for (int i = 0; i < qm.tri_count; i++) qm.tris[i].dirty = false;
+
+        // the first rounds only take the collapses that cost next to nothing
+        double threshold = 0.000000001 * pow(round + 3.0, 7.0);
+
+        for (int i = 0; i < qm.tri_count && alive > target; i++){
+            c3d_qtri *t = &qm.tris[i];
+            if (t->deleted || t->dirty || t->err[3] > threshold) continue;
+
+            for (int j = 0; j < 3; j++){
+                if (t->err[j] > threshold) continue;
+                int i0 = t->v[j], i1 = t->v[(j + 1) % 3];
+                c3d_qvertex *v0 = &qm.verts[i0], *v1 = &qm.verts[i1];
+                if (v0->border != v1->border) continue;
+
+                int need = max(v0->tcount, v1->tcount);
+                if (need > gone_cap){
+                    gone_cap = need * 2;
+                    free(gone0);
+                    free(gone1);
+                    gone0 = (bool *)malloc(gone_cap * sizeof(bool));
+                    gone1 = (bool *)malloc(gone_cap * sizeof(bool));
+                    if (gone0 == NULL || gone1 == NULL){
+                        fprintf(stderr, "Memory allocation failed in c3d_simplify.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
 
-                    final_color.x = (1.0f - mtl->transparency) * d->background_color.x + mtl->transparency * final_color.x;
-                    final_color.y = (1.0f - mtl->transparency) * d->background_color.y + mtl->transparency * final_color.y;
-                    final_color.z = (1.0f - mtl->transparency) * d->background_color.z + mtl->transparency * final_color.z;
+                vec3 p;
+                c3d_qedge(&qm, i0, i1, &p);
+                if (c3d_qflips(&qm, p, i0, i1, gone0) || c3d_qflips(&qm, p, i1, i0, gone1)) continue;
 
-                    final_color.x = C3D_CLAMP(final_color.x, 0.0f, 1.0f);
-                    final_color.y = C3D_CLAMP(final_color.y, 0.0f, 1.0f);
-                    final_color.z = C3D_CLAMP(final_color.z, 0.0f, 1.0f);
+                v0->p = p;
+                for (int k = 0; k < 10; k++) v0->q[k] += v1->q[k];
 
-                    COLORREF color = RGB(
-                        (int)(final_color.x * 255.0f),
-                        (int)(final_color.y * 255.0f),
-                        (int)(final_color.z * 255.0f)
-                    );
+                int tstart = qm.ref_count;
+                c3d_qmove(&qm, i0, i0, gone0, &alive);
+                c3d_qmove(&qm, i0, i1, gone1, &alive);
+                int tcount = qm.ref_count - tstart;
 
-                    buffer[y][x] = C3D_PXCHAR;
-                    colorBuffer[y][x] = color;
+                // the new list goes where the old one was if it fits
+                if (tcount <= v0->tcount){
+                    if (tcount) memmove(&qm.refs[v0->tstart], &qm.refs[tstart], tcount * sizeof(c3d_qref));
+                    qm.ref_count = tstart;
+                } else {
+                    v0->tstart = tstart;
                 }
+                v0->tcount = tcount;
+                break;
             }
         }
     }
+
+    tri *out = (tri *)malloc((alive ? alive : 1) * sizeof(tri));
+    if (out == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_simplify.\n");
+        exit(EXIT_FAILURE);
+    }
+    int n = 0;
+    for (int i = 0; i < qm.tri_count; i++){
+        const c3d_qtri *t = &qm.tris[i];
+        if (t->deleted) continue;
+        out[n] = t->corners;
+        out[n].vx = qm.verts[t->v[0]].p;
+        out[n].vy = qm.verts[t->v[1]].p;
+        out[n].vz = qm.verts[t->v[2]].p;
+        n++;
+    }
+    *out_count = n;
+
+    free(gone0);
+    free(gone1);
+    free(qm.verts);
+    free(qm.tris);
+    free(qm.refs);
+    return out;
+}
+
+STDC3DDEF c3d_intui c3d_trishash(const tri *tris, int tri_count){
+    const c3d_intuc *b = (const c3d_intuc *)tris;
+    c3d_intui h = 2166136261u;
+    for (size_t i = 0; i < (size_t)tri_count * sizeof(tri); i++) h = (h ^ b[i]) * 16777619u;
+    return h;
 }
 
 /**
- * Updates all buffers.
+ * Reads a mesh's levels of detail from a cache, if it was made from the
+ * same triangles. Every level must be coarser than the last and fit in
+ * what is left of the file, which must hold nothing else.
  */
-void c3d_update(display* d){
-    for (int i = 0; i < d->behavior_count; i++) {
-        behavior *b = &d->behaviors[i];
-        if (b->func != NULL) {
-            switch (b->type){
-                case C3D_CONTINUOUS_BEHAVIOR: b->func(d, b->argc, b->args); break;
-                case C3D_STARTUP_BEHAVIOR: (d->frame_count == 0) ? b->func(d, b->argc, b->args) : NULL; break;
-            }
-        }
+STDC3DDEF bool c3d_lodread(mesh *m, const char *path, c3d_intui hash){
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return false;
+
+    long size = (fseek(f, 0, SEEK_END) == 0) ? ftell(f) : -1;
+    bool ok = size >= 24 && fseek(f, 0, SEEK_SET) == 0;
+
+    char magic[6];
+    c3d_intuc h[18];
+    ok = ok && fread(magic, 1, 6, f) == 6 && memcmp(magic, C3D_LOD_MAGIC, 6) == 0 &&
+         fread(h, 1, 18, f) == 18 && (h[0] | (h[1] << 8)) == C3D_LOD_VERSION &&
+         c3d_getu32(h + 2) == (c3d_intui)m->tri_count && c3d_getu32(h + 6) == hash &&
+         c3d_getu32(h + 10) == sizeof(tri);
+    c3d_intui levels = ok ? c3d_getu32(h + 14) : 0;
+    ok = ok && levels >= 1 && levels <= C3D_LOD_LEVELS;
+
+    c3d_meshlod *lods = NULL;
+    if (ok){
+        lods = (c3d_meshlod *)calloc(levels, sizeof(c3d_meshlod));
+        ok = lods != NULL;
     }
-    float** depthBuffer = (float**)malloc(d->display_height * sizeof(float*));
-    wchar_t** buffer = (wchar_t**)malloc(d->display_height * sizeof(wchar_t*));
-    COLORREF** colorBuffer = (COLORREF**)malloc(d->display_height * sizeof(COLORREF*));
-    
-    for (int i = 0; i < d->display_height; i++) {
-        depthBuffer[i] = (float*)malloc(d->display_width * sizeof(float));
-        buffer[i] = (wchar_t*)malloc(d->display_width * sizeof(wchar_t));
-        colorBuffer[i] = (COLORREF*)malloc(d->display_width * sizeof(COLORREF));
-        
-        for (int j = 0; j < d->display_width; j++) {
-            buffer[i][j] = L' ';
-            colorBuffer[i][j] = RGB(0, 0, 0);
-            depthBuffer[i][j] = INFINITY;
-        }
+
+    size_t left = ok ? (size_t)size - 24 : 0;
+    c3d_intui last = (c3d_intui)m->tri_count;
+    for (c3d_intui i = 0; ok && i < levels; i++){
+        c3d_intuc b[4];
+        ok = left >= 4 && fread(b, 1, 4, f) == 4;
+        left -= ok ? 4 : 0;
+        c3d_intui count = ok ? c3d_getu32(b) : 0;
+        ok = ok && count > 0 && count < last && count <= left / sizeof(tri);
+        if (ok) lods[i].tris = (tri *)malloc(count * sizeof(tri));
+        ok = ok && lods[i].tris != NULL && fread(lods[i].tris, sizeof(tri), count, f) == count;
+        lods[i].tri_count = (int)count;
+        left -= ok ? count * sizeof(tri) : 0;
+        last = count;
     }
+    ok = ok && left == 0;
+    fclose(f);
 
-    mat4 matproj = c3d_mat4prj(d->camera.fnear, d->camera.ffar, d->camera.fov, d->camera.aspect);
-    mat4 camtranslate = c3d_mat4tra(-d->camera.pos.x, -d->camera.pos.y, -d->camera.pos.z);
-    mat4 camview = c3d_mat4mul(d->camera.matrot, camtranslate);
-    mat4 matcam = c3d_mat4mul(matproj, camview);
+    if (!ok){
+        for (c3d_intui i = 0; lods != NULL && i < levels; i++) free(lods[i].tris);
+        free(lods);
+        return false;
+    }
+    m->lods = lods;
+    m->lod_count = (int)levels;
+    return true;
+}
 
-    for (int i = 0; i < d->mesh_count; i++) {
-        mesh* m = &d->meshes[i];
-        for (int j = 0; j < m->tri_count; j++) {
-            tri t = m->tris[j];
+/**
+ * Writes a mesh's levels of detail to a cache. The file is written under
+ * a name of this process's own and renamed into place, so processes
+ * loading the same model at once, like the workers of a cluster, never
+ * read one half written.
+ */
+STDC3DDEF void c3d_lodwrite(const mesh *m, const char *path, c3d_intui hash){
+    if (m->lod_count == 0) return;
 
-            tri t_clipped[2];
-            int tri_count = c3d_nearclip(t, matcam, t_clipped);
+    char pid[16];
+    snprintf(pid, sizeof(pid), ".%lu", (unsigned long)GetCurrentProcessId());
+    char *tmp = c3d_strcat3(path, pid, ".tmp");
 
-            for (int c = 0; c < tri_count; c++) {
-                tri t = t_clipped[c];
+    // without a cache the levels are only made again next time
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL){
+        free(tmp);
+        return;
+    }
 
-                #ifdef BACKFACE_CULLING
-                if (c3d_backface(t, d->camera.pos)) continue;
-                #endif
+    c3d_intuc h[18];
+    c3d_putu16(h, C3D_LOD_VERSION);
+    c3d_putu32(h + 2, (c3d_intui)m->tri_count);
+    c3d_putu32(h + 6, hash);
+    c3d_putu32(h + 10, sizeof(tri));
+    c3d_putu32(h + 14, (c3d_intui)m->lod_count);
+    bool ok = fwrite(C3D_LOD_MAGIC, 1, 6, f) == 6 && fwrite(h, 1, 18, f) == 18;
+
+    for (int i = 0; ok && i < m->lod_count; i++){
+        c3d_intuc b[4];
+        c3d_putu32(b, (c3d_intui)m->lods[i].tri_count);
+        ok = fwrite(b, 1, 4, f) == 4 &&
+             fwrite(m->lods[i].tris, sizeof(tri), m->lods[i].tri_count, f) == (size_t)m->lods[i].tri_count;
+    }
+    ok = (fclose(f) == 0) && ok;
 
-                vec4 v0_clip = c3d_mat4vec4(t.vx, matcam);
-                vec4 v1_clip = c3d_mat4vec4(t.vy, matcam);
-                vec4 v2_clip = c3d_mat4vec4(t.vz, matcam);
+    if (!ok || !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING)) remove(tmp);
+    free(tmp);
+}
 
-                vec3 v0_ndc = {v0_clip.x / v0_clip.w, v0_clip.y / v0_clip.w, v0_clip.z / v0_clip.w};
-                vec3 v1_ndc = {v1_clip.x / v1_clip.w, v1_clip.y / v1_clip.w, v1_clip.z / v1_clip.w};
-                vec3 v2_ndc = {v2_clip.x / v2_clip.w, v2_clip.y / v2_clip.w, v2_clip.z / v2_clip.w};
+/**
+ * The path of the levels of detail cached for a model: its own path
+ * with a .lod extension instead of .obj, so c3d_loadmesh() doesn't take
+ * it for a model.
+ */
+STDC3DDEF char *c3d_lodpath(const char *path){
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/'), *back = strrchr(path, '\\');
+    if (back != NULL && (slash == NULL || back > slash)) slash = back;
+    size_t stem = (dot != NULL && (slash == NULL || dot > slash)) ? (size_t)(dot - path) : strlen(path);
+
+    char *cache = (char *)malloc(stem + 5);
+    if (cache == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_lodpath.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(cache, path, stem);
+    memcpy(cache + stem, ".lod", 5);
+    return cache;
+}
 
-                if ((v0_ndc.x < -1.0f && v1_ndc.x < -1.0f && v2_ndc.x < -1.0f) ||
-                    (v0_ndc.x >  1.0f && v1_ndc.x >  1.0f && v2_ndc.x >  1.0f) ||
-                    (v0_ndc.y < -1.0f && v1_ndc.y < -1.0f && v2_ndc.y < -1.0f) ||
-                    (v0_ndc.y >  1.0f && v1_ndc.y >  1.0f && v2_ndc.y >  1.0f) ||
-                    (v0_ndc.z < -1.0f && v1_ndc.z < -1.0f && v2_ndc.z < -1.0f) ||
-                    (v0_ndc.z >  1.0f && v1_ndc.z >  1.0f && v2_ndc.z >  1.0f)) {
-                    continue;
-                }
+/**
+ * Gives a mesh loaded from path its levels of detail, each with about
+ * half the triangles of the last, down to C3D_LOD_MIN_TRIS. They come
+ * from the .lod cache next to path when it is up to date, and are made
+ * and cached otherwise.
+ */
+STDC3DDEF void c3d_meshlods(mesh *m, const char *path){
+    if (C3D_LOD_LEVELS <= 0 || m->tri_count < 2 * C3D_LOD_MIN_TRIS) return;
 
-                #ifndef NO_FILL
-                c3d_rasterize(d, buffer, colorBuffer, depthBuffer, v0_ndc, v1_ndc, v2_ndc, v0_clip.w, v1_clip.w, v2_clip.w, t, m->mtl);
-                #else
-                // c3d_bresenham()
-                #endif
-            }
-        }
+    c3d_intui hash = c3d_trishash(m->tris, m->tri_count);
+    char *cache = c3d_lodpath(path);
+    if (c3d_lodread(m, cache, hash)){
+        free(cache);
+        return;
     }
 
-    d->frame_count++;
-    c3d_render(d, buffer, colorBuffer);
-    for (int i = 0; i < d->display_height; i++) {
-        free(buffer[i]);
-        free(colorBuffer[i]);
-        free(depthBuffer[i]);
+    m->lods = (c3d_meshlod *)malloc(C3D_LOD_LEVELS * sizeof(c3d_meshlod));
+    if (m->lods == NULL){
+        fprintf(stderr, "Memory allocation failed in c3d_meshlods.\n");
+        exit(EXIT_FAILURE);
     }
-    free(buffer);
-    free(colorBuffer);
-    free(depthBuffer);
+
+    const tri *from = m->tris;
+    int count = m->tri_count;
+    while (m->lod_count < C3D_LOD_LEVELS && count / 2 >= C3D_LOD_MIN_TRIS){
+        int out;
+        tri *lod = c3d_simplify(from, count, count / 2, &out);
+
+        // nothing left to collapse without folding the surface over
+        if (out > count * 3 / 4){
+            free(lod);
+            break;
+        }
+        m->lods[m->lod_count++] = (c3d_meshlod){lod, out};
+        from = lod;
+        count = out;
+    }
+
+    c3d_lodwrite(m, cache, hash);
+    free(cache);
 }
 
 /*
@@ -1299,10 +6919,10 @@ STDC3DDEF _obj *c3d_loadobj(const char *path) {
 
     if (f == NULL) {
         fprintf(stderr, "Path %s has no valid .OBJ file.", path);
-        return;
+        return NULL;
     }
 
-    _obj *obj = malloc(sizeof(_obj));
+    _obj *obj = (_obj *)malloc(sizeof(_obj));
     
     c3d_init__obj(obj);
 
@@ -1523,12 +7143,15 @@ STDC3DDEF material *c3d_loadmtl(const char *path, int *material_count) {
         if (strncmp(line, "d ", 2) == 0) {
             sscanf(line + 2, "%f", &current_material->transparency);
         }
+        if (strncmp(line, "illum ", 6) == 0) {
+            sscanf(line + 6, "%d", &current_material->illumination_model);
+        }
         if (strncmp(line, "map_Kd ", 7) == 0) {
             char texture_path[MAX_PATH_LENGTH];
             sscanf(line + 7, "%s", texture_path);
             texture temp = c3d_loadimg(texture_path);
             if (temp.data != NULL) {
-                current_material->diffuse_tex = malloc(sizeof(texture));
+                current_material->diffuse_tex = (texture *)malloc(sizeof(texture));
                 *current_material->diffuse_tex = temp;
             }
         }
@@ -1537,7 +7160,7 @@ STDC3DDEF material *c3d_loadmtl(const char *path, int *material_count) {
             sscanf(line + 7, "%s", texture_path);
             texture temp = c3d_loadimg(texture_path);
             if (temp.data != NULL) {
-                current_material->specular_tex = malloc(sizeof(texture));
+                current_material->specular_tex = (texture *)malloc(sizeof(texture));
                 *current_material->specular_tex = temp;
             }
         }
@@ -1546,7 +7169,7 @@ STDC3DDEF material *c3d_loadmtl(const char *path, int *material_count) {
             sscanf(line + 8, "%s", texture_path);
             texture temp = c3d_loadimg(texture_path);
             if (temp.data != NULL) {
-                current_material->normal_tex = malloc(sizeof(texture));
+                current_material->normal_tex = (texture *)malloc(sizeof(texture));
                 *current_material->normal_tex = temp;
             }
         }
@@ -1584,7 +7207,7 @@ STDC3DDEF mesh c3d_loadmesh(const char *dir) {
 
         if (strstr(filepath, obj) != NULL){
             char *full_obj_path = c3d_strcat3(dir, "/", filepaths[idx]);
-            objpath = malloc(strlen(full_obj_path) + 1);
+            objpath = (char *)malloc(strlen(full_obj_path) + 1);
             strcpy(objpath, full_obj_path);
             free(full_obj_path); 
 
@@ -1592,7 +7215,7 @@ STDC3DDEF mesh c3d_loadmesh(const char *dir) {
         }
         if (strstr(filepath, mtl) != NULL){
             char *full_mtl_path = c3d_strcat3(dir, "/", filepaths[idx]);
-            mtlpath = malloc(strlen(full_mtl_path) + 1);
+            mtlpath = (char *)malloc(strlen(full_mtl_path) + 1);
             strcpy(mtlpath, full_mtl_path);
             free(full_mtl_path);
 
@@ -1600,7 +7223,7 @@ STDC3DDEF mesh c3d_loadmesh(const char *dir) {
         }
         if (strstr(filepath, png) != NULL || strstr(filepath, jpg) != NULL){
             char *full_diff_path = c3d_strcat3(dir, "/", filepaths[idx]);
-            diffpath = malloc(strlen(full_diff_path) + 1);
+            diffpath = (char *)malloc(strlen(full_diff_path) + 1);
             strcpy(diffpath, full_diff_path);
             free(full_diff_path);
         }
@@ -1631,8 +7254,25 @@ STDC3DDEF mesh c3d_loadmesh(const char *dir) {
     }
     memcpy(new_mesh.tris, lobj->f, lobj->f_size * sizeof(tri));
     new_mesh.tri_count = (int)lobj->f_size;
-
-    new_mesh.name = malloc(sizeof(char));
+    new_mesh.baked = NULL;
+    new_mesh.version = ++c3d_meshversions;
+    new_mesh.baked_version = 0;
+    new_mesh.baked_lights = 0;
+    new_mesh.baked_shadows = 0;
+    new_mesh.rate = C3D_RATE_1X1;
+    new_mesh.sh = NULL;
+    new_mesh.occluder = false;
+    new_mesh.box_version = 0;
+    new_mesh.sphere_version = 0;
+    new_mesh.lods = NULL;
+    new_mesh.lod_count = 0;
+    new_mesh.lod = 0;
+    new_mesh.vlights = NULL;
+    new_mesh.vlight_ids = NULL;
+    new_mesh.vlight_version = 0;
+    new_mesh.vlight_lod = 0;
+
+    new_mesh.name = (char *)malloc(sizeof(char));
 
     #ifndef FORCE_SMOOTH
     if (lobj->smooth) {
@@ -1642,6 +7282,8 @@ STDC3DDEF mesh c3d_loadmesh(const char *dir) {
     c3d_vecnormalavg(&new_mesh);
     #endif
 
+    c3d_meshlods(&new_mesh, objpath);
+
     int materialc = 0;
     material *materials = NULL;
     if (mtlpath != NULL){
@@ -1823,7 +7465,7 @@ STDC3DDEF void c3d_behavior_swaptex(display *d, int argc, char **args) {
                 free(d->meshes[i].mtl->diffuse_tex);
             }
             texture new_texture = c3d_loadimg(new_texture_path);
-            d->meshes[i].mtl->diffuse_tex = malloc(sizeof(texture));
+            d->meshes[i].mtl->diffuse_tex = (texture *)malloc(sizeof(texture));
             *d->meshes[i].mtl->diffuse_tex = new_texture;
             break;
         }
@@ -1840,6 +7482,8 @@ STDC3DDEF void c3d_behavior_swapmesh(display *d, int argc, char **args) {
             if (d->meshes[i].tris) {
                 free(d->meshes[i].tris);
             }
+            c3d_meshfreelighting(&d->meshes[i]);
+            c3d_meshfreelods(&d->meshes[i]);
             if (d->meshes[i].mtl->diffuse_tex) {
                 free(d->meshes[i].mtl->diffuse_tex->data);
                 free(d->meshes[i].mtl->diffuse_tex);
@@ -1918,7 +7562,7 @@ STDC3DDEF void c3d_behavior_swaptex_id(display *d, int argc, char **args) {
             free(d->meshes[id].mtl->diffuse_tex);
         }
         texture new_texture = c3d_loadimg(new_texture_path);
-        d->meshes[id].mtl->diffuse_tex = malloc(sizeof(texture));
+        d->meshes[id].mtl->diffuse_tex = (texture *)malloc(sizeof(texture));
         *d->meshes[id].mtl->diffuse_tex = new_texture;
     }
 }
@@ -1930,6 +7574,8 @@ STDC3DDEF void c3d_behavior_swapmesh_id(display *d, int argc, char **args) {
 
     if (id >= 0 && id < d->mesh_count) {
         if (d->meshes[id].tris) free(d->meshes[id].tris);
+        c3d_meshfreelighting(&d->meshes[id]);
+        c3d_meshfreelods(&d->meshes[id]);
         if (d->meshes[id].mtl->diffuse_tex) free(d->meshes[id].mtl->diffuse_tex->data), free(d->meshes[id].mtl->diffuse_tex);
 
         char *full_path = c3d_strcat3(C3D_REL_MODELS_READ_PATH, "/", new_mesh_path);
@@ -1955,6 +7601,8 @@ STDC3DDEF void c3d_behavior_loopmesh(display *d, int argc, char **args) {
         frame_index = (frame_index + 1) % frame_count;
 
         if (d->meshes[id].tris) free(d->meshes[id].tris);
+        c3d_meshfreelighting(&d->meshes[id]);
+        c3d_meshfreelods(&d->meshes[id]);
         if (d->meshes[id].mtl->diffuse_tex) free(d->meshes[id].mtl->diffuse_tex->data), free(d->meshes[id].mtl->diffuse_tex);
         d->meshes[id] = c3d_loadmesh(frame_path);
     }
@@ -1984,12 +7632,11 @@ STDC3DDEF void c3d_behavior_colorize(display *d, int argc, char **args) {
     int height = 128;
 
     if (id >= 0 && id < d->mesh_count) {
-        d->meshes[id].mtl->diffuse_tex = (c3d_intuc *)malloc(width * height * 3 * sizeof(c3d_intuc));
+        d->meshes[id].mtl->diffuse_tex = (texture *)malloc(sizeof(texture));
+        d->meshes[id].mtl->diffuse_tex->data = (vec3 *)malloc(width * height * sizeof(vec3));
 
-        for (int i = 0; i < width * height * 3; i += 3) {
-            d->meshes[id].mtl->diffuse_tex->data[i] = (vec3){r, g, b};     
-            d->meshes[id].mtl->diffuse_tex->data[i + 1] = (vec3){r, g, b}; 
-            d->meshes[id].mtl->diffuse_tex->data[i + 2] = (vec3){r, g, b}; 
+        for (int i = 0; i < width * height; i++) {
+            d->meshes[id].mtl->diffuse_tex->data[i] = (vec3){(float)r, (float)g, (float)b};
         }
 
         d->meshes[id].mtl->diffuse_tex->width = width;
@@ -2005,9 +7652,15 @@ STDC3DDEF void c3d_behavior_colorize(display *d, int argc, char **args) {
 STDC3DDEF void c3d_loadscene(display *d, char *path){
     FILE *f = fopen(path, "r");
     if (f == NULL) {
-        return 0;
+        return;
     }
     
+    #ifdef C3D_NET
+    // the workers hold the old scene
+    c3d_clusterstop(d);
+    char *cluster_line = NULL;
+    #endif
+
     c3d_resetdisplay(d);
 
     char buffer[50];
@@ -2045,14 +7698,16 @@ STDC3DDEF void c3d_loadscene(display *d, char *path){
 
             char mpath[50];
             float x, y, z, scale_x, scale_y, scale_z;
+            char kind[50] = "";
 
-            if (sscanf_s(line, "%49s %f %f %f %f %f %f", mpath, (unsigned)_countof(mpath), &x, &y, &z, &scale_x, &scale_y, &scale_z) == 7){
+            if (sscanf_s(line, "%49s %f %f %f %f %f %f %49s", mpath, (unsigned)_countof(mpath), &x, &y, &z, &scale_x, &scale_y, &scale_z, kind, (unsigned)_countof(kind)) >= 7){
 
                 char *full_path = c3d_strcat3(C3D_MODELS_READ_PATH, "/", mpath);
                 
                 mesh new_mesh = c3d_loadmesh(full_path);
                 new_mesh.name = (char*)realloc(new_mesh.name, strlen(mpath) * sizeof(char));
                 memcpy(new_mesh.name, mpath, strlen(mpath) + 1);
+                new_mesh.occluder = !strcmp(kind, "occluder");
                 
                 c3d_meshadd(d, new_mesh);
 
@@ -2080,14 +7735,98 @@ STDC3DDEF void c3d_loadscene(display *d, char *path){
                     d->background_color.z = b; 
                 }
             }
+
+            char val[50];
+
+            if (sscanf_s(line, "%49s %49s", key, (unsigned)_countof(key), val, (unsigned)_countof(val)) == 2){
+                if (!strcmp(key, "output")){
+                    if (!strcmp(val, "ansi"))  d->output = C3D_OUTPUT_ANSI;
+                    if (!strcmp(val, "sixel")) d->output = C3D_OUTPUT_SIXEL;
+                    if (!strcmp(val, "kitty")) d->output = C3D_OUTPUT_KITTY;
+                    if (!strcmp(val, "ascii")) d->output = C3D_OUTPUT_ASCII;
+                    if (!strcmp(val, "ascii_color")) d->output = C3D_OUTPUT_ASCII_COLOR;
+                    if (!strcmp(val, "y4m"))   d->output = C3D_OUTPUT_Y4M;
+                }
+                if (!strcmp(key, "lighting")){
+                    if (!strcmp(val, "pixel"))  d->lighting = C3D_LIGHTING_PIXEL;
+                    if (!strcmp(val, "vertex")) d->lighting = C3D_LIGHTING_VERTEX;
+                }
+                if (!strcmp(key, "bake")){
+                    if (!strcmp(val, "on"))  d->bake.enabled = true;
+                    if (!strcmp(val, "off")) d->bake.enabled = false;
+                }
+                if (!strcmp(key, "sh_distance")) d->sh_distance = (float)atof(val);
+                if (!strcmp(key, "shadows")) d->shadow_size = (c3d_intus)atoi(val);
+                if (!strcmp(key, "vrs_far"))  d->vrs.far_rate = c3d_parserate(val);
+                if (!strcmp(key, "vrs_flat")) d->vrs.flat_rate = c3d_parserate(val);
+                if (!strcmp(key, "vrs_edge")) d->vrs.edge_rate = c3d_parserate(val);
+                if (!strcmp(key, "vrs_far_distance")) d->vrs.far_distance = (float)atof(val);
+                if (!strcmp(key, "vrs_fovea")) d->vrs.fovea = (float)atof(val);
+                if (!strcmp(key, "temporal")){
+                    if (!strcmp(val, "on"))  d->temporal.enabled = true;
+                    if (!strcmp(val, "off")) d->temporal.enabled = false;
+                }
+                if (!strcmp(key, "hiz")){
+                    if (!strcmp(val, "on"))  d->hiz.enabled = true;
+                    if (!strcmp(val, "off")) d->hiz.enabled = false;
+                }
+                if (!strcmp(key, "occlusion")) d->occlusion.width = (c3d_intus)atoi(val);
+                if (!strcmp(key, "depth_prepass")){
+                    if (!strcmp(val, "on"))  d->depth_prepass = true;
+                    if (!strcmp(val, "off")) d->depth_prepass = false;
+                }
+                if (!strcmp(key, "lod")){
+                    if (!strcmp(val, "on"))  d->lod = true;
+                    if (!strcmp(val, "off")) d->lod = false;
+                }
+                if (!strcmp(key, "front_to_back")){
+                    if (!strcmp(val, "on"))  d->order.enabled = true;
+                    if (!strcmp(val, "off")) d->order.enabled = false;
+                }
+
+                // where frames go besides the terminal, left alone on cluster workers
+                if (!d->worker){
+                    if (!strcmp(key, "writer")){
+                        if (!strcmp(val, "on"))  c3d_writerstart(d);
+                        if (!strcmp(val, "off")) c3d_writerstop(d);
+                    }
+                    if (!strcmp(key, "record")){
+                        c3d_recstop(d);
+                        if (strcmp(val, "off")) c3d_recstart(d, val);
+                    }
+                    if (!strcmp(key, "shm")){
+                        int max_width, max_height;
+                        c3d_shmclose(d);
+                        if (sscanf_s(line, "%49s %49s %d %d", key, (unsigned)_countof(key), val, (unsigned)_countof(val), &max_width, &max_height) == 4){
+                            c3d_shmopen(d, val, max_width, max_height);
+                        }
+                    }
+                    #ifdef C3D_NET
+                    if (!strcmp(key, "serve")){
+                        char host[50] = "";
+                        c3d_serverstop(d);
+                        if (strcmp(val, "off")){
+                            sscanf_s(line, "%49s %49s %49s", key, (unsigned)_countof(key), val, (unsigned)_countof(val), host, (unsigned)_countof(host));
+                            c3d_serverstart(d, host[0] ? host : NULL, (c3d_intus)atoi(val));
+                        }
+                    }
+                    // the workers must see the meshes, so the cluster starts after the whole scene is read
+                    if (!strcmp(key, "cluster")){
+                        free(cluster_line);
+                        cluster_line = _strdup(line);
+                    }
+                    #endif
+                }
+            }
         }
         if (!strcmp(buffer, "lights")){
             
             float x, y, z, brightness, radius;
             int r, g, b;
+            char kind[50] = "";
 
-            if (sscanf_s(line, "%f %f %f %d %d %d %f %f", &x, &y, &z, &r, &g, &b, &brightness, &radius) == 8){
-                light new_light = (light){(vec3){x, y, z}, (vec3){r, g, b}, brightness, radius};
+            if (sscanf_s(line, "%f %f %f %d %d %d %f %f %49s", &x, &y, &z, &r, &g, &b, &brightness, &radius, kind, (unsigned)_countof(kind)) >= 8){
+                light new_light = (light){(vec3){x, y, z}, (vec3){r, g, b}, brightness, radius, !strcmp(kind, "dynamic")};
                 c3d_lightadd(d, new_light);
             }
         }
@@ -2124,6 +7863,29 @@ STDC3DDEF void c3d_loadscene(display *d, char *path){
     }
 
     fclose(f);
+
+    #ifdef C3D_NET
+    // cluster sortfirst|sortlast host:port host:port ...
+    if (cluster_line != NULL){
+        const char **workers = (const char **)malloc(strlen(cluster_line) * sizeof(char *));
+        if (workers == NULL){
+            fprintf(stderr, "Memory allocation failed in c3d_loadscene.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        strtok(cluster_line, " \t\r\n");
+        char *mode = strtok(NULL, " \t\r\n");
+        int count = 0;
+        char *tok;
+        while ((tok = strtok(NULL, " \t\r\n")) != NULL) workers[count++] = tok;
+
+        if (mode != NULL && strcmp(mode, "off")){
+            c3d_clusterstart(d, workers, count, !strcmp(mode, "sortlast") ? C3D_CLUSTER_SORTLAST : C3D_CLUSTER_SORTFIRST);
+        }
+        free(workers);
+        free(cluster_line);
+    }
+    #endif
 }
 
 /**
@@ -2264,23 +8026,23 @@ void c3d_retgui(display *d){
 /**
  * Concatenates 3 strings together.
  */
-STDC3DDEF c3d_intuc *c3d_strcat3(const char *prefix, const char *string, const char *suffix){
+STDC3DDEF char *c3d_strcat3(const char *prefix, const char *string, const char *suffix){
     const size_t len_prefix = strlen(prefix);
     const size_t len_string = strlen(string);
     const size_t len_suffix = strlen(suffix);
 
-    char *new = malloc(len_prefix + len_string + len_suffix + 1);
+    char *joined = (char *)malloc(len_prefix + len_string + len_suffix + 1);
 
-    if (new == NULL){
+    if (joined == NULL){
         fprintf(stderr, "Memory allocation failed at strcat of parameters %s, %s, %s.", prefix, string, suffix);
         exit(EXIT_FAILURE);
     };
 
-    memcpy(new, prefix, len_prefix);
-    memcpy(new + len_prefix, string, len_string);
-    memcpy(new + len_prefix + len_string, suffix, len_suffix + 1);
+    memcpy(joined, prefix, len_prefix);
+    memcpy(joined + len_prefix, string, len_string);
+    memcpy(joined + len_prefix + len_string, suffix, len_suffix + 1);
     
-    return new;
+    return joined;
 }
 
 STDC3DDEF void c3d_show_file_contents(const char *filename) {
@@ -2349,12 +8111,12 @@ STDC3DDEF void c3d_filelist(const char *path, char ***out, int *count) {
 
     do {
         if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-            file_list = realloc(file_list, (*count + 1) * sizeof(char *));
+            file_list = (char **)realloc(file_list, (*count + 1) * sizeof(char *));
             if (!file_list) {
                 fprintf(stderr, "Memory allocation failed in filelist.\n");
                 exit(EXIT_FAILURE);
             }
-            file_list[*count] = malloc(strlen(findFileData.cFileName) + 1);
+            file_list[*count] = (char *)malloc(strlen(findFileData.cFileName) + 1);
             if (!file_list[*count]) {
                 fprintf(stderr, "Memory allocation failed for file name.\n");
                 exit(EXIT_FAILURE);
@@ -2404,12 +8166,12 @@ STDC3DDEF void c3d_folderlist(const char *path, char ***out, int *count) {
             strcmp(findFileData.cFileName, ".") != 0 && 
             strcmp(findFileData.cFileName, "..") != 0) {
 
-            folder_list = realloc(folder_list, (*count + 1) * sizeof(char *));
+            folder_list = (char **)realloc(folder_list, (*count + 1) * sizeof(char *));
             if (!folder_list) {
                 fprintf(stderr, "Memory allocation failed in folderlist.\n");
                 exit(EXIT_FAILURE);
             }
-            folder_list[*count] = malloc(strlen(findFileData.cFileName) + 1);
+            folder_list[*count] = (char *)malloc(strlen(findFileData.cFileName) + 1);
             if (!folder_list[*count]) {
                 fprintf(stderr, "Memory allocation failed for folder name.\n");
                 exit(EXIT_FAILURE);
@@ -2462,6 +8224,14 @@ void c3d_auto_winres(display *d, cam *c){
     d->display_width = size.width - correction_factor;
     d->display_height = size.height - correction_factor;
     c->aspect = (size.width - correction_factor) / (size.height - correction_factor);
+
+    // bitmap outputs draw real pixels, so the framebuffer grows to the
+    // console's size in pixels instead of cells.
+    if (C3D_OUTPUT_ISBITMAP(d->output)){
+        d->display_width *= C3D_CELL_PXW;
+        d->display_height *= C3D_CELL_PXH;
+        c->aspect = (float)d->display_width / d->display_height;
+    }
 }
 
 /*
@@ -2476,13 +8246,48 @@ void c3d_auto_winres(display *d, cam *c){
 display c3d_initdisplay(cam camera, int display_width, int display_height, vec3 background_color){
     display new_display;
     new_display.running = true;
+    new_display.output = C3D_OUTPUT_ANSI;
+    new_display.outbuf = (c3d_outbuf){0};
+    new_display.scratch = (c3d_encscratch){0};
+    new_display.encpool = NULL;
+    new_display.writer = NULL;
+    new_display.recorder = NULL;
+    new_display.out = NULL;
+    new_display.shm = NULL;
+    new_display.lighting = C3D_LIGHTING_PIXEL;
+    new_display.depth_prepass = false;
+    new_display.lod = true;
+    new_display.server = NULL;
+    new_display.cluster = NULL;
+    new_display.worker = false;
+    new_display.region_y0 = 0;
+    new_display.region_y1 = 0;
+    new_display.mesh_part = 0;
+    new_display.mesh_parts = 0;
+    new_display.stream_width = 0;
+    new_display.stream_height = 0;
     new_display.meshes = NULL;
     new_display.behaviors = NULL;
     new_display.lights = NULL;
+    new_display.lightsoa = (c3d_lightsoa){0};
+    new_display.bake = (c3d_bake){0};
+    new_display.sh_distance = 0.0f;
+    new_display.sh_watch = (c3d_lightwatch){0};
+    new_display.shadows = NULL;
+    new_display.shadow_count = 0;
+    new_display.shadow_version = 0;
+    new_display.shadow_size = 0;
+    new_display.vrs = (c3d_vrs){C3D_RATE_1X1};
+    new_display.vrs.fovea = 0.5f;
+    new_display.temporal = (c3d_temporal){0};
+    new_display.hiz = (c3d_hiz){0};
+    new_display.occlusion = (c3d_occlusion){0};
+    new_display.order = (c3d_draworder){0};
     new_display.light_count = 0;
     new_display.mesh_count = 0;
     new_display.behavior_count = 0;
     new_display.frame_count = 0;
+    new_display.draw_frame = 0;
     new_display.camera = camera;
     new_display.display_width = display_width;
     new_display.display_height = display_height;
@@ -2526,6 +8331,8 @@ void c3d_resetdisplay(display *d) {
         if (d->meshes[i].tris) {
             free(d->meshes[i].tris); 
         }
+        c3d_meshfreelighting(&d->meshes[i]);
+        c3d_meshfreelods(&d->meshes[i]);
     }
     free(d->meshes); 
     d->meshes = NULL;
@@ -2533,6 +8340,7 @@ void c3d_resetdisplay(display *d) {
     // free(d->lights);
     // d->lights = NULL;  
 
+    d->temporal.drawn = false;
     d->frame_count = 0;
     d->mesh_count = 0; 
 }
@@ -2568,7 +8376,7 @@ void c3d_meshadd(display *d, mesh new_mesh) {
  * Adds a behavior to the display.
  */
 void c3d_behavioradd(display *d, void (*func)(display *, int, char **), behavior_type type, int argc, char **args) {
-    behavior *temp = realloc(d->behaviors, (d->behavior_count + 1) * sizeof(behavior));
+    behavior *temp = (behavior *)realloc(d->behaviors, (d->behavior_count + 1) * sizeof(behavior));
     if (temp == NULL) {
         fprintf(stderr, "Memory allocation failed in c3d_behavioradd.\n");
         exit(EXIT_FAILURE);
@@ -2579,7 +8387,7 @@ void c3d_behavioradd(display *d, void (*func)(display *, int, char **), behavior
     b->func = func;
     b->argc = argc;
     b->type = type;
-    b->args = malloc(argc * sizeof(char *));
+    b->args = (char **)malloc(argc * sizeof(char *));
     if (b->args == NULL) {
         fprintf(stderr, "Memory allocation failed for behavior arguments.\n");
         exit(EXIT_FAILURE);
@@ -2593,11 +8401,13 @@ void c3d_behavioradd(display *d, void (*func)(display *, int, char **), behavior
     }
 }
 
-STDC3DDEF void c3d_meshabs(mesh *A, mat4 B){
-    mat3 invTranspose = c3d_mat4invtranspose3(B);
-
-    for (int i = 0; i < A->tri_count; i++) {
-        tri *triangle = &A->tris[i];
+/**
+ * Transforms triangles by B, and their normals by invTranspose, B's
+ * inverse-transpose.
+ */
+STDC3DDEF void c3d_trisabs(tri *tris, int tri_count, mat4 B, mat3 invTranspose){
+    for (int i = 0; i < tri_count; i++) {
+        tri *triangle = &tris[i];
 
         triangle->vx = c3d_mat4vec3(triangle->vx, B);
         triangle->vy = c3d_mat4vec3(triangle->vy, B);
@@ -2631,6 +8441,14 @@ STDC3DDEF void c3d_meshabs(mesh *A, mat4 B){
     }
 }
 
+STDC3DDEF void c3d_meshabs(mesh *A, mat4 B){
+    mat3 invTranspose = c3d_mat4invtranspose3(B);
+    A->version = ++c3d_meshversions;
+
+    c3d_trisabs(A->tris, A->tri_count, B, invTranspose);
+    for (int i = 0; i < A->lod_count; i++) c3d_trisabs(A->lods[i].tris, A->lods[i].tri_count, B, invTranspose);
+}
+
 STDC3DDEF void c3d_meshrel(mesh *A, mat4 B){
     float sum_x = 0.0f, sum_y = 0.0f, sum_z = 0.0f;
     float V = A->tri_count * 3;
@@ -2796,7 +8614,7 @@ void c3d_k_handle(display *d) {
     }
     
     if (GetAsyncKeyState(VK_RETURN) & C3D_KEY_PRESSED || GetAsyncKeyState(VK_LBUTTON) & C3D_KEY_PRESSED) {
-        light new_light = (light){(vec3){d->camera.pos.x, d->camera.pos.y, d->camera.pos.z}, (vec3){rand() % 256 /255.0f, rand() % 256 /255.0f, rand() % 256 /255.0f}, 1.0f, 0.5f};
+        light new_light = (light){(vec3){d->camera.pos.x, d->camera.pos.y, d->camera.pos.z}, (vec3){rand() % 256 /255.0f, rand() % 256 /255.0f, rand() % 256 /255.0f}, 1.0f, 0.5f, false};
         c3d_lightadd(d, new_light);
     }
 }
@@ -2827,11 +8645,366 @@ void c3d_m_handle(display *d, POINT p0){
  */
 
 #ifdef __cplusplus
-// c++ stuff
+} // extern "C"
+
+/*
+ * =============================================================================
+ *                                C++ SHADERS
+ * =============================================================================
+ *
+ * c3d::update() draws a frame like c3d_update(), with a vertex shader and
+ * a fragment shader given as functors. Both are template parameters, so
+ * they are inlined into the draw loop and rasterizer: a custom effect
+ * costs no call through a pointer per triangle or per cell.
+ *
+ *     struct toon {
+ *         vec3 operator()(const c3d::fragment &f) const {
+ *             vec3 c = c3d::phong()(f);
+ *             return c3d::make_vec3(floorf(c.x * 4.0f) / 4.0f, floorf(c.y * 4.0f) / 4.0f, floorf(c.z * 4.0f) / 4.0f);
+ *         }
+ *     };
+ *
+ *     c3d::update(&d, toon());
+ *
+ * The scene's culling, draw order, levels of detail, depth pre-pass and
+ * hierarchical depth apply as in c3d_update(), going by the meshes' own
+ * triangles before the vertex shader moves them. The shaders replace the
+ * whole of lighting, so the temporal cache and variable-rate shading are
+ * not used. With per-vertex lighting each
+ * vertex is shaded once a frame, unless the vertex shader moves it, and
+ * fragment::vertex holds the light interpolated to the cell, which
+ * c3d::phong uses. A cluster's
+ * workers draw with c3d_update().
+ */
+
+namespace c3d {
+
+// A vector from its components, C++ has no (vec3){x, y, z}.
+inline vec3 make_vec3(float x, float y, float z) {
+    vec3 v = {x, y, z};
+    return v;
+}
+
+inline vec2 make_vec2(float x, float y) {
+    vec2 v = {x, y};
+    return v;
+}
+
+// What a fragment shader is given for the cell it shades.
+struct fragment {
+    vec3 position;              // world space
+    vec3 normal;                // interpolated and normalized
+    vec2 uv;
+    const vec3 *baked;          // the baked light there, NULL if not baking
+    const vec3 *vertex;         // with per-vertex lighting, the ambient, diffuse and specular
+                                // light interpolated from the corners, NULL otherwise
+    float depth;                // distance along the view axis
+    int x, y;                   // the cell
+    mesh *m;
+    display *d;
+};
+
+// A vertex shader that leaves the triangles as they are.
+struct novertex {
+    void operator()(const display &, const mesh &, tri &) const {}
+};
+
+// Whether a vertex shader may move the corners, so the light cached at
+// the mesh's own vertices doesn't hold for them.
+inline bool moves(const novertex &) { return false; }
+template <class VertexShader>
+inline bool moves(const VertexShader &) { return true; }
+
+// The fragment shader c3d_update() draws with: Blinn-Phong lighting,
+// the diffuse texture and the material's transparency.
+struct phong {
+    vec3 operator()(const fragment &f) const {
+        material *mtl = f.m->mtl;
+        vec3 tex = {1.0f, 1.0f, 1.0f};
+        if (mtl->diffuse_tex != NULL && mtl->diffuse_tex->data != NULL) tex = c3d_texsample(mtl->diffuse_tex, f.uv.x, f.uv.y);
+
+        vec3 ambient = mtl->diffuse_color, diffuse = {0.0f, 0.0f, 0.0f}, specular = {0.0f, 0.0f, 0.0f};
+        if (f.vertex != NULL) {
+            ambient = f.vertex[0];
+            diffuse = f.vertex[1];
+            specular = f.vertex[2];
+        } else if (mtl->illumination_model != 0) {
+            c3d_bphongshade(f.d, f.normal, f.position, mtl, f.baked, f.d->sh_distance > 0.0f ? f.m->sh : NULL, &ambient, &diffuse, &specular);
+        }
+
+        vec3 c;
+        c.x = (ambient.x + diffuse.x) * tex.x + specular.x;
+        c.y = (ambient.y + diffuse.y) * tex.y + specular.y;
+        c.z = (ambient.z + diffuse.z) * tex.z + specular.z;
+        if (mtl->transparency < 1.0f) {
+            c.x = (1.0f - mtl->transparency) * f.d->background_color.x + mtl->transparency * c.x;
+            c.y = (1.0f - mtl->transparency) * f.d->background_color.y + mtl->transparency * c.y;
+            c.z = (1.0f - mtl->transparency) * f.d->background_color.z + mtl->transparency * c.z;
+        }
+        return c;
+    }
+};
+
+/**
+ * Fills a triangle given in clip space, calling fs for every cell that
+ * passes the depth test. baked is the light baked at its corners, or
+ * NULL. With per-vertex lighting the corners are shaded when the first
+ * cell passes, through the mesh's vertices in vlights, see
+ * c3d_vertexshade(). With prepass only the depth is written; after a
+ * depth pre-pass only the cells at the depth it left are shaded. The
+ * hierarchical depth tiles are tested and kept like c3d_rasterizewith()
+ * does.
+ */
+template <class FragmentShader>
+inline void rasterize(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer,
+                      const vec4 clip[3], const tri &t, mesh &m, const vec3 *baked, c3d_vertexlight *const *vlights,
+                      bool prepass, const FragmentShader &fs) {
+    vec3 ndc[3];
+    vec2 pv[3];
+    float inv_w[3];
+    for (int k = 0; k < 3; k++) {
+        ndc[k] = make_vec3(clip[k].x / clip[k].w, clip[k].y / clip[k].w, clip[k].z / clip[k].w);
+        pv[k] = c3d_project_vec3vec2(ndc[k], d->display_width, d->display_height);
+        inv_w[k] = 1.0f / clip[k].w;
+    }
+
+    int minx = max(C3D_MIN(pv[0].x, pv[1].x, pv[2].x), 0);
+    int maxx = min(C3D_MAX(pv[0].x, pv[1].x, pv[2].x), d->display_width - 1);
+    int miny = max(C3D_MIN(pv[0].y, pv[1].y, pv[2].y), d->region_y0);
+    int maxy = min(C3D_MAX(pv[0].y, pv[1].y, pv[2].y), (d->region_y1 ? d->region_y1 : d->display_height) - 1);
+    if (minx > maxx || miny > maxy) return;
+
+    float area = c3d_edge(pv[0], pv[1], pv[2]);
+    if (area == 0) return;
+
+    bool ascii = C3D_OUTPUT_ISASCII(d->output);
+    COLORREF mesh_color = RGB(
+        (int)(c3d_clampf(m.mtl->diffuse_color.x, 0.0f, 1.0f) * 255.0f),
+        (int)(c3d_clampf(m.mtl->diffuse_color.y, 0.0f, 1.0f) * 255.0f),
+        (int)(c3d_clampf(m.mtl->diffuse_color.z, 0.0f, 1.0f) * 255.0f)
+    );
+    const vec3 none = {0.0f, 0.0f, 0.0f};
+
+    fragment f;
+    f.m = &m;
+    f.d = d;
+    vec3 light;
+    f.baked = baked ? &light : NULL;
+
+    // per-vertex lighting shades the corners once, the cells only interpolate
+    bool per_vertex = (!prepass && m.mtl->illumination_model != 0 && d->lighting == C3D_LIGHTING_VERTEX);
+    bool vertex_shaded = false;
+    vec3 corner[3][3], vertex[3];
+    f.vertex = per_vertex ? vertex : NULL;
+
+    // walked tile by tile with hierarchical depth, otherwise as one tile
+    const bool equal = (!prepass && d->depth_prepass);
+    const bool hiz = (d->hiz.enabled && d->hiz.tiles != NULL);
+    const int ts = hiz ? C3D_HIZ_TILE : 65536;
+    float tri_zmin = C3D_MIN(ndc[0].z, ndc[1].z, ndc[2].z);
+    float tri_zmax = C3D_MAX(ndc[0].z, ndc[1].z, ndc[2].z);
+
+    for (int ty = miny - miny % ts; ty <= maxy; ty += ts) {
+        for (int tx = minx - minx % ts; tx <= maxx; tx += ts) {
+            c3d_hiztile *tile = NULL;
+            bool accept = false;
+            if (hiz) {
+                tile = &d->hiz.tiles[(ty / ts) * d->hiz.columns + tx / ts];
+                // after a pre-pass the triangle may still be the one at zmax
+                if (equal ? tri_zmin > tile->zmax : tri_zmin >= tile->zmax) continue;
+                if (tile->dirty) {
+                    c3d_hizrefresh(d, depthBuffer, tile, tx, ty);
+                    if (equal ? tri_zmin > tile->zmax : tri_zmin >= tile->zmax) continue;
+                }
+                accept = (!equal && tri_zmax < tile->zmin);
+            }
+            int x0 = max(tx, minx), x1 = min(tx + ts - 1, maxx);
+            int y0 = max(ty, miny), y1 = min(ty + ts - 1, maxy);
+
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    vec2 vxy = {x + 0.5f, y + 0.5f};
+                    float w0 = c3d_edge(pv[1], pv[2], vxy) / area;
+                    float w1 = c3d_edge(pv[2], pv[0], vxy) / area;
+                    float w2 = c3d_edge(pv[0], pv[1], vxy) / area;
+                    if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) continue;
+
+                    float denom = w0 * inv_w[0] + w1 * inv_w[1] + w2 * inv_w[2];
+                    if (denom == 0.0f) continue;
+                    float z = (ndc[0].z * w0 * inv_w[0] + ndc[1].z * w1 * inv_w[1] + ndc[2].z * w2 * inv_w[2]) / denom;
+                    if (equal ? z != depthBuffer[y][x] : !(accept || z < depthBuffer[y][x])) continue;
+                    depthBuffer[y][x] = z;
+                    if (tile != NULL && !equal) {
+                        if (z < tile->zmin) tile->zmin = z;
+                        tile->dirty = true;
+                    }
+                    if (prepass) continue;
+
+                    if (per_vertex && !vertex_shaded) {
+                        const vec3 position[3] = {t.vx, t.vy, t.vz};
+                        const vec3 normal[3] = {t.nvx, t.nvy, t.nvz};
+                        for (int k = 0; k < 3; k++) {
+                            c3d_vertexshade(d, vlights ? vlights[k] : NULL, normal[k], position[k], m.mtl, baked ? &baked[k] : NULL,
+                                            d->sh_distance > 0.0f ? m.sh : NULL, &corner[0][k], &corner[1][k], &corner[2][k]);
+                        }
+                        vertex_shaded = true;
+                    }
+
+                    // perspective-correct weights of the corners
+                    float b0 = w0 * inv_w[0] / denom;
+                    float b1 = w1 * inv_w[1] / denom;
+                    float b2 = w2 * inv_w[2] / denom;
+
+                    f.position = c3d_vec3bary(t.vx, t.vy, t.vz, b0, b1, b2);
+                    f.normal = c3d_vec3bary(t.nvx, t.nvy, t.nvz, b0, b1, b2);
+                    c3d_vec3normalize(&f.normal);
+                    f.uv = make_vec2(t.uvx.x * b0 + t.uvy.x * b1 + t.uvz.x * b2, t.uvx.y * b0 + t.uvy.y * b1 + t.uvz.y * b2);
+                    if (baked != NULL) light = c3d_vec3bary(baked[0], baked[1], baked[2], b0, b1, b2);
+                    for (int k = 0; per_vertex && k < 3; k++) vertex[k] = c3d_vec3bary(corner[k][0], corner[k][1], corner[k][2], b0, b1, b2);
+                    f.depth = 1.0f / denom;
+                    f.x = x;
+                    f.y = y;
+
+                    vec3 c = fs(f);
+
+                    // the ASCII outputs only need the intensity, and at most a flat mesh color
+                    if (ascii) {
+                        buffer[y][x] = c3d_rampglyph(c, none, none);
+                        colorBuffer[y][x] = mesh_color;
+                        continue;
+                    }
+
+                    buffer[y][x] = C3D_PXCHAR;
+                    colorBuffer[y][x] = RGB(
+                        (int)(c3d_clampf(c.x, 0.0f, 1.0f) * 255.0f),
+                        (int)(c3d_clampf(c.y, 0.0f, 1.0f) * 255.0f),
+                        (int)(c3d_clampf(c.z, 0.0f, 1.0f) * 255.0f)
+                    );
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Transforms, clips and rasterizes the meshes not culled this frame, in
+ * draw order and at their level of detail, like c3d_drawmeshes(),
+ * running vs on each world-space triangle before it is clipped. With
+ * prepass, only their depth is written.
+ */
+template <class VertexShader, class FragmentShader>
+inline void drawmeshes(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer, mat4 matcam,
+                       bool prepass, const VertexShader &vs, const FragmentShader &fs) {
+    for (c3d_intui n = 0; n < d->mesh_count; n++) {
+        int i = d->order.enabled ? (int)d->order.ids[n] : (int)n;
+        mesh &m = d->meshes[i];
+        if (d->mesh_parts && i % d->mesh_parts != d->mesh_part) continue;
+        if (d->occlusion.width && d->occlusion.culled[i]) continue;
+        const tri *tris = m.lod ? m.lods[m.lod - 1].tris : m.tris;
+        int count = m.lod ? m.lods[m.lod - 1].tri_count : m.tri_count;
+
+        // the light cached per vertex is of the mesh's own corners
+        bool per_vertex = (!prepass && m.mtl->illumination_model != 0 && d->lighting == C3D_LIGHTING_VERTEX && !moves(vs));
+        if (per_vertex) c3d_meshweld(&m);
+
+        for (int j = 0; j < count; j++) {
+            tri t = tris[j];
+            vs(*d, m, t);
+
+            tri t_clipped[2];
+            int tri_count = c3d_nearclip(t, matcam, t_clipped);
+            const vec3 *baked = (d->bake.enabled && !prepass) ? &m.baked[j * 3] : NULL;
+
+            for (int c = 0; c < tri_count; c++) {
+                const tri &tc = t_clipped[c];
+
+                #ifdef BACKFACE_CULLING
+                if (c3d_backface(tc, d->camera.pos)) continue;
+                #endif
+
+                vec4 clip[3] = {c3d_mat4vec4(tc.vx, matcam), c3d_mat4vec4(tc.vy, matcam), c3d_mat4vec4(tc.vz, matcam)};
+
+                // all three corners beyond one side of the frustum
+                bool outside = false;
+                for (int axis = 0; axis < 3 && !outside; axis++) {
+                    int below = 0, above = 0;
+                    for (int k = 0; k < 3; k++) {
+                        float v = (axis == 0 ? clip[k].x : axis == 1 ? clip[k].y : clip[k].z) / clip[k].w;
+                        below += v < -1.0f;
+                        above += v > 1.0f;
+                    }
+                    outside = (below == 3 || above == 3);
+                }
+                if (outside) continue;
+
+                // the corners the near plane made are not vertices of the mesh, their baked light is found on the original triangle
+                bool whole = (tri_count == 1 && c3d_triwhole(&tc, &t));
+                const vec3 *corner_baked = baked;
+                vec3 clipped_baked[3];
+                if (baked != NULL && !whole) {
+                    clipped_baked[0] = c3d_bakedat(&t, baked, tc.vx);
+                    clipped_baked[1] = c3d_bakedat(&t, baked, tc.vy);
+                    clipped_baked[2] = c3d_bakedat(&t, baked, tc.vz);
+                    corner_baked = clipped_baked;
+                }
+                c3d_vertexlight *vlights[3] = {NULL, NULL, NULL};
+                if (per_vertex && whole) {
+                    for (int k = 0; k < 3; k++) vlights[k] = &m.vlights[m.vlight_ids[j * 3 + k]];
+                }
+
+                rasterize(d, buffer, colorBuffer, depthBuffer, clip, tc, m, corner_baked, vlights, prepass, fs);
+            }
+        }
+    }
+}
+
+/**
+ * Draws a frame into the buffers with the given shaders, after
+ * c3d_framebegin() like c3d_drawscene(), with a depth pre-pass first if
+ * the display asks for one. Culling, sorting and the levels of detail go
+ * by the meshes' own triangles, before the vertex shader. Unlike
+ * c3d_drawscene() it neither reads nor fills the temporal cache, so a
+ * later c3d_drawscene() starts it again instead of reusing older cells.
+ */
+template <class VertexShader, class FragmentShader>
+inline void drawscene(display *d, wchar_t **buffer, COLORREF **colorBuffer, float **depthBuffer,
+                      const VertexShader &vs, const FragmentShader &fs) {
+    mat4 matcam = c3d_framebegin(d);
+    if (d->depth_prepass) drawmeshes(d, buffer, colorBuffer, depthBuffer, matcam, true, vs, fs);
+    drawmeshes(d, buffer, colorBuffer, depthBuffer, matcam, false, vs, fs);
+    d->temporal.drawn = false;
+}
+
+/**
+ * Updates all buffers like c3d_update(), drawing with the given shaders.
+ */
+template <class VertexShader, class FragmentShader>
+inline void update(display *d, const VertexShader &vs, const FragmentShader &fs) {
+    c3d_runbehaviors(d);
+    wchar_t **buffer;
+    COLORREF **colorBuffer;
+    float **depthBuffer;
+    c3d_framealloc(d, &buffer, &colorBuffer, &depthBuffer);
+    drawscene(d, buffer, colorBuffer, depthBuffer, vs, fs);
+    c3d_framesubmit(d, buffer, colorBuffer, depthBuffer);
+}
+
+template <class FragmentShader>
+inline void update(display *d, const FragmentShader &fs) {
+    update(d, novertex(), fs);
+}
+
+} // namespace c3d
+
+extern "C" {
 #endif
 
 #endif /* C3D_IMPLEMENTATION */
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* C3D_H */
 
 
@@ -8,8 +8,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-int main(void){
+int main(int argc, char **argv){
     window size = c3d_winsize();
     c3d_wininit(size);
 
@@ -24,6 +25,20 @@ int main(void){
                             (vec3){0.0f, 0.0f, 0.0f}    // initial background color
                             );  
 
+#ifdef C3D_NET
+    // "c3d --worker <port> <scene>" renders for a coordinator that
+    // loaded the same scene with a cluster key (see SCENES.md)
+    if (argc == 4 && !strcmp(argv[1], "--worker")){
+        d.worker = true;
+        c3d_loadscene(&d, argv[3]);
+        c3d_workerserve(&d, NULL, (c3d_intus)atoi(argv[2]));
+        return 0;
+    }
+#else
+    (void)argc;
+    (void)argv;
+#endif
+
     while (d.running){
         if (GetAsyncKeyState(VK_ESCAPE) & C3D_KEY_PRESSED) {
             c3d_retgui(&d); // opens the standard rectangular GUI if ESC key is pressed
@@ -32,8 +47,11 @@ int main(void){
         POINT p0;
         GetCursorPos(&p0);
 
-        float fps = c3d_getavgfps();
-        fprintf(stdout, "FPS: %.2f", fps);
+        // only on a console, it would end up inside the frames of a pipe or file
+        if (GetFileType(c3d_outhandle(&d)) == FILE_TYPE_CHAR) {
+            float fps = c3d_getavgfps();
+            fprintf(stdout, "FPS: %.2f", fps);
+        }
 
         c3d_auto_winres(&d, &c); // updates display resolution
 
@@ -43,5 +61,15 @@ int main(void){
         c3d_m_handle(&d, p0);   // handle mouse events 
     }
 
+    // write out the last frames and release whatever the scene started
+    c3d_writerstop(&d);
+    c3d_recstop(&d);
+    c3d_shmclose(&d);
+#ifdef C3D_NET
+    c3d_serverstop(&d);
+    c3d_clusterstop(&d);
+#endif
+    c3d_encpoolstop(&d);
+
     return 0;
 }